@@ -0,0 +1,733 @@
+/*
+ * arbre
+ *
+ * (c) 2011-2012, Alexis Sellier
+ *
+ * aot.c
+ *
+ *   ahead-of-time compiler, from byte-code to C
+ *
+ */
+#include <stdbool.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+
+#include "value.h"
+#include "op.h"
+#include "runtime.h"
+#include "vm.h"
+#include "jit.h"
+#include "aot.h"
+#include "error.h"
+#include "assert.h"
+
+/*
+ * Each clause is compiled into a C function, of type `NativeCode`,
+ * which the threaded dispatcher enters the same way as code compiled
+ * by the JIT. The registers of the clause are C locals, loaded from
+ * the frame on entry, and stored back on exit. Jumps are `goto`s.
+ *
+ * Instructions which aren't compiled, like returns, return to the
+ * interpreter, which runs them and re-enters the function.
+ *
+ * A clause is closed if all of its instructions compile, its pattern
+ * binds its arguments as they are, and it only calls, or tail-calls,
+ * paths of the module which have a single, closed clause. Closed
+ * clauses are also compiled to a function which takes its arguments
+ * and returns its value as C values, without a frame: calls to them
+ * are C calls. Tail calls return to the trampoline of the call,
+ * `AOT_CALL`, which makes them, so that they don't grow the C stack.
+ * Past `AOT_MAXDEPTH` nested direct calls, calls go through the
+ * interpreter again, whose stack isn't bounded.
+ *
+ * Direct calls don't spend credits, as programs compiled ahead of
+ * time run a single process.
+ *
+ * The generated program embeds the byte-code of the module, which it
+ * loads into a VM before swapping in the compiled clauses.
+ */
+
+unsigned AOT_DEPTH = 0;
+
+static VM            *AOT_VM;      /* VM of the program, see `aot_main` */
+static struct module *AOT_MODULE;
+
+/* Write RK operand `x` */
+static void aot_rk(FILE *out, OpArg x)
+{
+	if (ISK(x))
+		fprintf(out, "K[%d].word", INDEXK(x));
+	else
+		fprintf(out, "r%u", x);
+}
+
+/*
+ * Whether the registers which instruction `i` uses are all
+ * within the frame of clause `cl`.
+ */
+static bool aot_fits(struct clause *cl, Instruction i)
+{
+	OpCode o = iOP(i);
+
+	if (AMODE(o) && iA(i) >= (OpArg)cl->nlocals)
+		return false;
+
+	if (OPMODE(o) == ABC || OPMODE(o) == JBC) {
+		OpArg b = iB(i), c = iC(i);
+
+		if (BMODE(o) == OPARG_R && b >= (OpArg)cl->nlocals)
+			return false;
+		if (BMODE(o) == OPARG_K && ! ISK(b) && b >= (OpArg)cl->nlocals)
+			return false;
+		if (CMODE(o) == OPARG_K && ! ISK(c) && c >= (OpArg)cl->nlocals)
+			return false;
+	}
+	return true;
+}
+
+/*
+ * Jump from instruction `n` to instruction `target`. Direct
+ * functions jump back without spending credits.
+ */
+static void aot_goto(FILE *out, struct clause *c, unsigned long n, long target, bool direct)
+{
+	if (target < 0 || target >= (long)c->codelen)
+		fprintf(out, "AOT_EXIT(%ld);\n", target);
+	else if (target <= (long)n && ! direct)
+		fprintf(out, "AOT_BACK(%ld);\n", target);
+	else
+		fprintf(out, "goto L%ld;\n", target);
+}
+
+/*
+ * Fail instruction `i`, at `n`, as its operands aren't numbers: have
+ * its generic handler report it, or report it ourselves in a direct
+ * function, which has no frame to return to.
+ */
+static void aot_generic(FILE *out, Instruction i, unsigned long n, bool direct)
+{
+	if (direct)
+		fprintf(out, "\t\tvm_badarg(%d); /* %s */\n", iOP(i), OPCODE_STRINGS[iOP(i)]);
+	else
+		fprintf(out, "\t\tAOT_GENERIC(%lu);\n", n);
+}
+
+/*
+ * Target of the jump of instruction `n`, if it may jump,
+ * or `-1`. Test instructions skip the following jump if
+ * they hold, and JBC instructions skip `A` instructions
+ * if they don't.
+ */
+static long aot_target(struct clause *c, unsigned long n)
+{
+	Instruction i = c->code[n];
+	OpCode      o = iOP(i);
+
+	if (o == OP_JUMP)
+		return (long)n + 1 + iJ(i);
+	if (o == OP_LOOP)
+		return 0;
+	if (TMODE(o))
+		return (long)n + 2;
+	if (OPMODE(o) == JBC)
+		return (long)n + 1 + iA(i);
+
+	return -1;
+}
+
+/*
+ * Write the condition tested by instruction `i`.
+ */
+static void aot_cond(FILE *out, Instruction i)
+{
+	OpCode o = iOP(i);
+
+	switch (o) {
+		case OP_GT:   case OP_GTNN:
+		case OP_GTJ:  case OP_GTJNN:
+			fputs("AOT_NUMBER(", out), aot_rk(out, iB(i));
+			fputs(") > AOT_NUMBER(", out), aot_rk(out, iC(i));
+			fputs(")", out);
+			break;
+		case OP_GTI:  case OP_GTINN:
+		case OP_GTIJ: case OP_GTIJNN:
+		case OP_LTI:  case OP_LTINN:
+		case OP_LTIJ: case OP_LTIJNN: {
+			bool gt = o == OP_GTI  || o == OP_GTINN ||
+			          o == OP_GTIJ || o == OP_GTIJNN;
+
+			fputs("AOT_NUMBER(", out), aot_rk(out, iB(i));
+			fprintf(out, ") %s %d", gt ? ">" : "<", iSC(i));
+			break;
+		}
+		case OP_EQ:
+		case OP_EQJ:
+		case OP_EQV:
+			aot_rk(out, iB(i));
+			fputs(" == ", out);
+			aot_rk(out, iC(i));
+			break;
+		case OP_EQI:
+		case OP_EQIJ:
+			aot_rk(out, iB(i));
+			fprintf(out, " == AOT_TVNUMBER(%d)", iSC(i));
+			break;
+		default:
+			assert(0);
+	}
+}
+
+/*
+ * Number of arguments clause `c` takes, if its pattern binds them to
+ * its first registers as they are: `0` for a single argument, else
+ * the arity of its tuple pattern. Returns `-1` otherwise.
+ */
+static int aot_params(struct clause *c)
+{
+	struct tvalue *p = &c->pattern;
+
+	if (TV_TAG(*p) == TYPE_ANY)
+		return 0;
+	if (TV_TAG(*p) != TYPE_TUPLE)
+		return -1;
+
+	Tuple *t = TV_TUPLE(*p);
+
+	if (t->arity == 0 || t->arity > AOT_MAXARGS)
+		return -1;
+
+	for (int i = 0; i < t->arity; i++) {
+		if (TV_TAG(t->members[i]) != TYPE_ANY)
+			return -1;
+	}
+	return t->arity;
+}
+
+/* Number of arguments call `i` passes, as in `aot_params` */
+static int aot_nargs(Instruction i)
+{
+	OpCode o = iOP(i);
+
+	return o == OP_CALLN || o == OP_TAILCALLN ? iC(i) : 0;
+}
+
+/*
+ * Index of the path which instruction `n` of clause `c` calls, if it
+ * is a call to a path of the same module, with a single clause, and
+ * its arguments and result are registers of the frame. Returns `-1`
+ * otherwise.
+ */
+static int aot_callee(struct clause *c, unsigned long n)
+{
+	Instruction    i = c->code[n];
+	OpCode         o = iOP(i);
+	struct module *m = c->path->module;
+	struct tvalue *k;
+
+	if (o != OP_CALL && o != OP_CALLN && o != OP_TAILCALL && o != OP_TAILCALLN)
+		return -1;
+
+	if (aot_nargs(i) > 0 ? iA(i) + aot_nargs(i) > c->nlocals : ! aot_fits(c, i))
+		return -1;
+
+	if (! ISK(iB(i)))
+		return -1;
+
+	k = &c->constants[INDEXK(iB(i))];
+
+	if (TV_TYPE(*k) != TYPE_PATHID || strcmp(TV_PATHID(*k)->module, m->name))
+		return -1;
+
+	for (unsigned p = 0; p < m->pathc; p++) {
+		if (! strcmp(m->paths[p]->name, TV_PATHID(*k)->path))
+			return m->paths[p]->nclauses == 1 ? (int)p : -1;
+	}
+	return -1;
+}
+
+/*
+ * Index of the path which instruction `n` of clause `c` calls
+ * directly, if it is closed, and takes its arguments the way
+ * they are passed, or `-1`. `closed` is indexed by path.
+ */
+static int aot_direct(const bool *closed, struct clause *c, unsigned long n)
+{
+	int p = aot_callee(c, n);
+
+	if (p < 0 || ! closed[p])
+		return -1;
+
+	if (aot_params(c->path->module->paths[p]->clauses[0]) != aot_nargs(c->code[n]))
+		return -1;
+
+	return p;
+}
+
+/*
+ * Whether instruction `n` of clause `c` compiles in a closed clause
+ */
+static bool aot_closes(const bool *closed, struct clause *c, unsigned long n)
+{
+	Instruction i = c->code[n];
+	OpCode      o = iOP(i);
+
+	switch (o) {
+		case OP_INVALID: /* Ends the code, isn't run */
+			return true;
+		case OP_RETURN:
+			return ISK(iA(i)) || iA(i) < (OpArg)c->nlocals;
+		case OP_RETK:
+			return true;
+		case OP_CALL:     case OP_CALLN:
+		case OP_TAILCALL: case OP_TAILCALLN:
+			return aot_direct(closed, c, n) >= 0;
+		default:
+			return jit_compiles(o) && aot_fits(c, i) && aot_target(c, n) < (long)c->codelen;
+	}
+}
+
+/*
+ * Find which paths of module `m` have a single, closed clause,
+ * into `closed`. See above.
+ */
+static void aot_closure(struct module *m, bool *closed)
+{
+	bool changed = true;
+
+	for (unsigned p = 0; p < m->pathc; p++)
+		closed[p] = m->paths[p]->nclauses == 1 && aot_params(m->paths[p]->clauses[0]) >= 0;
+
+	/* Clauses may call each other, so they're taken to be closed
+	 * until one of their instructions says otherwise. */
+	while (changed) {
+		changed = false;
+
+		for (unsigned p = 0; p < m->pathc; p++) {
+			struct clause *c = m->paths[p]->clauses[0];
+
+			for (unsigned long n = 0; closed[p] && n < c->codelen; n++) {
+				if (! aot_closes(closed, c, n))
+					closed[p] = false, changed = true;
+			}
+		}
+	}
+}
+
+/*
+ * Write call instruction `n` of clause `c`, to the closed clause of
+ * path `p`. Functions with a frame leave calls which are too deep to
+ * the interpreter, direct functions make them through it.
+ */
+static void aot_call(FILE *out, struct clause *c, unsigned long n, int p, bool direct)
+{
+	Instruction i     = c->code[n];
+	OpCode      o     = iOP(i);
+	int         nargs = aot_nargs(i);
+	bool        tail  = o == OP_TAILCALL || o == OP_TAILCALLN;
+	const char *to    = tail ? "t->" : "u.";
+
+	if (! tail && ! direct)
+		fprintf(out, "\tif (AOT_DEPTH >= AOT_MAXDEPTH)\n\t\tAOT_GENERIC(%lu);\n", n);
+
+	fputs("\t{\n", out);
+
+	if (tail)
+		fprintf(out, "\t\tt->fn = direct_%d;\n", p);
+	else
+		fprintf(out, "\t\tstruct aottail u = { direct_%d, K };\n\n", p);
+
+	if (nargs == 0) {
+		fprintf(out, "\t\t%sargs[0] = ", to);
+		aot_rk(out, iC(i));
+		fputs(";\n", out);
+	}
+	for (int a = 0; a < nargs; a++)
+		fprintf(out, "\t\t%sargs[%d] = r%u;\n", to, a, iA(i) + a);
+
+	if (tail)
+		fputs("\t\treturn 0;\n", out);
+	else if (direct)
+		fprintf(out, "\t\tif (AOT_DEPTH < AOT_MAXDEPTH)\n\t\t\tAOT_CALL(u, r%u);\n"
+		             "\t\telse\n\t\t\tr%u = aot_interpret(%d, u.args, %d);\n",
+		        iA(i), iA(i), p, nargs);
+	else
+		fprintf(out, "\t\tAOT_CALL(u, r%u);\n", iA(i));
+
+	fputs("\t}\n", out);
+}
+
+/*
+ * Write instruction `n` of clause `c`, for a function with a frame,
+ * or a `direct` function. See `aot_clause` and `aot_closed`.
+ */
+static void aot_instruction(FILE *out, const bool *closed, struct clause *c, unsigned long n, bool direct)
+{
+	Instruction i = c->code[n];
+	OpCode      o = iOP(i);
+	int         p;
+
+	if ((p = aot_direct(closed, c, n)) >= 0) {
+		aot_call(out, c, n, p, direct);
+		return;
+	}
+
+	switch (o) {
+		case OP_INVALID:
+			return;
+
+		case OP_RETURN:
+			fputs("\treturn ", out), aot_rk(out, iA(i)), fputs(";\n", out);
+			return;
+
+		case OP_RETK:
+			fprintf(out, "\treturn K[%u].word;\n", iD(i));
+			return;
+
+		case OP_MOVE:
+			fprintf(out, "\tr%u = r%u;\n", iA(i), iB(i));
+			return;
+
+		case OP_LOADK:
+			fprintf(out, "\tr%u = K[%u].word;\n", iA(i), iD(i));
+			return;
+
+		case OP_JUMP:
+		case OP_LOOP:
+			fputs("\t", out);
+			aot_goto(out, c, n, aot_target(c, n), direct);
+			return;
+
+		case OP_ADD:   case OP_ADDNN:
+		case OP_SUB:   case OP_SUBNN:
+			if (o == OP_ADD || o == OP_SUB) {
+				fputs("\tif (! AOT_ISNUMBER(", out), aot_rk(out, iB(i));
+				fputs(") || ! AOT_ISNUMBER(", out), aot_rk(out, iC(i));
+				fputs("))\n", out), aot_generic(out, i, n, direct);
+			}
+			fprintf(out, "\tr%u = AOT_TVNUMBER((uint32_t)AOT_NUMBER(", iA(i));
+			aot_rk(out, iB(i));
+			fprintf(out, ") %c (uint32_t)AOT_NUMBER(", o == OP_ADD || o == OP_ADDNN ? '+' : '-');
+			aot_rk(out, iC(i));
+			fputs("));\n", out);
+			return;
+
+		case OP_ADDI:  case OP_ADDINN:
+		case OP_SUBI:  case OP_SUBINN:
+			if (o == OP_ADDI || o == OP_SUBI) {
+				fputs("\tif (! AOT_ISNUMBER(", out), aot_rk(out, iB(i));
+				fputs("))\n", out), aot_generic(out, i, n, direct);
+			}
+			fprintf(out, "\tr%u = AOT_TVNUMBER((uint32_t)AOT_NUMBER(", iA(i));
+			aot_rk(out, iB(i));
+			fprintf(out, ") %c (uint32_t)%d);\n", o == OP_ADDI || o == OP_ADDINN ? '+' : '-', iSC(i));
+			return;
+
+		default:
+			break;
+	}
+
+	/* Comparisons of numbers check their operands first */
+	switch (o) {
+		case OP_GT:
+		case OP_GTJ:
+			fputs("\tif (! AOT_ISNUMBER(", out), aot_rk(out, iB(i));
+			fputs(") || ! AOT_ISNUMBER(", out), aot_rk(out, iC(i));
+			fputs("))\n", out), aot_generic(out, i, n, direct);
+			break;
+		case OP_GTI:
+		case OP_LTI:
+		case OP_GTIJ:
+		case OP_LTIJ:
+			fputs("\tif (! AOT_ISNUMBER(", out), aot_rk(out, iB(i));
+			fputs("))\n", out), aot_generic(out, i, n, direct);
+			break;
+		default:
+			break;
+	}
+
+	/* Test instructions fall through to their jump if they fail,
+	 * JBC instructions to the next instruction if they pass. */
+	fprintf(out, TMODE(o) ? "\tif (" : "\tif (! (");
+	aot_cond(out, i);
+	fprintf(out, TMODE(o) ? ")\n\t\t" : "))\n\t\t");
+	aot_goto(out, c, n, aot_target(c, n), direct);
+}
+
+/*
+ * Write clause `c` as function `name`, and the table of the
+ * instructions it compiles. Returns `false` if there are none.
+ */
+static bool aot_clause(FILE *out, const bool *closed, struct clause *c, const char *name)
+{
+	bool *compiled = calloc(c->codelen, sizeof(bool)),
+	     *labelled = calloc(c->codelen, sizeof(bool));
+	bool  any      = false;
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		Instruction i = c->code[n];
+		OpCode      o = iOP(i);
+
+		if (jit_compiles(o) && aot_fits(c, i))
+			compiled[n] = labelled[n] = any = true;
+
+		/* Tail calls replace the frame, so they're left to the interpreter */
+		if ((o == OP_CALL || o == OP_CALLN) && aot_direct(closed, c, n) >= 0)
+			compiled[n] = labelled[n] = any = true;
+	}
+
+	for (unsigned long n = 0; any && n < c->codelen; n++) {
+		long target = aot_target(c, n);
+
+		if (compiled[n] && target >= 0 && target < (long)c->codelen)
+			labelled[target] = true;
+	}
+
+	if (! any)
+		goto done;
+
+	fprintf(out, "/* %s/%s */\n", c->path->module->name, c->path->name);
+	fprintf(out, "static unsigned long %s(struct tvalue *R, struct tvalue *K,\n", name);
+	fprintf(out, "\tuint16_t *credits, unsigned long n)\n{\n");
+	fprintf(out, "\tunsigned long ret;\n");
+
+	for (int r = 0; r < c->nlocals; r++)
+		fprintf(out, "\tuint64_t r%d = R[%d].word;\n", r, r);
+
+	fprintf(out, "\n\t(void)K, (void)credits;\n\n\tswitch (n) {\n");
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		if (compiled[n])
+			fprintf(out, "\t\tcase %lu: goto L%lu;\n", n, n);
+	}
+	fprintf(out, "\t\tdefault: AOT_EXIT(n);\n\t}\n");
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		if (labelled[n])
+			fprintf(out, "L%lu: /* %s */\n", n, OPCODE_STRINGS[iOP(c->code[n])]);
+
+		if (compiled[n])
+			aot_instruction(out, closed, c, n, false);
+		else
+			fprintf(out, "\tAOT_EXIT(%lu);\n", n);
+	}
+
+	fprintf(out, "exit:\n");
+
+	for (int r = 0; r < c->nlocals; r++)
+		fprintf(out, "\tR[%d].word = r%d;\n", r, r);
+
+	fprintf(out, "\treturn ret;\n}\n\n");
+
+	fprintf(out, "static const bool %s_compiled[] = {", name);
+
+	for (unsigned long n = 0; n < c->codelen; n++)
+		fprintf(out, "%s%s%d", n ? "," : "", n % 24 ? " " : "\n\t", compiled[n]);
+
+	fprintf(out, "\n};\n\n");
+
+done:
+	free(compiled);
+	free(labelled);
+
+	return any;
+}
+
+/*
+ * Write the closed clause `c` of path `p` as function `direct_<p>`,
+ * which is called directly, with its arguments in `a`. See above.
+ */
+static void aot_closed(FILE *out, const bool *closed, struct clause *c, int p)
+{
+	bool *labelled = calloc(c->codelen, sizeof(bool));
+	int   nparams  = aot_params(c);
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		long target = aot_target(c, n);
+
+		if (target >= 0)
+			labelled[target] = true;
+	}
+
+	fprintf(out, "/* %s/%s, called directly */\n", c->path->module->name, c->path->name);
+	fprintf(out, "static uint64_t direct_%d(uint64_t *a, struct aottail *t)\n{\n", p);
+	fprintf(out, "\tstruct tvalue *K = t->K;\n");
+
+	for (int r = 0; r < c->nlocals; r++) {
+		if (r < (nparams ? nparams : 1))
+			fprintf(out, "\tuint64_t r%d = a[%d];\n", r, r);
+		else
+			fprintf(out, "\tuint64_t r%d = 0;\n", r);
+	}
+	fprintf(out, "\n\t(void)K;\n\n");
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		if (labelled[n])
+			fprintf(out, "L%lu: /* %s */\n", n, OPCODE_STRINGS[iOP(c->code[n])]);
+
+		aot_instruction(out, closed, c, n, true);
+	}
+	fprintf(out, "}\n\n");
+
+	free(labelled);
+}
+
+/*
+ * Write a C program which runs module `m`, with its clauses
+ * compiled to C. `code` is the byte-code of the module, of
+ * `size` bytes, as it was before `m` was loaded from it.
+ */
+void aot_generate(FILE *out, struct module *m, const uint8_t *code, size_t size)
+{
+	char name[64];
+	int  nclauses = 0;
+
+	fprintf(out, "/*\n * Generated by `arbre aot` from module `%s`.\n */\n", m->name);
+	fprintf(out, "#include <stdbool.h>\n"
+	             "#include <inttypes.h>\n"
+	             "#include <stdio.h>\n"
+	             "#include <stddef.h>\n\n"
+	             "#include \"value.h\"\n"
+	             "#include \"op.h\"\n"
+	             "#include \"runtime.h\"\n"
+	             "#include \"vm.h\"\n"
+	             "#include \"jit.h\"\n"
+	             "#include \"aot.h\"\n\n");
+
+	fprintf(out, "static uint8_t CODE[] = {");
+
+	for (size_t b = 0; b < size; b++)
+		fprintf(out, "%s%s0x%02x", b ? "," : "", b % 12 ? " " : "\n\t", code[b]);
+
+	fprintf(out, "\n};\n\n");
+
+	bool *compiled = malloc(sizeof(bool) * (m->pathc ? m->pathc : 1) * 256),
+	     *closed   = malloc(sizeof(bool) * (m->pathc ? m->pathc : 1));
+
+	aot_closure(m, closed);
+
+	for (unsigned p = 0; p < m->pathc; p++) {
+		if (closed[p])
+			fprintf(out, "static uint64_t direct_%u(uint64_t *a, struct aottail *t);\n", p);
+	}
+	fprintf(out, "\n");
+
+	for (unsigned p = 0; p < m->pathc; p++) {
+		if (closed[p])
+			aot_closed(out, closed, m->paths[p]->clauses[0], p);
+	}
+
+	for (unsigned p = 0; p < m->pathc; p++) {
+		for (int i = 0; i < m->paths[p]->nclauses; i++) {
+			sprintf(name, "clause_%u_%d", p, i);
+
+			if ((compiled[p * 256 + i] = aot_clause(out, closed, m->paths[p]->clauses[i], name)))
+				nclauses ++;
+		}
+	}
+
+	fprintf(out, "static const struct aotclause CLAUSES[] = {\n");
+
+	for (unsigned p = 0; p < m->pathc; p++) {
+		for (int i = 0; i < m->paths[p]->nclauses; i++) {
+			if (compiled[p * 256 + i])
+				fprintf(out, "\t{ %u, %d, clause_%u_%d, clause_%u_%d_compiled },\n", p, i, p, i, p, i);
+		}
+	}
+	fprintf(out, "\t{ 0, 0, NULL, NULL }\n};\n\n");
+
+	fprintf(out, "int main(void)\n{\n\treturn aot_main(\"");
+
+	for (const char *s = m->name; *s; s++)
+		fprintf(out, (*s == '"' || *s == '\\') ? "\\%c" : "%c", *s);
+
+	fprintf(out, "\", CODE, CLAUSES, %d);\n}\n", nclauses);
+
+	free(compiled);
+	free(closed);
+}
+
+/*
+ * Run the `main` path of module `module`, loaded from byte-code `code`,
+ * with the `n` clauses compiled ahead of time in `clauses`. Returns the
+ * number it evaluates to.
+ */
+int aot_main(const char *module, uint8_t *code, const struct aotclause *clauses, unsigned n)
+{
+#if defined(VM_THREADED)
+	VM            *v = vm();
+	struct module *m;
+	struct tvalue *ret;
+
+	/* Clauses are compiled ahead of time, not when they are hot */
+	v->dispatch = DISPATCH_THREADED;
+	v->jit      = false;
+
+	vm_open(v, module, code);
+	vm_link(v);
+
+	m = vm_module(v, module);
+
+	AOT_VM     = v;
+	AOT_MODULE = m;
+
+	for (unsigned i = 0; i < n; i++) {
+		struct native *native = malloc(sizeof(*native));
+
+		native->code     = clauses[i].code;
+		native->compiled = clauses[i].compiled;
+
+		vm_native(v, m->paths[clauses[i].path]->clauses[clauses[i].clause], native);
+	}
+
+	ret = vm_run(v, module, "main");
+
+	return TV_NUMBER(*ret);
+#else
+	error(1, 0, "ahead-of-time compiled code needs the threaded dispatcher");
+	return 1;
+#endif
+}
+
+/*
+ * Call the only clause of path `path` of the module with `args`, or
+ * `args[0]` if `nargs` is zero, in the interpreter, on a process of its
+ * own. Direct functions call through it once they are too deep in the
+ * C stack.
+ */
+uint64_t aot_interpret(unsigned path, uint64_t *args, int nargs)
+{
+	struct path   *p    = AOT_MODULE->paths[path];
+	Process       *self = AOT_VM->proc,
+	              *proc;
+	struct tvalue  arg[AOT_MAXARGS],
+	              *ret;
+	uint64_t       word;
+
+	for (int i = 0; i < (nargs ? nargs : 1); i++)
+		arg[i].word = args[i];
+
+	/* Park the calling process, so that the scheduler
+	 * doesn't switch back to it midway. */
+	self->flags &= ~(PROC_READY);
+
+	proc = vm_spawn(AOT_VM, AOT_MODULE, p);
+
+	if (vm_callpath(AOT_VM, proc, p, arg, nargs) < 0)
+		error(1, 0, "no matches for %s/%s", AOT_MODULE->name, p->name);
+
+	ret  = vm_execute(AOT_VM, proc);
+	word = ret->word;
+
+	AOT_VM->nprocs --; /* `proc` was spawned last */
+	AOT_VM->proc = self;
+	self->flags |= PROC_READY;
+
+	stack_free(proc->stack);
+	free(proc);
+	free(ret);
+
+	return word;
+}
@@ -0,0 +1,75 @@
+/*
+ * arbre
+ *
+ * (c) 2011-2012, Alexis Sellier
+ *
+ * aot.h
+ *
+ */
+#define AOT_MAXARGS   16    /* Arguments of a direct call, at most */
+#define AOT_MAXDEPTH  1024  /* Nested direct calls, before calls go through the interpreter */
+
+struct aottail;
+
+typedef uint64_t (*AotDirect)(uint64_t *args, struct aottail *t);
+
+/*
+ * Direct call of a clause, see `AOT_CALL`. The callee makes a tail
+ * call by setting `fn` and `args` to the clause it calls and its
+ * arguments, and returning.
+ */
+struct aottail {
+	AotDirect      fn;
+	struct tvalue *K;
+	uint64_t       args[AOT_MAXARGS];
+};
+
+extern unsigned AOT_DEPTH;  /* Direct calls in progress */
+
+/*
+ * Native code of clause `clause` of path `path` of a module,
+ * compiled ahead of time.
+ */
+struct aotclause {
+	unsigned     path;
+	unsigned     clause;
+	NativeCode   code;
+	const bool  *compiled;
+};
+
+/*
+ * Helpers of generated code, on the words of tagged values
+ */
+#define AOT_NUMBER(w)    ((int32_t)(uint32_t)((w) >> TV_TAGBITS))
+#define AOT_ISNUMBER(w)  (((w) & TYPE_MASK) == TYPE_NUMBER)
+#define AOT_TVNUMBER(n)  (TVNUMBER(n).word)
+
+/* Return to the interpreter, at instruction `n` */
+#define AOT_EXIT(n)     do { ret = (unsigned long)(n) << 1;     goto exit; } while (0)
+
+/* Return to the interpreter, to run instruction `n` with its generic handler */
+#define AOT_GENERIC(n)  do { ret = (unsigned long)(n) << 1 | 1; goto exit; } while (0)
+
+/* Jump back to instruction `n`, spending a credit */
+#define AOT_BACK(n) \
+	do { \
+		if (-- *credits == 0) \
+			AOT_EXIT(n); \
+		goto L##n; \
+	} while (0)
+
+/* Call `t.fn` with `t.args` into `w`, then the clauses it tail-calls in turn */
+#define AOT_CALL(t, w) \
+	do { \
+		AOT_DEPTH ++; \
+		do { \
+			AotDirect fn_ = (t).fn; \
+			(t).fn = NULL; \
+			(w) = fn_((t).args, &(t)); \
+		} while ((t).fn); \
+		AOT_DEPTH --; \
+	} while (0)
+
+void      aot_generate  (FILE *out, struct module *m, const uint8_t *code, size_t size);
+int       aot_main      (const char *module, uint8_t *code, const struct aotclause *clauses, unsigned n);
+uint64_t  aot_interpret (unsigned path, uint64_t *args, int nargs);
@@ -10,12 +10,15 @@
  */
 #include  <unistd.h>
 #include  <stdlib.h>
+#include  <string.h>
 #include  <stdint.h>
 #include  <assert.h>
 #include  <stdbool.h>
 
 #include  "value.h"
 
+size_t strnlen(const char *, size_t);
+
 struct tvalue bin_readtuple(uint8_t **bp);
 
 struct tvalue bin_readnode(uint8_t **bp)
@@ -29,29 +32,22 @@ struct tvalue bin_readnode(uint8_t **bp)
 			tv = bin_readtuple(bp);
 			break;
 		case TYPE_NUMBER:
-			tv = (struct tvalue){
-				.t = TYPE_NUMBER,
-				.v = (Value){
-					.number = *(int *)*bp
-				}
-			};
+			tv = TVNUMBER(*(int *)*bp);
 			*bp += sizeof(int);
 			break;
 		case TYPE_ATOM: {
 			uint8_t len = *(*bp)++;
 
-			tv = (struct tvalue){
-				.t = TYPE_ATOM,
-				.v = (Value){
-					 // Alternatively `strndup(*bp, len)`
-					.atom = (const char *)*bp
-				}
-			};
+			/* `len` may or may not account for a trailing NUL */
+			const char *name = (const char *)*bp;
+			size_t      n    = strnlen(name, len);
+
+			tv = TVPTR(TYPE_ATOM, atom_intern(name, n));
 			*bp += len;
 			break;
 		}
 		case TYPE_ANY:
-			tv = (struct tvalue){ .t = TYPE_ANY };
+			tv = TV(TYPE_ANY, 0);
 			break;
 		default:
 			assert(0);
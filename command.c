@@ -15,8 +15,11 @@
 #include  <assert.h>
 #include  <errno.h>
 #include  <sys/stat.h>
+#include  <sys/wait.h>
+#include  <unistd.h>
 
 char *strdup(const char *);
+int   mkstemp(char *);
 
 #include  "arbre.h"
 #include  "scanner.h"
@@ -28,15 +31,19 @@ char *strdup(const char *);
 #include  "command.h"
 #include  "error.h"
 #include  "reduce.h"
+#include  "jit.h"
+#include  "aot.h"
 #include  "limits.h"
 
 static int   command_build(Command *cmd);
 static int   command_run(Command *cmd);
 static int   command_test(Command *cmd);
+static int   command_aot(Command *cmd);
 static bool  command_parseopt(Command *cmd, char opt, char *arg);
 static void  command_parselopt(Command *cmd, char *arg);
 
-static uint8_t *freadbin(FILE *fp, const char *path);
+static uint8_t *freadbin(FILE *fp, size_t *size);
+static char    *command_module(const char *path);
 
 struct {
 	CommandOption  type;
@@ -46,6 +53,8 @@ struct {
 	{CMDOPT_AST,     "ast"},
 	{CMDOPT_PRE,     "pre"},
 	{CMDOPT_V,       "verbose"},
+	{CMDOPT_STATS,   "stats"},
+	{CMDOPT_NOJIT,   "no-jit"},
 	{0, NULL}
 };
 
@@ -57,6 +66,7 @@ struct {
 	{CMD_BUILD,    "build",   command_build},
 	{CMD_RUN,      "run",     command_run},
 	{CMD_TEST,     "test",    command_test},
+	{CMD_AOT,      "aot",     command_aot},
  // {CMD_VERSION,  "version", command_version},
 	{0, NULL, NULL}
 };
@@ -68,6 +78,7 @@ const char *CMD_USAGE =
 	"    build      compile modules and dependencies\n"
 	"    clean      remove .arb.bin files\n"
 	"    run        compile and run\n"
+	"    aot        compile to a native executable, through C\n"
 	"\n"
 	"options:\n"
 	"    -v         verbose\n"
@@ -75,7 +86,13 @@ const char *CMD_USAGE =
 	"    --version  print version and exit\n"
 	"    --ast      print the AST\n"
 	"    --pre      only run the pre-processor phase\n"
-	"    --syntax   only run the syntax checking phase\n";
+	"    --syntax   only run the syntax checking phase\n"
+	"    --stats    print run-time statistics of the VM\n"
+	"    --no-jit   don't compile hot clauses to native code\n"
+	"    -O0|-O1|-O2\n"
+	"               optimization level, -O1 by default\n"
+	"    --dispatch=switch|threaded\n"
+	"               select the instruction dispatch method\n";
 
 /*
  * Command allocator/initialzer
@@ -83,15 +100,17 @@ const char *CMD_USAGE =
 Command *command(int argv, char *argc[])
 {
 	Command *c = malloc(sizeof(*c));
-			 c->type    = 0;
-			 c->options = 0;
-			 c->inputs  = malloc(sizeof(char*) * argv);
-			 c->inputc  = 0;
-			 c->argv    = argv;
-			 c->argc    = argc;
-			 c->output  = NULL;
-			 c->fp      = NULL;
-			 c->f       = NULL;
+			 c->type     = 0;
+			 c->options  = 0;
+			 c->inputs   = malloc(sizeof(char*) * argv);
+			 c->inputc   = 0;
+			 c->argv     = argv;
+			 c->argc     = argc;
+			 c->output   = NULL;
+			 c->dispatch = DISPATCH_THREADED;
+			 c->optimize = 1;
+			 c->fp       = NULL;
+			 c->f        = NULL;
 	return   c;
 }
 
@@ -133,11 +152,16 @@ int command_exec(Command *cmd)
 						case '\0':
 							// TODO: Read from STDIN
 							break;
+						case 'v': /* Takes no argument */
+							cmd->options |= CMDOPT_V;
+							break;
 						default: {
 							char opt = cmd->argc[i][1],
 								*arg = NULL;
 
-							if (i < cmd->argv - 1 && cmd->argc[i + 1][0] != '-') {
+							if (cmd->argc[i][2] != '\0') { /* Attached, eg. `-O2` */
+								arg = &cmd->argc[i][2];
+							} else if (i < cmd->argv - 1 && cmd->argc[i + 1][0] != '-') {
 								arg = cmd->argc[++i];
 							}
 							command_parseopt(cmd, opt, arg);
@@ -167,6 +191,11 @@ static bool command_parseopt(Command *cmd, char opt, char *arg)
 		case 'o':
 			cmd->output = arg;
 			return true;
+		case 'O':
+			if (! arg || strlen(arg) != 1 || arg[0] < '0' || arg[0] > '2')
+				error(1, 0, "unknown optimization level `%s`", arg ? arg : "");
+			cmd->optimize = arg[0] - '0';
+			return true;
 		default:
 			break;
 	}
@@ -180,6 +209,22 @@ static bool command_parseopt(Command *cmd, char opt, char *arg)
  */
 static void command_parselopt(Command *cmd, char *arg)
 {
+	char *val = strchr(arg, '=');
+
+	if (val) { /* Option with value, eg. `--dispatch=switch` */
+		*val++ = '\0';
+
+		if (! strcmp(arg, "dispatch")) {
+			if (! strcmp(val, "switch"))
+				cmd->dispatch = DISPATCH_SWITCH;
+			else if (! strcmp(val, "threaded"))
+				cmd->dispatch = DISPATCH_THREADED;
+			else
+				error(1, 0, "unknown dispatch method `%s`", val);
+		}
+		return;
+	}
+
 	for (int i = 0; CMD_OPTIONS[i].type; i++) {
 		if (strcmp(CMD_OPTIONS[i].name, arg) == 0) {
 			cmd->options |= CMD_OPTIONS[i].type;
@@ -213,29 +258,31 @@ static int command_run(Command *c)
 
 	command_build(c);
 
-	const char *path = c->inputs[0];
-
-	char *module = strdup(path);
-
-	for (int i = 0; i < strlen(module); i++) {
-		if (module[i] == '.') {
-			module[i] = '\0';
-			break;
-		}
-	}
+	char *module = command_module(c->inputs[0]);
 
 	if (c->options & CMDOPT_SYNTAX)
 		return 0;
 
-	uint8_t *code = freadbin(c->fp, module);
+	uint8_t *code = freadbin(c->fp, NULL);
 
 	VM *v = vm();
+
+#if defined(VM_THREADED)
+	v->dispatch = c->dispatch;
+#endif
+	/* Native code is entered from the threaded dispatcher only */
+	v->jit = v->jit && v->dispatch == DISPATCH_THREADED && ! (c->options & CMDOPT_NOJIT);
+
 	vm_open(v, module, code);
+	vm_link(v);
 
 	ret = vm_run(v, module, "main");
 
-	assert(ret->t == TYPE_NUMBER);
-	return ret->v.number;
+	if (c->options & CMDOPT_STATS)
+		vm_stats(v, stderr);
+
+	assert(TV_TYPE(*ret) == TYPE_NUMBER);
+	return TV_NUMBER(*ret);
 }
 
 #ifdef DEBUG
@@ -281,13 +328,15 @@ static int command_build(Command *c)
 		if (p->errors > 0)
 			return 1;
 
-		reduce(tree);
+		reduce(tree, c->optimize, c->options & CMDOPT_V);
 
 		if (c->options & CMDOPT_SYNTAX)
 			break;
 
 		Generator *g = generator(tree, src);
 
+		g->optimize = c->optimize;
+
 		mkdir(ARBRE_DIR,     0755);
 		mkdir(ARBRE_BIN_DIR, 0755);
 
@@ -302,21 +351,175 @@ static int command_build(Command *c)
 }
 
 /*
- * Read an arb.bin file
+ * 'aot' command
+ *
+ * Compile a module to C, see `aot.c`, and the C to an executable
+ * with the system compiler, `$CC` or `cc`. The executable is linked
+ * against `bin/libarbre.a`, which is looked up along with the headers
+ * in `$ARBRE_HOME`, or else next to the `arbre` executable.
  */
-static uint8_t *freadbin(FILE *fp, const char *module)
+static int command_aot(Command *c)
+{
+	static char home[PATH_MAX], src[PATH_MAX], tmp[PATH_MAX],
+	            lib[PATH_MAX + sizeof("/bin/libarbre.a")];
+
+	if (c->inputc > 1)
+		error(1, 0, "more than one input file was given");
+
+	if (c->inputc == 0)
+		puts("usage: arbre aot <module> [-o <executable>]"), exit(0);
+
+	char       *module = command_module(c->inputs[0]);
+	const char *exe    = c->output ? c->output : module;
+	const char *cc     = getenv("CC") ? getenv("CC") : "cc";
+	char       *bin;
+
+	if (getenv("ARBRE_HOME")) {
+		snprintf(home, sizeof(home), "%s", getenv("ARBRE_HOME"));
+	} else if (strchr(c->argc[0], '/')) {
+		snprintf(home, sizeof(home), "%s", c->argc[0]);
+
+		*strrchr(home, '/') = '\0'; /* Strip `arbre` */
+
+		if ((bin = strrchr(home, '/')))
+			*bin = '\0';
+		else
+			strcpy(home, ".");
+	} else {
+		error(1, 0, "couldn't find the arbre library, set ARBRE_HOME");
+	}
+
+	/* The byte-code is only needed until the C is generated. It is
+	 * kept next to the executable, under a name of its own, so that
+	 * concurrent builds don't share it. */
+	snprintf(tmp, sizeof(tmp), "%s.bin.XXXXXX", exe);
+
+	int fd = mkstemp(tmp);
+
+	if (fd < 0)
+		error(1, errno, "couldn't create file %s for writing", tmp);
+
+	close(fd);
+	c->output = tmp;
+
+	if (command_build(c) || (c->options & CMDOPT_SYNTAX)) {
+		remove(tmp);
+		return 1;
+	}
+
+	size_t   size;
+	uint8_t *code = freadbin(c->fp, &size),
+	        *copy = malloc(size);
+
+	remove(tmp);
+
+	memcpy(copy, code, size);
+
+	VM *v = vm();
+
+	vm_open(v, module, copy);
+
+	snprintf(src, sizeof(src), "%s.c", exe);
+
+	FILE *out = fopen(src, "w");
+
+	if (! out)
+		error(1, errno, "couldn't create file %s for writing", src);
+
+	aot_generate(out, vm_module(v, module), code, size);
+	fclose(out);
+
+	snprintf(lib, sizeof(lib), "%s/bin/libarbre.a", home);
+
+	/* `CC` may carry flags of its own, as in `cc -m32` */
+	char *argv[64], *ccs = strdup(cc);
+	int   argc = 0;
+
+	for (char *w = strtok(ccs, " \t"); w && argc < 48; w = strtok(NULL, " \t"))
+		argv[argc++] = w;
+
+	if (argc == 0)
+		error(1, 0, "no C compiler was given in CC");
+
+	argv[argc++] = "-std=c11";
+	argv[argc++] = "-O2";
+	argv[argc++] = "-I";
+	argv[argc++] = home;
+	argv[argc++] = "-o";
+	argv[argc++] = (char *)exe;
+	argv[argc++] = src;
+	argv[argc++] = lib;
+	argv[argc]   = NULL;
+
+	if (c->options & CMDOPT_V) {
+		for (int i = 0; i < argc; i++)
+			printf(i ? " %s" : "%s", argv[i]);
+		putchar('\n');
+	}
+	fflush(stdout);
+
+	int   status;
+	pid_t pid = fork();
+
+	if (pid < 0)
+		error(1, errno, "couldn't run %s", argv[0]);
+
+	if (pid == 0) {
+		execvp(argv[0], argv);
+		error(127, errno, "couldn't run %s", argv[0]);
+	}
+
+	if (waitpid(pid, &status, 0) < 0)
+		error(1, errno, "couldn't wait for %s", argv[0]);
+
+	/* The C source is only kept for inspection, with `-v` */
+	if (! (c->options & CMDOPT_V))
+		remove(src);
+
+	free(ccs);
+
+	if (! WIFEXITED(status) || WEXITSTATUS(status) != 0)
+		error(1, 0, "couldn't compile %s", src);
+
+	return 0;
+}
+
+/*
+ * Name of the module in file `path`, which is its path
+ * without extension.
+ */
+static char *command_module(const char *path)
+{
+	char *module = strdup(path);
+
+	for (int i = 0; i < strlen(module); i++) {
+		if (module[i] == '.') {
+			module[i] = '\0';
+			break;
+		}
+	}
+	return module;
+}
+
+/*
+ * Read an arb.bin file, of `size` bytes if not `NULL`
+ */
+static uint8_t *freadbin(FILE *fp, size_t *size)
 {
 	uint8_t    *buffer;
-	size_t      size;
+	size_t      len;
 
 	fseek(fp, 0L, SEEK_END);
 
-	size = ftell(fp);
+	len = ftell(fp);
 	rewind(fp);
 
-	buffer = malloc(size);
+	buffer = malloc(len);
+
+	fread(buffer, sizeof(uint8_t), len, fp);
 
-	fread(buffer, sizeof(uint8_t), size, fp);
+	if (size)
+		*size = len;
 
 	return buffer;
 }
@@ -8,13 +8,16 @@
 typedef enum {
 	CMD_BUILD = 1,
 	CMD_RUN,
-	CMD_TEST
+	CMD_TEST,
+	CMD_AOT
 } CommandType;
 
 struct Command {
 	CommandType  type;
 	int          options;
 	char        *output; // TODO: This doesn't belong here
+	Dispatch     dispatch;
+	int          optimize;
 	char       **inputs;
 	int          inputc;
 	int          argv;
@@ -29,7 +32,9 @@ typedef enum {
 	CMDOPT_SYNTAX = 1,
 	CMDOPT_PRE    = 1 << 1,
 	CMDOPT_AST    = 1 << 2,
-	CMDOPT_V      = 1 << 3
+	CMDOPT_V      = 1 << 3,
+	CMDOPT_STATS  = 1 << 4,
+	CMDOPT_NOJIT  = 1 << 5
 } CommandOption;
 
 Command  *command(int argv, char *argc[]);
@@ -17,6 +17,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <assert.h>
@@ -35,6 +36,9 @@ char  *strndup(const char *, size_t);
 #include "report.h"
 #undef  REPORT_GEN
 
+/* Minimum number of literal clauses for a select to use a `switch` */
+#define SWITCH_MIN  8
+
 static int    gen_block   (Generator *, struct node *);
 static int    gen_match   (Generator *, struct node *);
 static int    gen_bind    (Generator *, struct node *);
@@ -55,8 +59,14 @@ static int    gen_apply   (Generator *, struct node *);
 static int    gen_access  (Generator *, struct node *);
 static int    gen_clause  (Generator *, struct node *);
 static int    gen         (Generator *, Instruction);
+static void   gen_fuse    (Generator *, ClauseEntry *);
+static void   gen_specialize(Generator *, ClauseEntry *);
+static void   gen_escape  (Generator *, ClauseEntry *, int);
+static void   gen_alloc   (Generator *, ClauseEntry *, int);
+static unsigned long gen_peephole(Generator *, ClauseEntry *, int);
 
 static void dump_path(PathEntry *p, FILE *out);
+static void dump_constant(struct tvalue *tval, FILE *out);
 static void gen_locals(Generator *g, struct node *n);
 
 int (*OP_GENERATORS[])(Generator *, struct node *) = {
@@ -113,10 +123,19 @@ Generator *generator(Tree *tree, struct source *source)
 	g->source    = source;
 	g->module    = source_module(source);
 	g->block     = NULL;
+	g->tail      = NULL;
 	g->slot      = 1;
 	g->path      = NULL;
 	g->paths     = calloc(256, sizeof(PathEntry*));
 	g->pathsn    = 0;
+	g->ktable    = symtab(1024);
+	g->kheader   = NULL;
+	g->kindex    = 0;
+	g->ksize     = 0;
+	g->optimize  = 1;
+	g->ninstrs   = 0;
+	g->nremoved  = 0;
+	g->nframed   = 0;
 
 	return g;
 }
@@ -127,6 +146,11 @@ void generate(Generator *g, FILE *out)
 
 	gen_block(g, g->tree->root);
 
+	if (g->optimize > 0)
+		printf("optimized away %lu of %lu instructions..\n", g->nremoved, g->ninstrs);
+	if (g->nframed > 0)
+		printf("built %lu value(s) in frames..\n", g->nframed);
+
 	if (out == NULL) return;
 
 	/* Write magic number */
@@ -136,6 +160,12 @@ void generate(Generator *g, FILE *out)
 	int version = 0xffffff;
 	fwrite(&version, 3, 1, out);
 
+	/* Write constant pool */
+	fwrite(&g->kindex, 4, 1, out);
+
+	for (unsigned i = 0; i < g->kindex; i++)
+		dump_constant(g->kheader[i], out);
+
 	/* Write path entry count */
 	fwrite(&g->pathsn, 4, 1, out);
 
@@ -144,45 +174,156 @@ void generate(Generator *g, FILE *out)
 	}
 }
 
-static int gen_constant(Generator *g, const char *src, struct tvalue *tval)
+/*
+ * Constant keys, which identify constants by their type and value,
+ * so that equal constants share a slot in the pool.
+ */
+struct kbuf {
+	char   *data;
+	size_t  len, size;
+};
+
+static void kbuf_put(struct kbuf *b, const void *p, size_t n)
+{
+	if (b->len + n + 1 > b->size) {
+		b->size = (b->len + n + 1) * 2;
+		b->data = realloc(b->data, b->size);
+	}
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+	b->data[b->len] = '\0';
+}
+
+/* Strings are prefixed with their length, so keys don't contain
+ * the NUL which ends them. */
+static void kbuf_str(struct kbuf *b, const char *str)
+{
+	char len[16];
+
+	kbuf_put(b, len, snprintf(len, sizeof(len), "%zu:", strlen(str)));
+	kbuf_put(b, str, strlen(str));
+}
+
+static void constant_key(struct kbuf *b, struct tvalue *tval)
+{
+	char buf[32];
+
+	kbuf_put(b, buf, snprintf(buf, sizeof(buf), "%d/", (int)TV_TAG(*tval)));
+
+	switch (TV_TYPE(*tval)) {
+		case TYPE_PATHID:
+			kbuf_str(b, TV_PATHID(*tval)->module);
+			kbuf_str(b, TV_PATHID(*tval)->path);
+			break;
+		case TYPE_ATOM:
+			kbuf_str(b, TV_ATOM(*tval));
+			break;
+		case TYPE_NUMBER:
+			kbuf_put(b, buf, snprintf(buf, sizeof(buf), "%ld", (long)TV_NUMBER(*tval)));
+			break;
+		case TYPE_VAR:
+		case TYPE_ANY:
+			kbuf_put(b, buf, snprintf(buf, sizeof(buf), "%d", (int)TV_IDENT(*tval)));
+			break;
+		case TYPE_TUPLE:
+			kbuf_put(b, "(", 1);
+			for (int i = 0; i < TV_TUPLE(*tval)->arity; i++)
+				constant_key(b, &TV_TUPLE(*tval)->members[i]);
+			kbuf_put(b, ")", 1);
+			break;
+		case TYPE_LIST:
+			kbuf_put(b, "[", 1);
+			for (List *l = TV_LIST(*tval); l && l->tail; l = l->tail)
+				constant_key(b, &l->head);
+			kbuf_put(b, "]", 1);
+			break;
+		default:
+			assert(0);
+			break;
+	}
+}
+
+/*
+ * Add `tval` to the module's constant pool, unless an equal constant
+ * is already in it, and return its index.
+ */
+static int gen_constant(Generator *g, struct tvalue *tval)
 {
-	if (src) {
-		Sym *k = symtab_lookup(g->path->clause->ktable, src);
+	struct kbuf key = { NULL, 0, 0 };
+
+	constant_key(&key, tval);
+
+	Sym *k = symtab_lookup(g->ktable, key.data);
 
-		if (k)
-			return k->e.tval->v.number;
+	if (k) {
+		free(key.data);
+		return TV_NUMBER(*k->e.tval);
+	}
+
+	if (g->kindex > OPMAX_D)
+		error(1, 0, "too many constants in module `%s`", g->module->name);
+
+	if (g->kindex == g->ksize) {
+		g->ksize   = g->ksize ? g->ksize * 2 : 64;
+		g->kheader = realloc(g->kheader, g->ksize * sizeof(*g->kheader));
 	}
 
-	int             index  = g->path->clause->kindex++;
+	int             index  = g->kindex++;
 	Value           v      = (Value){ .number = index };
-	struct tvalue  *indexv = tvalue(-1, v);
+	struct tvalue  *indexv = tvalue(TYPE_NUMBER, v);
 
-	g->path->clause->kheader[index] = tval;
+	g->kheader[index] = tval;
 
-	if (src)
-		symtab_insert(g->path->clause->ktable, src, tvsymbol(src, indexv));
+	symtab_insert(g->ktable, key.data, tvsymbol(key.data, indexv));
 
 	return index;
 }
 
+static void gen_load(Generator *g, int reg, int rk)
+{
+	if (ISK(rk))
+		gen(g, iAD(OP_LOADK, reg, INDEXK(rk)));
+	else
+		gen(g, iABC(OP_MOVE, reg, rk, 0));
+}
+
 static unsigned nextreg(Generator *g)
 {
 	// TODO: Check limits
 	return g->path->clause->nreg++;
 }
 
+/*
+ * Return constant `tval` as an RK operand, or, if its index doesn't
+ * fit one, load it into a new register with `loadk`.
+ */
+static int gen_rk(Generator *g, struct tvalue *tval)
+{
+	int k = gen_constant(g, tval);
+
+	if (k <= MAXINDEXRK)
+		return RKASK(k);
+
+	int reg = nextreg(g);
+
+	gen(g, iAD(OP_LOADK, reg, k));
+
+	return reg;
+}
+
 static int gen_atom(Generator *g, struct node *n)
 {
 	Value v = (Value){ .atom = n->src };
 	struct tvalue *tval = tvalue(TYPE_ATOM, v);
 
-	return RKASK(gen_constant(g, n->src, tval));
+	return gen_rk(g, tval);
 }
 
 static int gen_block(Generator *g, struct node *n)
 {
-	struct nodelist *ns  = n->o.block.body;
-	int              reg = 0;
+	struct nodelist *ns     = n->o.block.body;
+	struct node     *parent = g->block;
+	int              reg    = 0;
 
 	g->block = n;
 
@@ -190,7 +331,7 @@ static int gen_block(Generator *g, struct node *n)
 		reg = gen_node(g, ns->head);
 		ns  = ns->tail;
 	}
-	g->block = n;
+	g->block = parent;
 
 	return reg;
 }
@@ -208,7 +349,7 @@ static int gen_access(Generator *g, struct node *n)
 		case MODULE_CURRENT: {
 			/* TODO: Factor this somehow */
 			Value v = (Value){ .atom = g->module->name };
-			int current = gen_constant(g, g->module->name, tvalue(TYPE_ATOM, v));
+			int current = gen_constant(g, tvalue(TYPE_ATOM, v));
 
 			switch (rval->op) {
 				case OIDENT: {
@@ -216,7 +357,7 @@ static int gen_access(Generator *g, struct node *n)
 					pid->module = g->module->name;
 					pid->path = rval->src;
 					Value v = (Value){ .pathid = pid };
-					return RKASK(gen_constant(g, NULL, tvalue(TYPE_PATHID, v)));
+					return gen_rk(g, tvalue(TYPE_PATHID, v));
 				}
 				default:
 					assert(0);
@@ -233,26 +374,202 @@ static int gen_access(Generator *g, struct node *n)
 	return reg;
 }
 
-static int gen_apply(Generator *g, struct node *n)
+/*
+ * Generate the parallel assignment of `src`, an array of `n` registers
+ * or constants, to registers `0` to `n - 1`. Registers which are read
+ * are assigned last, and cycles are broken with a temporary register.
+ */
+static void gen_moves(Generator *g, int *src, int n)
 {
-	int lval = gen_node(g, n->o.apply.lval),
-	    rval = gen_node(g, n->o.apply.rval);
+	bool done[n];
+	int  left = 0;
 
-	int rr = nextreg(g);
+	for (int i = 0; i < n; i++) {
+		done[i] = !ISK(src[i]) && src[i] == i;
+		left   += !done[i];
+	}
 
-	bool tailcall = false;
+	while (left > 0) {
+		bool progress = false;
 
-	char *name = n->o.apply.lval->o.path.name->src;
+		for (int i = 0; i < n; i++) {
+			bool read = false;
 
-	for (struct node *b = g->block; n == b->o.block.body->end->head; b = b->o.block.parent) {
-		if (name == g->path->name || !strcmp(name, g->path->name)) { /* Tail-call */
-			tailcall = true;
-			break;
+			if (done[i])
+				continue;
+
+			for (int j = 0; j < n; j++)
+				read = read || (!done[j] && j != i && !ISK(src[j]) && src[j] == i);
+
+			if (read)
+				continue;
+
+			gen_load(g, i, src[i]);
+
+			done[i]  = true;
+			progress = true;
+			left --;
+		}
+
+		if (! progress) { /* Cycle */
+			int i = 0, t = nextreg(g);
+
+			while (done[i])
+				i ++;
+
+			gen(g, iABC(OP_MOVE, t, i, 0));
+
+			for (int j = 0; j < n; j++) {
+				if (!done[j] && !ISK(src[j]) && src[j] == i)
+					src[j] = t;
+			}
 		}
 	}
+}
+
+/*
+ * Check whether call `n`, in tail position, calls the current clause,
+ * with an argument which always matches the clause's parameters.
+ * Only the first clause of a path can loop, as it's always tried first.
+ */
+static bool gen_isloop(Generator *g, struct node *n)
+{
+	struct node *lval   = n->o.apply.lval,
+	            *rval   = n->o.apply.rval,
+	            *params = g->path->clause->params;
+
+	if (! params || lval->op != OACCESS)
+		return false;
+
+	struct node *module = lval->o.access.lval,
+	            *path   = lval->o.access.rval;
+
+	if (module->o.module.type != MODULE_CURRENT || path->op != OIDENT)
+		return false;
+
+	if (strcmp(path->src, g->path->name))
+		return false;
+
+	return params->op == OIDENT || (rval->op == OTUPLE &&
+	                                rval->o.tuple.arity == params->o.tuple.arity);
+}
+
+/*
+ * Generate a self tail-call with argument `arg` as a loop: the new
+ * arguments are moved straight into the parameter registers, and the
+ * clause is restarted, without building a tuple, matching it against
+ * the clause's pattern, or re-initializing the frame.
+ */
+static int gen_loop(Generator *g, struct node *arg)
+{
+	struct node *params = g->path->clause->params;
+
+	if (params->op == OIDENT) {
+		int src = gen_node(g, arg);
+
+		gen_moves(g, &src, 1);
+	} else {
+		int              n = params->o.tuple.arity, src[n];
+		struct nodelist *ns = arg->o.tuple.members;
+
+		for (int i = 0; i < n; i++, ns = ns->tail)
+			src[i] = gen_node(g, ns->head);
+
+		gen_moves(g, src, n);
+	}
+	gen(g, iABC(OP_LOOP, 0, 0, 0));
+
+	return nextreg(g);
+}
+
+/*
+ * Generate the `n` nodes `ns` into consecutive registers,
+ * and return the first one.
+ */
+static unsigned gen_values(Generator *g, struct nodelist *ns, int n)
+{
+	int src[n];
+
+	for (int i = 0; i < n; i++, ns = ns->tail)
+		src[i] = gen_node(g, ns->head);
+
+	unsigned base = nextreg(g);
+
+	for (int i = 1; i < n; i++)
+		nextreg(g);
+
+	for (int i = 0; i < n; i++)
+		gen_load(g, base + i, src[i]);
+
+	return base;
+}
+
+/*
+ * Generate call `n`, whose argument is a tuple, passing its members in
+ * consecutive registers instead. The callee binds them straight to its
+ * parameters, so no tuple is built, unless its pattern binds it whole.
+ */
+static int gen_calln(Generator *g, struct node *n, bool tailcall)
+{
+	struct node *arg = n->o.apply.rval;
+
+	int      lval = gen_node(g, n->o.apply.lval);
+	unsigned base = gen_values(g, arg->o.tuple.members, arg->o.tuple.arity);
+
+	gen(g, iABC(tailcall ? OP_TAILCALLN : OP_CALLN, base, lval, arg->o.tuple.arity));
+
+	return base;
+}
+
+/*
+ * Generate `n` into `count` consecutive registers, for it to be
+ * unpacked, and return the first one. Calls return their values
+ * straight into these registers (see `OP_RETURNN`).
+ */
+static unsigned gen_results(Generator *g, struct node *n, int count)
+{
+	int reg = gen_node(g, n);
+
+	if (n->op != OAPPLY || ISK(reg)) {
+		int src = reg;
+
+		gen_load(g, reg = nextreg(g), src);
+	}
+
+	/* The result of a call is in its last register, or
+	 * the first of its arguments. */
+	while (g->path->clause->nreg < reg + count)
+		nextreg(g);
+
+	return reg;
+}
+
+/*
+ * Check whether node `n` is the value returned by the current clause
+ */
+static bool gen_istail(Generator *g, struct node *n)
+{
+	return g->block->o.block.body->end->head == n && g->block == g->tail;
+}
+
+static int gen_apply(Generator *g, struct node *n)
+{
+	/* Calls whose value is returned replace the caller's frame */
+	bool tailcall = gen_istail(g, n);
+
+	if (tailcall && gen_isloop(g, n))
+		return gen_loop(g, n->o.apply.rval);
+
+	if (n->o.apply.rval && n->o.apply.rval->op == OTUPLE && n->o.apply.rval->o.tuple.arity > 0)
+		return gen_calln(g, n, tailcall);
+
+	int lval = gen_node(g, n->o.apply.lval),
+	    rval = gen_node(g, n->o.apply.rval);
+
+	int rr = nextreg(g);
 
 	if (tailcall) { /* Tail-call */
-		gen(g, iABC(OP_TAILCALL, rr, 0, rval));
+		gen(g, iABC(OP_TAILCALL, rr, lval, rval));
 	} else {
 		gen(g, iABC(OP_CALL, rr, lval, rval));
 	}
@@ -260,6 +577,28 @@ static int gen_apply(Generator *g, struct node *n)
 	return rr;
 }
 
+/*
+ * Parameters `lval` of clause `c`, if they are distinct identifiers,
+ * which are bound to registers `0` and up. Returns NULL otherwise.
+ */
+static struct node *gen_params(ClauseEntry *c, struct node *lval)
+{
+	if (! lval)
+		return NULL;
+
+	if (lval->op == OIDENT)
+		return c->nlocals == 1 ? lval : NULL;
+
+	if (lval->op != OTUPLE || c->nlocals != lval->o.tuple.arity)
+		return NULL;
+
+	for (struct nodelist *ns = lval->o.tuple.members; ns; ns = ns->tail) {
+		if (ns->head->op != OIDENT)
+			return NULL;
+	}
+	return lval;
+}
+
 static int gen_clause(Generator *g, struct node *n)
 {
 	int reg = -1;
@@ -274,21 +613,48 @@ static int gen_clause(Generator *g, struct node *n)
 
 	g->path->nclauses ++;
 
+	struct node *tail = g->tail;
+
 	enterscope(g->tree);
 	gen_locals(g, n->o.clause.lval);
+
+	int nparams = g->path->clause->nreg;
+
+	if (index == 0)
+		g->path->clause->params = gen_params(g->path->clause, n->o.clause.lval);
+
+	g->tail = n->o.clause.rval;
 	reg = gen_block(g, n->o.clause.rval);
+	g->tail = tail;
 	exitscope(g->tree);
 
-	if (iOP(g->path->clause->code[g->path->clause->pc - 1]) != OP_TAILCALL) {
+	/* Bodies which are a variable or a constant emit no code */
+	OpCode last = g->path->clause->pc > 0 ? iOP(g->path->clause->code[g->path->clause->pc - 1])
+	                                      : OP_INVALID;
+
+	if (last != OP_TAILCALL && last != OP_TAILCALLN && last != OP_LOOP && last != OP_RETURNN) {
 		if (ISK(reg)) {
 			rega = nextreg(g);
-			gen(g, iAD(OP_LOADK, rega, reg));
+			gen_load(g, rega, reg);
 			reg = rega;
 		}
 		gen(g, iABC(OP_RETURN, reg, 0, 0));
 	}
 	gen(g, 0); /* Terminator */
 
+	unsigned long emitted = g->path->clause->pc;
+
+	if (g->optimize > 0) {
+		gen_peephole(g, g->path->clause, nparams);
+		gen_alloc(g, g->path->clause, nparams);
+		gen_peephole(g, g->path->clause, nparams); /* For the `move`s removed */
+		gen_fuse(g, g->path->clause);
+		gen_escape(g, g->path->clause, nparams);
+		gen_specialize(g, g->path->clause);
+	}
+	g->ninstrs  += emitted - 1;
+	g->nremoved += emitted - g->path->clause->pc;
+
 	if (old)
 		g->path->clause = old;
 
@@ -330,7 +696,7 @@ static struct tvalue *gen_pattern(Generator *g, struct node *n)
 			pattern = tuple(n->o.tuple.arity);
 
 			for (struct nodelist *ns = n->o.tuple.members ; ns ; ns = ns->tail) {
-				pattern->v.tuple->members[i++] = *gen_pattern(g, ns->head);
+				TV_TUPLE(*pattern)->members[i++] = *gen_pattern(g, ns->head);
 			}
 			break;
 		}
@@ -376,13 +742,13 @@ static struct tvalue *gen_pattern(Generator *g, struct node *n)
 			 * [X, XS..]  = <list> <any> <any..>
 			 *
 			 */
-			List *l = list_cons(NULL, NULL);
+			List *l = list();
 
 			if (n->o.list.length > 0) {
 				assert(n->o.list.items->end);
 
 				for (struct nodelist *ns = n->o.list.items ; ns ; ns = ns->tail) {
-					l = list_cons(l, gen_pattern(g, ns->head));
+					l = list_cons(l, *gen_pattern(g, ns->head));
 				}
 			}
 			pattern = tvalue(TYPE_LIST, (Value){ .list = l });
@@ -396,319 +762,2241 @@ static struct tvalue *gen_pattern(Generator *g, struct node *n)
 	return pattern;
 }
 
-static int gen_select(Generator *g, struct node *n)
+/*
+ * Generate the body of select clause `c`, storing its value in `result`
+ */
+static void gen_selectbody(Generator *g, struct node *c, unsigned result)
 {
-	struct nodelist *ns;
-	struct node *arg = n->o.select.arg;
+	unsigned     ret;
+	struct node *tail = g->tail;
 
-	unsigned result = nextreg(g), ret;
-	unsigned long savedpc = -1, offset;
+	/* The clause's value is returned if the select's is */
+	g->tail = tail ? c->o.clause.rval : NULL;
 
-	int nclauses = n->o.select.nclauses;
-	int patches[nclauses - 1];
+	enterscope(g->tree);
+	ret = gen_block(g, c->o.clause.rval);
+	exitscope(g->tree);
 
-	ClauseEntry *clause = g->path->clause;
+	g->tail = tail;
 
-	ns = n->o.select.clauses;
+	gen_load(g, result, ret);
+}
 
-	/* Denotes whether or not this `select` node is the last value
-	 * in the parent function, in which case it can just return
-	 * from inside its clauses, instead of jumping outside. */
-	bool islast = g->block->o.block.body->end->head == n &&
-	              g->block == clause->node->o.clause.rval;
+/*
+ * List of jumps, to be patched once their target is known
+ */
+struct jumps {
+	int *pcs;
+	int  n;
+};
 
-	for (int i = 0; i < nclauses; i++) {
-		struct node *c = ns->head;
+static void jumps_add(struct jumps *j, int pc)
+{
+	j->pcs = realloc(j->pcs, sizeof(int) * (j->n + 1));
+	j->pcs[j->n ++] = pc;
+}
 
-		int nguards = c->o.clause.nguards;
-		int gpatches[nguards];
+/*
+ * Point jumps `j` at `target`, and empty the list
+ */
+static void jumps_patch(ClauseEntry *c, struct jumps *j, unsigned long target)
+{
+	for (int i = 0; i < j->n; i++)
+		c->code[j->pcs[i]] = iAJ(OP_JUMP, 0, (long)target - j->pcs[i] - 1);
 
-		enterscope(g->tree);
+	free(j->pcs);
+	j->pcs = NULL;
+	j->n   = 0;
+}
+
+/*
+ * Move the jumps of `from` to `to`
+ */
+static void jumps_move(struct jumps *to, struct jumps *from)
+{
+	for (int i = 0; i < from->n; i++)
+		jumps_add(to, from->pcs[i]);
 
-		/* If we have a pattern and an argument to match
-		 * against it. */
-		if (c->o.clause.lval && arg) {
-			unsigned reg = nextreg(g);
+	free(from->pcs);
+	from->pcs = NULL;
+	from->n   = 0;
+}
 
-			struct tvalue *pat = gen_pattern(g, c->o.clause.lval);
+/*
+ * Number of leading clauses of select `n` which have
+ * a number or atom literal pattern, and no guards.
+ */
+static int switch_clauses(struct node *n)
+{
+	int count = 0;
 
-			OpCode op;
+	for (struct nodelist *ns = n->o.select.clauses; ns && count < OPMAX_C; ns = ns->tail) {
+		struct node *c = ns->head;
 
-			switch (pat->t) {
-				case TYPE_NUMBER:   op = OP_EQ;       break;
-				case TYPE_ATOM:
-				case TYPE_STRING:
-				default:            op = OP_MATCH;
-			}
-			gen(g, iABC(op, reg, RKASK(gen_constant(g, NULL, pat)), gen_node(g, arg)));
+		if (! c->o.clause.lval || c->o.clause.nguards)
+			break;
 
-			savedpc = g->path->clause->pc;
-			gen(g, 0); /* Patched in [1] */
-		}
+		if (c->o.clause.lval->op != ONUMBER && c->o.clause.lval->op != OATOM)
+			break;
 
-		{ /* Guards */
-			struct nodelist *ns = c->o.clause.guards;
+		count ++;
+	}
+	return count;
+}
 
-			for (int i = 0; i < nguards; i++) {
-				gen_node(g, ns->head);
-				gpatches[i] = clause->pc;
-				gen(g, 0); /* Patched in [0] */
-				ns = ns->tail;
-			}
-		}
+/*
+ * Generate the leading literal clauses of select `n` as a `switch`, if
+ * there are at least `SWITCH_MIN` of them. Numbers in a compact range
+ * are looked up by index, and other keys are binary searched. The
+ * default jump of the switch lands on the remaining clauses.
+ *
+ * Jumps to the end of the select are left to be patched in `ends`.
+ * Returns the number of clauses generated.
+ */
+static int gen_switch(Generator *g, struct node *n, unsigned result, struct jumps *ends)
+{
+	ClauseEntry *clause   = g->path->clause;
+	int          nclauses = switch_clauses(n);
 
-		/* Gen clause */
+	if (nclauses < SWITCH_MIN)
+		return 0;
 
-		enterscope(g->tree);
-		ret = gen_block(g, c->o.clause.rval);
-		exitscope(g->tree);
+	struct tvalue   *keys[nclauses];
+	unsigned long    body[nclauses];
+	int              first[nclauses], /* Clauses introducing a new key */
+	                 nkeys   = 0;
+	bool             numbers = true;
+	long             lo = 0, hi = 0;
+	struct nodelist *ns = n->o.select.clauses;
 
-		if (ISK(ret))
-			gen(g, iAD(OP_LOADK, result, ret));
-		else
-			gen(g, iABC(OP_MOVE, result, ret, 0));
+	for (int i = 0; i < nclauses; i++, ns = ns->tail) {
+		keys[i] = gen_pattern(g, ns->head->o.clause.lval);
 
-		/* Create patch for [2] */
-		if (i < nclauses - 1) {
-			patches[i] = clause->pc;
-			gen(g, 0);
-		}
+		bool dup = false;
+		for (int j = 0; j < nkeys; j++)
+			dup = dup || keys[first[j]]->word == keys[i]->word;
 
-		if (c->o.clause.lval && arg) {
-			offset = clause->pc - savedpc - 1;
-			clause->code[savedpc] = iAJ(OP_JUMP, 0, offset); /* 1 */
-		}
+		if (! dup)
+			first[nkeys ++] = i;
 
-		for (int i = 0; i < nguards; i++) {
-			clause->code[gpatches[i]] = /* 2 */
-				iAJ(OP_JUMP, 0, clause->pc - gpatches[i] - 1);
-		}
-		exitscope(g->tree);
+		if (TV_TYPE(*keys[i]) != TYPE_NUMBER) {
+			numbers = false;
+		} else {
+			long v = TV_NUMBER(*keys[i]);
 
-		ns = ns->tail;
-	}
-	/* [2] Patch clauses to skip over following clauses */
-	for (int i = 0; i < nclauses - 1; i++) {
-		clause->code[patches[i]] = islast ? iABC(OP_RETURN, result, 0, 0)
-		                                  : iAJ(OP_JUMP, 0, clause->pc - patches[i] - 1);
+			lo = (i == 0 || v < lo) ? v : lo;
+			hi = (i == 0 || v > hi) ? v : hi;
+		}
 	}
-	return result;
-}
 
-static int gen_add(Generator *g, struct node *n)
-{
-	int lval = gen_node(g, n->o.add.lval),
-	    rval = gen_node(g, n->o.add.rval);
+	/* Use a dense table if at least half of it is used */
+	bool dense = numbers && hi - lo < OPMAX_C && hi - lo + 1 <= 2 * nkeys;
+	int  size  = dense ? hi - lo + 1 : nkeys;
+	int  index[nkeys];
 
-	int reg = nextreg(g);
+	/* Keys are stored in argument `A` of the table's jumps */
+	for (int e = 0; ! dense && e < nkeys; e++) {
+		if ((index[e] = gen_constant(g, keys[first[e]])) > OPMAX_A)
+			return 0;
+	}
 
-	gen(g, iABC(OP_ADD, reg, lval, rval));
+	int  reg   = gen_node(g, n->o.select.arg);
 
-	return reg;
-}
+	if (ISK(reg)) {
+		int k = reg;
+		gen_load(g, reg = nextreg(g), k);
+	}
 
-static int gen_sub(Generator *g, struct node *n)
-{
-	int lval = gen_node(g, n->o.add.lval),
-	    rval = gen_node(g, n->o.add.rval);
+	int low = dense ? gen_rk(g, tvalue(TYPE_NUMBER, (Value){ .number = lo })) : 0;
 
-	int reg = nextreg(g);
+	unsigned long table = clause->pc + 1;
 
-	gen(g, iABC(OP_SUB, reg, lval, rval));
+	if (dense) {
+		gen(g, iABC(OP_SWITCH, reg, low, size));
+	} else {
+		gen(g, iABC(OP_SWITCHK, reg, 0, size));
+	}
 
-	return reg;
-}
+	for (int i = 0; i <= size; i++)
+		gen(g, 0); /* Patched below */
 
-static int gen_gt(Generator *g, struct node *n)
-{
-	int lval = gen_node(g, n->o.cmp.lval),
-	    rval = gen_node(g, n->o.cmp.rval);
+	ns = n->o.select.clauses;
 
-	gen(g, iABC(OP_GT, 0, lval, rval));
+	for (int i = 0; i < nclauses; i++, ns = ns->tail) {
+		body[i] = clause->pc;
 
-	return -1;
+		enterscope(g->tree);
+		gen_selectbody(g, ns->head, result);
+		exitscope(g->tree);
+
+		if (i < n->o.select.nclauses - 1) {
+			jumps_add(ends, clause->pc);
+			gen(g, 0);
+		}
+	}
+
+	unsigned long fallback = clause->pc;
+
+	for (int e = 0; e < size; e++) {
+		unsigned long target = fallback;
+		int           k      = 0;
+
+		if (dense) {
+			for (int j = 0; j < nkeys; j++) {
+				if (TV_NUMBER(*keys[first[j]]) == lo + e)
+					target = body[first[j]];
+			}
+		} else {
+			target = body[first[e]];
+			k      = index[e];
+		}
+		clause->code[table + e] = iAJ(OP_JUMP, k, (long)target - (long)(table + e) - 1);
+	}
+	clause->code[table + size] = iAJ(OP_JUMP, 0, (long)fallback - (long)(table + size) - 1);
+
+	return nclauses;
+}
+
+/*
+ * Pattern-matching compiler
+ *
+ * The clauses of a select are compiled together into a decision
+ * tree, of primitive tests and destructuring instructions, instead
+ * of matching each clause's pattern in turn with `match`.
+ *
+ * Patterns are laid out in a matrix, with one row per clause, and one
+ * column per sub-term of the argument, or "occurrence", which is held
+ * in a register. The first row which tests a constructor (a literal,
+ * a tuple arity, an empty or non-empty list) picks the column to
+ * switch on. The leading rows which all test a constructor in that
+ * column are split by constructor, and the constructor's sub-terms are
+ * loaded into registers once, for all the rows which need them. The
+ * rows which follow are compiled after, and are jumped to on failure.
+ *
+ * A row without constructors left is a leaf: its variables are bound,
+ * bound variables and guards are tested, and its body is generated.
+ * Clause bodies are thus never duplicated.
+ */
+
+/*
+ * Row of a pattern matrix: a clause, the patterns it has left to
+ * match, one per column, and the scope its bindings are defined in.
+ * A NULL pattern matches anything, and binds nothing.
+ */
+struct row {
+	struct node    *clause;
+	SymTable       *scope;
+	struct tvalue **pats;
+};
+
+/*
+ * Put the items of the list patterns in `p` in order. Patterns are
+ * generated with their items reversed, as the VM reverses them again
+ * when reading them (see `vm_readlist`).
+ */
+static void pattern_order(struct tvalue *p)
+{
+	if (! p)
+		return;
+
+	if (TV_TYPE(*p) == TYPE_TUPLE) {
+		for (int i = 0; i < TV_TUPLE(*p)->arity; i++)
+			pattern_order(&TV_TUPLE(*p)->members[i]);
+	} else if (TV_TYPE(*p) == TYPE_LIST) {
+		List *l = TV_LIST(*p), *prev = l;
+
+		while (! LIST_ISEMPTY(prev)) /* The end of the list stays last */
+			prev = prev->tail;
+
+		while (! LIST_ISEMPTY(l)) {
+			List *next = l->tail;
+
+			pattern_order(&l->head);
+			l->tail = prev;
+			prev    = l;
+			l       = next;
+		}
+		*p = TVPTR(TV_TAG(*p), prev);
+	}
+}
+
+/*
+ * Constructor tested by pattern `p`, or 0 if it matches any value.
+ * Patterns with the same constructor have the same key.
+ */
+static uint64_t pattern_key(struct tvalue *p)
+{
+	if (! p)
+		return 0;
+
+	switch (TV_TYPE(*p)) {
+		case TYPE_NUMBER:
+		case TYPE_ATOM:
+			return p->word;
+		case TYPE_TUPLE:
+			return TV(TYPE_TUPLE, TV_TUPLE(*p)->arity).word;
+		case TYPE_LIST: {
+			List *l = TV_LIST(*p);
+
+			if (LIST_ISEMPTY(l))
+				return TV(TYPE_LIST, 0).word;
+			if (TV_TAG(l->head) & Q_RANGE) /* `[xs..]` matches any list */
+				return 0;
+
+			return TV(TYPE_LIST, 1).word;
+		}
+		default:
+			return 0;
+	}
+}
+
+/*
+ * Generate the test of the constructor of pattern `p` on register
+ * `reg`. Returns the number of sub-terms of the constructor.
+ */
+static int gen_ctortest(Generator *g, struct tvalue *p, int reg)
+{
+	switch (TV_TYPE(*p)) {
+		case TYPE_NUMBER:
+			if (TV_NUMBER(*p) >= OPMIN_I && TV_NUMBER(*p) <= OPMAX_I) {
+				gen(g, iABC(OP_EQI, 0, reg, (uint8_t)TV_NUMBER(*p)));
+				return 0;
+			}
+			/* Fallthrough */
+		case TYPE_ATOM:
+			gen(g, iABC(OP_EQV, 0, gen_rk(g, p), reg));
+			return 0;
+		case TYPE_TUPLE:
+			gen(g, iABC(OP_TESTT, 0, reg, TV_TUPLE(*p)->arity));
+			return TV_TUPLE(*p)->arity;
+		case TYPE_LIST:
+			if (LIST_ISEMPTY(TV_LIST(*p))) {
+				gen(g, iABC(OP_TESTL, 0, reg, 0));
+				return 0;
+			}
+			gen(g, iABC(OP_TESTL, 0, reg, 1));
+			return 2;
+		default:
+			assert(0);
+			return 0;
+	}
+}
+
+/*
+ * Store the sub-patterns of constructor pattern `p` in `out`:
+ * the members of a tuple, or the head and tail of a list.
+ */
+static void pattern_args(struct tvalue *p, struct tvalue **out)
+{
+	if (TV_TYPE(*p) == TYPE_TUPLE) {
+		for (int i = 0; i < TV_TUPLE(*p)->arity; i++)
+			out[i] = &TV_TUPLE(*p)->members[i];
+	} else if (TV_TYPE(*p) == TYPE_LIST && ! LIST_ISEMPTY(TV_LIST(*p))) {
+		List *tail = TV_LIST(*p)->tail;
+
+		out[0] = &TV_LIST(*p)->head;
+		out[1] = (! LIST_ISEMPTY(tail) && TV_TAG(tail->head) & Q_RANGE)
+		       ? &tail->head
+		       : tvalue(TYPE_LIST, (Value){ .list = tail });
+	}
+}
+
+/*
+ * Load sub-term `i` of the value in `reg`, which matched
+ * constructor pattern `p`. Returns the register it is in.
+ */
+static int gen_destructure(Generator *g, struct tvalue *p, int reg, int i)
+{
+	unsigned sub = nextreg(g);
+
+	if (TV_TYPE(*p) == TYPE_TUPLE)
+		gen(g, iABC(OP_GETT, sub, reg, i));
+	else
+		gen(g, iABC(i == 0 ? OP_HEAD : OP_TAIL, sub, reg, 0));
+
+	return sub;
+}
+
+/*
+ * Generate leaf row `r`, which has no constructors left to test.
+ * Jumps taken if a bound variable or a guard doesn't match are
+ * added to `fails`.
+ */
+static void gen_leaf(Generator *g, struct row *r, int *occs, int ncols,
+                     unsigned result, struct jumps *ends, struct jumps *fails)
+{
+	ClauseEntry *clause = g->path->clause;
+	SymTable    *saved  = g->tree->symbols;
+
+	g->tree->symbols = r->scope;
+
+	/* Bindings, and `[xs..]` */
+	for (int i = 0; i < ncols; i++) {
+		struct tvalue *p = r->pats[i];
+
+		if (! p)
+			continue;
+
+		if (TV_TYPE(*p) == TYPE_LIST) {
+			gen(g, iABC(OP_TESTL, 0, occs[i], 2));
+			jumps_add(fails, clause->pc);
+			gen(g, 0);
+
+			p = &TV_LIST(*p)->head;
+		}
+		if (TV_TYPE(*p) == TYPE_ANY && TV_IDENT(*p) != occs[i])
+			gen(g, iABC(OP_MOVE, TV_IDENT(*p), occs[i], 0));
+	}
+
+	/* Bound variables */
+	for (int i = 0; i < ncols; i++) {
+		struct tvalue *p = r->pats[i];
+
+		if (p && TV_TYPE(*p) == TYPE_LIST)
+			p = &TV_LIST(*p)->head;
+
+		if (! p || TV_TYPE(*p) != TYPE_VAR)
+			continue;
+
+		int k = gen_rk(g, tvalue(TYPE_VAR, (Value){ .ident = TV_IDENT(*p) }));
+
+		gen(g, iABC(OP_MATCH, 0, k, occs[i]));
+		jumps_add(fails, clause->pc);
+		gen(g, 0);
+	}
+
+	/* Guards */
+	struct nodelist *ns = r->clause->o.clause.guards;
+
+	for (int i = 0; i < r->clause->o.clause.nguards; i++, ns = ns->tail) {
+		gen_node(g, ns->head);
+		jumps_add(fails, clause->pc);
+		gen(g, 0);
+	}
+
+	gen_selectbody(g, r->clause, result);
+
+	jumps_add(ends, clause->pc);
+	gen(g, 0);
+
+	g->tree->symbols = saved;
+}
+
+/*
+ * Generate the decision tree of pattern matrix `rows`, whose columns
+ * are held in registers `occs`. Jumps taken if no row matches are
+ * added to `fails`, and jumps out of clause bodies to `ends`.
+ */
+static void gen_matrix(Generator *g, struct row *rows, int nrows, int *occs, int ncols,
+                       unsigned result, struct jumps *ends, struct jumps *fails)
+{
+	ClauseEntry *clause = g->path->clause;
+	struct jumps next   = { NULL, 0 }; /* Jumps to the following rows */
+	int          col    = -1,
+	             nblock = 1;
+
+	if (nrows == 0)
+		return;
+
+	for (int i = 0; i < ncols && col < 0; i++) {
+		if (pattern_key(rows[0].pats[i]))
+			col = i;
+	}
+
+	if (col < 0) {
+		gen_leaf(g, &rows[0], occs, ncols, result, ends, &next);
+
+		if (next.n == 0) /* The following rows are unreachable */
+			return;
+	} else {
+		while (nblock < nrows && pattern_key(rows[nblock].pats[col]))
+			nblock ++;
+
+		int test = -1; /* Jump to the next constructor test */
+
+		for (int i = 0; i < nblock; i++) {
+			uint64_t       key  = pattern_key(rows[i].pats[col]);
+			struct tvalue *p    = rows[i].pats[col];
+			bool           seen = false;
+
+			for (int j = 0; j < i; j++)
+				seen = seen || pattern_key(rows[j].pats[col]) == key;
+
+			if (seen)
+				continue;
+
+			if (test >= 0)
+				clause->code[test] = iAJ(OP_JUMP, 0, (long)clause->pc - test - 1);
+
+			int arity = gen_ctortest(g, p, occs[col]);
+
+			test = clause->pc;
+			gen(g, 0); /* Patched above, or added to `next` */
+
+			/* Specialize the rows with this constructor */
+			struct row sub[nblock];
+			int        subocc[ncols + arity],
+			           nsub = 0;
+
+			for (int j = i; j < nblock; j++) {
+				if (pattern_key(rows[j].pats[col]) != key)
+					continue;
+
+				struct tvalue **pats = malloc(sizeof(*pats) * (ncols + arity));
+
+				memcpy(pats, rows[j].pats, sizeof(*pats) * ncols);
+				pats[col] = NULL;
+				pattern_args(rows[j].pats[col], pats + ncols);
+
+				sub[nsub ++] = (struct row){ rows[j].clause, rows[j].scope, pats };
+			}
+
+			/* Load the sub-terms which are matched against */
+			memcpy(subocc, occs, sizeof(*occs) * ncols);
+
+			for (int k = 0; k < arity; k++) {
+				bool used = false;
+
+				for (int j = 0; j < nsub; j++)
+					used = used || sub[j].pats[ncols + k];
+
+				subocc[ncols + k] = used ? gen_destructure(g, p, occs[col], k) : -1;
+			}
+			gen_matrix(g, sub, nsub, subocc, ncols + arity, result, ends, &next);
+		}
+		jumps_add(&next, test);
+	}
+
+	/* Rows after the leaf, or after the block */
+	if (nblock < nrows) {
+		jumps_patch(clause, &next, clause->pc);
+		gen_matrix(g, rows + nblock, nrows - nblock, occs, ncols, result, ends, fails);
+	} else {
+		jumps_move(fails, &next);
+	}
+}
+
+/*
+ * Arity of the tuples which all `n` clauses `ns` of select `sel`
+ * match against, if its argument is a call, or 0.
+ */
+static int select_arity(struct node *sel, struct nodelist *ns, int n)
+{
+	int arity = 0;
+
+	if (sel->o.select.arg->op != OAPPLY || n != sel->o.select.nclauses)
+		return 0;
+
+	for (int i = 0; i < n; i++, ns = ns->tail) {
+		struct node *lval = ns->head->o.clause.lval;
+
+		if (! lval || lval->op != OTUPLE || lval->o.tuple.arity == 0)
+			return 0;
+		if (arity && lval->o.tuple.arity != arity)
+			return 0;
+
+		arity = lval->o.tuple.arity;
+	}
+	return arity;
+}
+
+/*
+ * Generate the `n` clauses `ns` of select `sel` as a decision tree
+ */
+static void gen_tree(Generator *g, struct node *sel, struct nodelist *ns, int n,
+                     unsigned result, struct jumps *ends, struct jumps *fails)
+{
+	struct row rows[n];
+	int        arity = select_arity(sel, ns, n),
+	           ncols = arity ? arity : 1,
+	           occs[ncols],
+	           reg;
+
+	/* Calls whose value is only matched against tuples return
+	 * its members, which are the columns of the matrix. */
+	if (arity) {
+		reg = gen_results(g, sel->o.select.arg, arity);
+
+		gen(g, iABC(OP_UNPACK, reg, 0, arity));
+		jumps_add(fails, g->path->clause->pc);
+		gen(g, 0);
+	} else if (ISK(reg = gen_node(g, sel->o.select.arg))) {
+		int k = reg;
+		gen_load(g, reg = nextreg(g), k);
+	}
+
+	for (int i = 0; i < ncols; i++)
+		occs[i] = reg + i;
+
+	for (int i = 0; i < n; i++, ns = ns->tail) {
+		struct tvalue *p;
+
+		rows[i].clause  = ns->head;
+		rows[i].pats    = malloc(sizeof(*rows[i].pats) * ncols);
+
+		enterscope(g->tree);
+		p = gen_pattern(g, ns->head->o.clause.lval);
+		pattern_order(p);
+		rows[i].scope   = g->tree->symbols;
+		exitscope(g->tree);
+
+		if (arity)
+			pattern_args(p, rows[i].pats);
+		else
+			rows[i].pats[0] = p;
+	}
+	gen_matrix(g, rows, n, occs, ncols, result, ends, fails);
+}
+
+static int gen_select(Generator *g, struct node *n)
+{
+	struct nodelist *ns;
+	struct node *arg = n->o.select.arg;
+
+	unsigned result = nextreg(g);
+
+	int nclauses = n->o.select.nclauses;
+
+	struct jumps ends = { NULL, 0 }; /* Jumps to the end of the select */
+
+	ClauseEntry *clause = g->path->clause;
+
+	ns = n->o.select.clauses;
+
+	/* Denotes whether or not this `select` node is the last value
+	 * in the parent function, in which case it can just return
+	 * from inside its clauses, instead of jumping outside. */
+	bool islast = gen_istail(g, n);
+
+	struct node *tail = g->tail;
+
+	g->tail = islast ? n : NULL; /* See `gen_selectbody` */
+
+	if (arg) {
+		int first = gen_switch(g, n, result, &ends);
+
+		for (int i = 0; i < first; i++)
+			ns = ns->tail;
+
+		if (first < nclauses) {
+			struct jumps fails = { NULL, 0 };
+
+			gen_tree(g, n, ns, nclauses - first, result, &ends, &fails);
+			jumps_patch(clause, &fails, clause->pc);
+		}
+	}
+
+	for (int i = 0; !arg && i < nclauses; i++) {
+		struct node *c = ns->head;
+
+		int nguards = c->o.clause.nguards;
+		int gpatches[nguards];
+
+		enterscope(g->tree);
+
+		{ /* Guards */
+			struct nodelist *ns = c->o.clause.guards;
+
+			for (int i = 0; i < nguards; i++) {
+				gen_node(g, ns->head);
+				gpatches[i] = clause->pc;
+				gen(g, 0); /* Patched in [0] */
+				ns = ns->tail;
+			}
+		}
+
+		/* Gen clause */
+		gen_selectbody(g, c, result);
+
+		/* Create patch for [2] */
+		if (i < nclauses - 1) {
+			jumps_add(&ends, clause->pc);
+			gen(g, 0);
+		}
+
+		for (int i = 0; i < nguards; i++) {
+			clause->code[gpatches[i]] = /* 2 */
+				iAJ(OP_JUMP, 0, clause->pc - gpatches[i] - 1);
+		}
+		exitscope(g->tree);
+
+		ns = ns->tail;
+	}
+
+	/* The last clause can fall through to the end */
+	if (! islast && ends.n > 0 && ends.pcs[ends.n - 1] == (int)clause->pc - 1) {
+		ends.n --;
+		clause->pc --;
+	}
+
+	/* [2] Patch clauses to skip over following clauses */
+	for (int i = 0; i < ends.n; i++) {
+		clause->code[ends.pcs[i]] = islast ? iABC(OP_RETURN, result, 0, 0)
+		                                   : iAJ(OP_JUMP, 0, clause->pc - ends.pcs[i] - 1);
+	}
+	free(ends.pcs);
+
+	g->tail = tail;
+
+	return result;
+}
+
+/*
+ * Check whether node `n` is a number literal small enough
+ * to be an immediate operand, and if so, store it in `imm`.
+ */
+static bool gen_immediate(struct node *n, int *imm)
+{
+	if (n->op != ONUMBER)
+		return false;
+
+	int number = atoi(n->src);
+
+	if (number < OPMIN_I || number > OPMAX_I)
+		return false;
+
+	*imm = number;
+
+	return true;
+}
+
+static int gen_add(Generator *g, struct node *n)
+{
+	int reg, imm;
+
+	if (gen_immediate(n->o.add.rval, &imm)) {
+		int lval = gen_node(g, n->o.add.lval);
+		reg = nextreg(g);
+		gen(g, iABC(OP_ADDI, reg, lval, (uint8_t)imm));
+	} else if (gen_immediate(n->o.add.lval, &imm)) {
+		int rval = gen_node(g, n->o.add.rval);
+		reg = nextreg(g);
+		gen(g, iABC(OP_ADDI, reg, rval, (uint8_t)imm));
+	} else {
+		int lval = gen_node(g, n->o.add.lval),
+		    rval = gen_node(g, n->o.add.rval);
+
+		reg = nextreg(g);
+		gen(g, iABC(OP_ADD, reg, lval, rval));
+	}
+	return reg;
+}
+
+static int gen_sub(Generator *g, struct node *n)
+{
+	int reg, imm;
+
+	if (gen_immediate(n->o.add.rval, &imm)) {
+		int lval = gen_node(g, n->o.add.lval);
+		reg = nextreg(g);
+		gen(g, iABC(OP_SUBI, reg, lval, (uint8_t)imm));
+	} else {
+		int lval = gen_node(g, n->o.add.lval),
+		    rval = gen_node(g, n->o.add.rval);
+
+		reg = nextreg(g);
+		gen(g, iABC(OP_SUB, reg, lval, rval));
+	}
+	return reg;
+}
+
+/*
+ * Generate `lval > rval`
+ */
+static int gen_cmp(Generator *g, struct node *lval, struct node *rval)
+{
+	int imm;
+
+	if (gen_immediate(rval, &imm)) {
+		gen(g, iABC(OP_GTI, 0, gen_node(g, lval), (uint8_t)imm));
+	} else if (gen_immediate(lval, &imm)) {
+		gen(g, iABC(OP_LTI, 0, gen_node(g, rval), (uint8_t)imm));
+	} else {
+		int l = gen_node(g, lval),
+		    r = gen_node(g, rval);
+
+		gen(g, iABC(OP_GT, 0, l, r));
+	}
+	return -1;
+}
+
+static int gen_gt(Generator *g, struct node *n)
+{
+	return gen_cmp(g, n->o.cmp.lval, n->o.cmp.rval);
+}
+
+static int gen_lt(Generator *g, struct node *n)
+{
+	return gen_cmp(g, n->o.cmp.rval, n->o.cmp.lval);
+}
+
+static void gen_locals(Generator *g, struct node *n)
+{
+	switch (n->op) {
+		case OTUPLE:
+			for (struct nodelist *ns = n->o.tuple.members ; ns ; ns = ns->tail) {
+				gen_locals(g, ns->head);
+			}
+			break;
+		case OIDENT: {
+			Sym  *ident = tree_lookup(g->tree, n->src);
+
+			if (! ident) {
+				g->path->clause->nlocals ++;
+				define(g, n->src, nextreg(g));
+			}
+			break;
+		}
+		case ONUMBER:
+		case OATOM:
+		case OSTRING:
+			gen_node(g, n);
+			break;
+		default:
+			// Ignore
+			break;
+	}
+}
+
+static int gen_path(Generator *g, struct node *n)
+{
+	char *name = n->o.path.name->src;
+
+	Sym *k = symtab_lookup(g->tree->psymbols, name);
+
+	if (k) { /* Further definitions add clauses to the path */
+		if (k->e.path->nclauses == OPMAX_A) {
+			nreportf(REPORT_ERROR, n, "path '%s' has too many clauses.", name);
+			exit(1);
+		}
+		g->path = k->e.path;
+
+		return gen_clause(g, n->o.path.clause);
+	}
+
+	g->path = g->paths[g->pathsn] = pathentry(name, n, g->pathsn);
+
+	symtab_insert(g->tree->psymbols, name, psymbol(name, g->path));
+
+	g->pathsn ++;
+
+	return gen_clause(g, n->o.path.clause);
+}
+
+static int gen_num(Generator *g, struct node *n)
+{
+	// TODO: Use number(const char *)
+
+	int number = atoi(n->src);
+
+	Value v = (Value){ .number = number };
+
+	struct tvalue *tval = tvalue(TYPE_NUMBER, v);
+
+	/* Small numbers used as operands of arithmetic and comparison
+	 * ops are inlined as immediates, and don't end up here. */
+
+	return gen_rk(g, tval);
+}
+
+static int gen_tuple(Generator *g, struct node *n)
+{
+	struct nodelist *ns;
+
+	/* Returned tuples aren't built, their members are returned */
+	if (n->o.tuple.arity > 0 && gen_istail(g, n)) {
+		unsigned base = gen_values(g, n->o.tuple.members, n->o.tuple.arity);
+
+		gen(g, iABC(OP_RETURNN, base, 0, n->o.tuple.arity));
+
+		return base;
+	}
+
+	unsigned reg = nextreg(g);
+
+	gen(g, iABC(OP_TUPLE, reg, n->o.tuple.arity, 0));
+
+	ns = n->o.tuple.members;
+	for (int i = 0; i < n->o.tuple.arity; i++) {
+		gen(g, iABC(OP_SETTUPLE, reg, i, gen_node(g, ns->head)));
+		ns = ns->tail;
+	}
+	return reg;
+}
+
+static int gen_list(Generator *g, struct node *n)
+{
+	unsigned reg = nextreg(g);
+
+	gen(g, iABC(OP_LIST, reg, 0, 0));
+
+	return reg;
+}
+
+static int gen_cons(Generator *g, struct node *n)
+{
+	struct node *lval = n->o.cons.lval,
+	            *rval = n->o.cons.rval;
+
+	unsigned reg = -1;
+
+	if (rval == NULL) {
+		reg = nextreg(g);
+		gen(g, iABC(OP_LIST, reg, 0, 0));
+	} else {
+		reg = gen_cons(g, rval);
+	}
+
+	if (lval)
+		gen(g, iABC(OP_CONS, reg, reg, gen_node(g, lval)));
+
+	return reg;
+}
+
+/*
+ * Check whether `lval` is a tuple of distinct identifiers,
+ * which can be bound to the registers it is unpacked into.
+ */
+static bool gen_isunpack(struct node *lval)
+{
+	if (lval->op != OTUPLE || lval->o.tuple.arity == 0)
+		return false;
+
+	for (struct nodelist *ns = lval->o.tuple.members; ns; ns = ns->tail) {
+		if (ns->head->op != OIDENT)
+			return false;
+
+		for (struct nodelist *ms = ns->tail; ms; ms = ms->tail) {
+			if (! strcmp(ms->head->src, ns->head->src))
+				return false;
+		}
+	}
+	return true;
+}
+
+/*
+ * Bind the identifiers of tuple `lval` to the members of `rval`
+ */
+static int gen_unpack(Generator *g, struct node *lval, struct node *rval)
+{
+	int      arity = lval->o.tuple.arity;
+	unsigned reg   = gen_results(g, rval, arity);
+
+	gen(g, iABC(OP_UNPACK, reg, 0, arity));
+	gen(g, iAJ(OP_JUMP, 0, 0));
+
+	// TODO: gen error in case of bad-match
+
+	struct nodelist *ns = lval->o.tuple.members;
+
+	for (int i = 0; i < arity; i++, ns = ns->tail) {
+		g->path->clause->nlocals ++;
+
+		if (tree_lookup(g->tree, ns->head->src))
+			nreportf(REPORT_ERROR, ns->head, ERR_REDEFINITION, ns->head->src);
+		else
+			define(g, ns->head->src, reg + i);
+	}
+	return 0;
+}
+
+static int gen_bind(Generator *g, struct node *n)
+{
+	struct node *lval = n->o.match.lval,
+	            *rval = n->o.match.rval;
+
+	int lreg, rreg;
+
+	if (gen_isunpack(lval))
+		return gen_unpack(g, lval, rval);
+
+	switch (rval->op) {
+		case OIDENT:
+			rreg = gen_defined(g, rval);
+			if (rreg == -1) {
+				return rreg;
+			}
+			break;
+		case OTUPLE:
+			rreg = gen_tuple(g, rval);
+			break;
+		default:
+			rreg = gen_node(g, rval);
+			break;
+	}
+
+	if (lval->op == OIDENT) {
+		Sym  *ident = tree_lookup(g->tree, lval->src);
+
+		g->path->clause->nlocals ++;
+
+		if (ident) {
+			nreportf(REPORT_ERROR, n, ERR_REDEFINITION, lval->src);
+		} else { /* Create variable binding */
+			lreg = define(g, lval->src, nextreg(g));
+			gen_load(g, lreg, rreg);
+		}
+	} else {
+		// TODO
+	}
+	return 0;
+}
+
+static int gen_match(Generator *g, struct node *n)
+{
+	struct node *lval = n->o.match.lval,
+	            *rval = n->o.match.rval;
+
+	int larg = gen_node(g, lval),
+	    rarg = gen_node(g, rval);
+
+	gen(g, iABC(OP_MATCH, 0, larg, rarg));
+	gen(g, iAJ(OP_JUMP, 0, 0));
+
+	// TODO: gen error in case of bad-match
+
+	return 0;
+}
+
+static int gen_node(Generator *g, struct node *n)
+{
+	return OP_GENERATORS[n->op](g, n);
+}
+
+/*
+ * Check whether pattern `p` binds any variable
+ */
+static bool pattern_binds(struct tvalue *p)
+{
+	switch (TV_TYPE(*p)) {
+		case TYPE_ANY:
+			return true;
+		case TYPE_TUPLE:
+			for (int i = 0; i < TV_TUPLE(*p)->arity; i++) {
+				if (pattern_binds(&TV_TUPLE(*p)->members[i]))
+					return true;
+			}
+			return false;
+		case TYPE_LIST:
+			for (List *l = TV_LIST(*p); l && ! LIST_ISEMPTY(l); l = l->tail) {
+				if (pattern_binds(&l->head))
+					return true;
+			}
+			return false;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Remove the instructions marked as `dead` from clause `c`,
+ * and re-target jumps accordingly. Jumps to a removed
+ * instruction land on the next remaining one.
+ *
+ * Returns the number of instructions removed.
+ */
+static unsigned long gen_compact(ClauseEntry *c, bool *dead)
+{
+	unsigned long *map = malloc(sizeof(*map) * (c->pc + 1)),
+	               n   = 0;
+
+	for (unsigned long i = 0; i < c->pc; i++) {
+		map[i] = n;
+
+		if (! dead[i])
+			n ++;
+	}
+	map[c->pc] = n;
+
+	for (unsigned long i = 0; i < c->pc; i++) {
+		Instruction in = c->code[i];
+		OpCode      o  = iOP(in);
+
+		if (dead[i])
+			continue;
+
+		if (in && OPMODE(o) == AJ) {
+			long target = i + 1 + iJ(in);
+			in = iAJ(o, iA(in), (long)map[target] - (long)map[i] - 1);
+		} else if (OPMODE(o) == JBC) {
+			long target = i + 1 + iA(in);
+			in = iSETA(in, map[target] - map[i] - 1);
+		}
+		c->code[map[i]] = in;
+	}
+	free(map);
+
+	n = c->pc - n;
+	c->pc -= n;
+
+	return n;
+}
+
+/*
+ * Jump-fused variants of test instructions
+ */
+static const OpCode FUSED_JUMPS[] = {
+	[OP_EQ]    = OP_EQJ,
+	[OP_GT]    = OP_GTJ,
+	[OP_MATCH] = OP_MATCHJ,
+	[OP_EQI]   = OP_EQIJ,
+	[OP_GTI]   = OP_GTIJ,
+	[OP_LTI]   = OP_LTIJ
+};
+
+/*
+ * Fuse common instruction sequences into super-instructions:
+ *
+ *     loadk  rA, kD   ; return rA   =>  retk   kD
+ *     move   rA, rB   ; return rA   =>  return rB
+ *     eq     kB, rC   ; jump   J    =>  eqj    J, kB, rC
+ *     gt     kB, rC   ; jump   J    =>  gtj    J, kB, rC
+ *     match  kB, rC   ; jump   J    =>  matchj J, kB, rC
+ *
+ * As well as the immediate variants of `eq` and `gt`.
+ *
+ * The `return` is kept if it is the target of a jump.
+ * `match` is only fused if its pattern doesn't bind
+ * anything, as `A` is otherwise used for the bindings.
+ */
+static void gen_fuse(Generator *g, ClauseEntry *c)
+{
+	bool *target = calloc(c->pc + 1, sizeof(bool)),
+	     *dead   = calloc(c->pc + 1, sizeof(bool));
+
+	for (unsigned long i = 0; i < c->pc; i++) {
+		if (c->code[i] && OPMODE(iOP(c->code[i])) == AJ)
+			target[i + 1 + iJ(c->code[i])] = true;
+	}
+
+	for (unsigned long i = 0; i + 1 < c->pc; i++) {
+		Instruction in   = c->code[i],
+		            next = c->code[i + 1];
+
+		switch (iOP(in)) {
+			case OP_LOADK:
+			case OP_MOVE:
+				if (iOP(next) != OP_RETURN || iA(next) != iA(in))
+					break;
+
+				c->code[i]   = iOP(in) == OP_LOADK ? iAD(OP_RETK, 0, iD(in))
+				                                   : iABC(OP_RETURN, iB(in), 0, 0);
+				dead[i + 1]  = ! target[i + 1];
+				i ++;
+				break;
+			case OP_MATCH:
+				if (! ISK(iB(in)) || pattern_binds(g->kheader[INDEXK(iB(in))]))
+					break;
+				/* Fallthrough */
+			case OP_EQ:  case OP_GT:
+			case OP_EQI: case OP_GTI: case OP_LTI: {
+				OpCode fused = FUSED_JUMPS[iOP(in)];
+
+				if (iOP(next) != OP_JUMP || target[i + 1])
+					break;
+
+				if (iJ(next) < 0 || iJ(next) + 1 > OPMAX_A)
+					break;
+
+				c->code[i]  = iABC(fused, iJ(next) + 1, iB(in), iC(in));
+				dead[i + 1] = true;
+				i ++;
+				break;
+			}
+			default:
+				break;
+		}
+	}
+	gen_compact(c, dead);
+
+	free(target);
+	free(dead);
+}
+
+/*
+ * Mark the registers bound or read by pattern `p` in `regs`
+ */
+static void pattern_regs(struct tvalue *p, bool *regs, int nregs)
+{
+	switch (TV_TYPE(*p)) {
+		case TYPE_ANY:
+		case TYPE_VAR:
+			if (TV_IDENT(*p) < nregs)
+				regs[TV_IDENT(*p)] = true;
+			break;
+		case TYPE_TUPLE:
+			for (int i = 0; i < TV_TUPLE(*p)->arity; i++)
+				pattern_regs(&TV_TUPLE(*p)->members[i], regs, nregs);
+			break;
+		case TYPE_LIST:
+			for (List *l = TV_LIST(*p); l && ! LIST_ISEMPTY(l); l = l->tail)
+				pattern_regs(&l->head, regs, nregs);
+			break;
+		default:
+			break;
+	}
+}
+
+/*
+ * Number of consecutive registers from `A` used by instruction `in`
+ */
+static int op_span(Instruction in)
+{
+	switch (iOP(in)) {
+		case OP_CALLN:
+		case OP_TAILCALLN:
+		case OP_UNPACK:
+		case OP_RETURNN:
+			return iC(in) > 0 ? iC(in) : 1;
+		default:
+			return 1;
+	}
+}
+
+/*
+ * Store the registers in operands `A`, `B` and `C` of instruction
+ * `in` in `regs`, or -1 for operands which aren't registers.
+ */
+static void op_regs(Instruction in, int regs[3])
+{
+	OpCode o = iOP(in);
+
+	regs[0] = AMODE(o) && !(o == OP_RETURN && ISK(iA(in))) ? (int)iA(in) : -1;
+	regs[1] = -1;
+	regs[2] = -1;
+
+	if (OPMODE(o) != ABC && OPMODE(o) != JBC)
+		return;
+
+	if (BMODE(o) == OPARG_R || (BMODE(o) == OPARG_K && !ISK(iB(in))))
+		regs[1] = iB(in);
+	if (CMODE(o) == OPARG_R || (CMODE(o) == OPARG_K && !ISK(iC(in))))
+		regs[2] = iC(in);
+}
+
+/*
+ * Mark the registers of clause `c` which must keep their numbers in
+ * `pinned`: the `nparams` parameters, and registers referred to by
+ * patterns.
+ *
+ * Returns false if the code binds registers through `match`, or
+ * jumps backwards, in which case registers can't be told apart.
+ */
+static bool gen_pinned(Generator *g, ClauseEntry *c, int nparams, bool *pinned)
+{
+	int n = c->nreg;
+
+	for (int r = 0; r < n; r++)
+		pinned[r] = r < nparams;
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+		OpCode      o  = iOP(in);
+
+		if (! in)
+			continue;
+
+		if (o == OP_SEND || o == OP_LAMBDA)
+			return false;
+		if (o == OP_MATCH && ISK(iB(in)) && pattern_binds(g->kheader[INDEXK(iB(in))]))
+			return false;
+		if (OPMODE(o) == AJ && iJ(in) < 0)
+			return false;
+
+		/* Registers named by the patterns this clause refers to */
+		if (o == OP_LOADK || o == OP_RETK)
+			pattern_regs(g->kheader[iD(in)], pinned, n);
+		else if (OPMODE(o) == ABC && BMODE(o) == OPARG_K && ISK(iB(in)))
+			pattern_regs(g->kheader[INDEXK(iB(in))], pinned, n);
+		if (OPMODE(o) == ABC && CMODE(o) == OPARG_K && ISK(iC(in)))
+			pattern_regs(g->kheader[INDEXK(iC(in))], pinned, n);
+
+		if (o == OP_SWITCH || o == OP_SWITCHK) /* Skip the jump table */
+			pc += iC(in) + 1;
+	}
+	return true;
+}
+
+/*
+ * Allocate the registers of clause `c` by their lifetimes, so that
+ * registers of temporaries which are no longer live are reused, and
+ * remove the `move`s between registers which end up the same.
+ *
+ * Code only ever jumps forward, apart from `loop`, after which only
+ * the parameters are live. A register is thus live from the first
+ * instruction it appears in to the last. Registers which are used
+ * together, as by `calln`, are allocated as one consecutive unit.
+ *
+ * Registers pinned by `gen_pinned` keep their numbers. Clauses whose
+ * code binds registers through `match`, or jumps backwards, are left
+ * as they are.
+ */
+static void gen_alloc(Generator *g, ClauseEntry *c, int nparams)
+{
+	int n = c->nreg;
+
+	if (n == 0)
+		return;
+
+	int  unit[n],             /* First register of the unit of a register */
+	     size[n],             /* Registers in a unit */
+	     start[n], end[n],    /* Lifetime of a unit */
+	     map[n],              /* New register of each register */
+	     until[n];            /* Last instruction a new register is used by */
+	bool pinned[n],
+	     joined[n];           /* In the same unit as the previous register */
+
+	for (int r = 0; r < n; r++) {
+		start[r]  = end[r] = -1;
+		map[r]    = r;
+		until[r]  = -1;
+		joined[r] = false;
+	}
+
+	if (! gen_pinned(g, c, nparams, pinned))
+		return;
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+		OpCode      o  = iOP(in);
+		int         regs[3];
+
+		if (! in)
+			continue;
+
+		op_regs(in, regs);
+
+		for (int r = regs[0] + 1; regs[0] >= 0 && r < regs[0] + op_span(in); r++) {
+			if (r >= n)
+				return;
+			joined[r] = true;
+		}
+		if (o == OP_SWITCH || o == OP_SWITCHK) /* Skip the jump table */
+			pc += iC(in) + 1;
+	}
+
+	/* Lifetimes of units, which are pinned if any of their registers is */
+	for (int r = 0; r < n; r++) {
+		unit[r] = joined[r] ? unit[r - 1] : r;
+		size[r] = 0;
+
+		size[unit[r]] ++;
+		pinned[unit[r]] = pinned[unit[r]] || pinned[r];
+	}
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+		int         regs[3];
+
+		if (! in)
+			continue;
+
+		op_regs(in, regs);
+
+		for (int k = 0; k < 3; k++) {
+			int span = k == 0 ? op_span(in) : 1;
+
+			for (int r = regs[k]; r >= 0 && r < regs[k] + span; r++) {
+				if (r >= n)
+					return;
+				if (start[unit[r]] < 0)
+					start[unit[r]] = pc;
+				end[unit[r]] = pc;
+			}
+		}
+		if (iOP(in) == OP_SWITCH || iOP(in) == OP_SWITCHK)
+			pc += iC(in) + 1;
+	}
+
+	int nreg = 0;
+
+	for (int r = 0; r < n; r++) {
+		if (pinned[unit[r]]) {
+			until[r] = INT_MAX;
+			nreg     = r + 1;
+		}
+	}
+
+	/* Allocate units in order of their first instruction */
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		for (int r = 0; r < n; r++) {
+			if (unit[r] != r || pinned[r] || start[r] != (long)pc)
+				continue;
+
+			Instruction in  = c->code[pc];
+			int         reg = -1;
+
+			/* A `move` from a register which isn't used after it
+			 * can use the same register. */
+			if (size[r] == 1 && iOP(in) == OP_MOVE && iA(in) == (unsigned)r) {
+				int b = iB(in);
+
+				if (unit[b] == b && size[b] == 1 && ! pinned[b] &&
+				    start[b] < (long)pc && end[b] == (long)pc)
+					reg = map[b];
+			}
+
+			for (int p = 0; reg < 0 && p + size[r] <= n; p++) {
+				bool free = true;
+
+				for (int k = 0; k < size[r] && free; k++)
+					free = until[p + k] <= (long)pc;
+
+				if (free)
+					reg = p;
+			}
+
+			if (reg < 0) /* Fragmented, keep the registers as they are */
+				return;
+
+			for (int k = 0; k < size[r]; k++) {
+				map[r + k]     = reg + k;
+				until[reg + k] = end[r];
+			}
+			if (reg + size[r] > nreg)
+				nreg = reg + size[r];
+		}
+	}
+
+	/* Rename registers, and remove `move`s to the same register */
+	bool *dead = calloc(c->pc + 1, sizeof(bool));
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+		OpCode      o  = iOP(in);
+		int         regs[3];
+
+		if (! in)
+			continue;
+
+		op_regs(in, regs);
+
+		if (regs[0] >= 0)
+			in = iSETA(in, map[regs[0]]);
+		if (regs[1] >= 0)
+			in = iABC(o, iA(in), map[regs[1]], iC(in));
+		if (regs[2] >= 0)
+			in = iABC(o, iA(in), iB(in), map[regs[2]]);
+
+		c->code[pc] = in;
+		dead[pc]    = o == OP_MOVE && iA(in) == iB(in);
+
+		if (o == OP_SWITCH || o == OP_SWITCHK)
+			pc += iC(in) + 1;
+	}
+	c->nreg = nreg;
+
+	gen_compact(c, dead);
+	free(dead);
+}
+
+/*
+ * Peephole optimizer
+ *
+ * Cleans up the code of a clause as emitted, before registers are
+ * allocated, and again after, as allocation removes `move`s:
+ *
+ *   - Jumps to jumps are threaded to their final target, and jumps
+ *     to the next instruction are removed.
+ *   - Unreachable code, as after tail-calls and returns, is removed.
+ *   - Values are forwarded through `move` and `loadk`, whose target
+ *     register is only read by the next instruction, and results are
+ *     stored straight into the register they are moved to.
+ *   - Pure instructions whose result is never read are removed.
+ *
+ * At `-O2`, jumps to a `return` are also replaced by the `return`
+ * itself, so that each branch of a select returns on its own.
+ */
+
+/* Instructions after which control doesn't carry on to the next one */
+static bool op_ends(OpCode o)
+{
+	switch (o) {
+		case OP_JUMP:     case OP_LOOP:
+		case OP_RETURN:   case OP_RETK:      case OP_RETURNN:
+		case OP_TAILCALL: case OP_TAILCALLN:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Instructions which store a result in register `A` without reading
+ * it, and those of them which have no other effect.
+ */
+static bool op_defines(OpCode o)
+{
+	switch (o) {
+		case OP_MOVE: case OP_LOADK:
+		case OP_ADD:  case OP_SUB:  case OP_ADDI: case OP_SUBI:
+		case OP_GETT: case OP_HEAD: case OP_TAIL:
+		case OP_TUPLE: case OP_LIST: case OP_CONS:
+		case OP_CALL:
+			return true;
+		default:
+			return false;
+	}
+}
+
+static bool op_pure(OpCode o)
+{
+	return op_defines(o) && o != OP_CALL && o != OP_TUPLE && o != OP_CONS;
+}
+
+/* Does instruction `in` read or write register `r` */
+static bool op_mentions(Instruction in, int r)
+{
+	int regs[3];
+
+	op_regs(in, regs);
+
+	return (regs[0] >= 0 && r >= regs[0] && r < regs[0] + op_span(in)) ||
+	       regs[1] == r || regs[2] == r;
 }
 
-static int gen_lt(Generator *g, struct node *n)
+/*
+ * Store the instructions control can go to after instruction `pc` in
+ * `succ`, which must have room for `OPMAX_C + 2` of them, and return
+ * how many there are. The jump following a test, and the jumps of a
+ * `switch` table, are successors in their own right.
+ */
+static int op_successors(ClauseEntry *c, unsigned long pc, unsigned long *succ)
 {
-	int lval = gen_node(g, n->o.cmp.lval),
-	    rval = gen_node(g, n->o.cmp.rval);
-
-	gen(g, iABC(OP_GT, 0, rval, lval));
+	Instruction in = c->code[pc];
+	OpCode      o  = iOP(in);
+	int         n  = 0;
+
+	if (o == OP_SWITCH || o == OP_SWITCHK) {
+		for (int e = 1; e <= iC(in) + 1; e++)
+			succ[n++] = pc + e;
+	} else if (in && o == OP_JUMP) {
+		succ[n++] = pc + 1 + iJ(in);
+	} else if (in && TMODE(o)) {
+		succ[n++] = pc + 1;
+		succ[n++] = pc + 2;
+	} else if (in && OPMODE(o) == JBC) {
+		succ[n++] = pc + 1;
+		succ[n++] = pc + 1 + iA(in);
+	} else if (! in || ! op_ends(o)) {
+		succ[n++] = pc + 1;
+	}
+	return n;
+}
 
-	return -1;
+/*
+ * Mark the jumps of `switch` tables in `table`, and the jumps which
+ * follow a test in `branch`. Neither can be removed or replaced.
+ */
+static void gen_jumpkinds(ClauseEntry *c, bool *table, bool *branch)
+{
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+		OpCode      o  = iOP(in);
+
+		if (o == OP_SWITCH || o == OP_SWITCHK) {
+			for (int e = 1; e <= iC(in) + 1; e++)
+				table[pc + e] = true;
+			pc += iC(in) + 1;
+		} else if (in && TMODE(o) && pc + 1 < c->pc) {
+			branch[pc + 1] = true;
+		}
+	}
 }
 
-static void gen_locals(Generator *g, struct node *n)
+/*
+ * Thread jumps, and remove unreachable code and jumps to the next
+ * instruction. Returns the number of instructions removed.
+ */
+static unsigned long gen_jumps(Generator *g, ClauseEntry *c)
 {
-	switch (n->op) {
-		case OTUPLE:
-			for (struct nodelist *ns = n->o.tuple.members ; ns ; ns = ns->tail) {
-				gen_locals(g, ns->head);
-			}
-			break;
-		case OIDENT: {
-			Sym  *ident = tree_lookup(g->tree, n->src);
+	bool          *table  = calloc(c->pc + 1, sizeof(bool)),
+	              *branch = calloc(c->pc + 1, sizeof(bool)),
+	              *reach  = calloc(c->pc + 1, sizeof(bool)),
+	              *dead   = calloc(c->pc + 1, sizeof(bool));
+	unsigned long *work   = malloc((c->pc + 1) * sizeof(*work)),
+	               succ[OPMAX_C + 2],
+	               nwork  = 0;
 
-			if (! ident) {
-				g->path->clause->nlocals ++;
-				define(g, n->src, nextreg(g));
+	gen_jumpkinds(c, table, branch);
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+
+		if (! in || iOP(in) != OP_JUMP)
+			continue;
+
+		long target = pc + 1 + iJ(in);
+
+		/* A jump which jumps to itself is left to be */
+		for (int hops = 0; hops < 16 && target >= 0 && target < (long)c->pc; hops++) {
+			Instruction t = c->code[target];
+
+			if (! t || iOP(t) != OP_JUMP || table[target] || target == (long)pc)
+				break;
+			target = target + 1 + iJ(t);
+		}
+
+		if (g->optimize >= 2 && ! table[pc] && ! branch[pc] &&
+		    target < (long)c->pc && c->code[target] && iOP(c->code[target]) == OP_RETURN)
+			c->code[pc] = c->code[target];
+		else
+			c->code[pc] = iAJ(OP_JUMP, iA(in), target - (long)pc - 1);
+	}
+
+	reach[0]       = true;
+	work[nwork++]  = 0;
+
+	while (nwork > 0) {
+		unsigned long pc = work[--nwork];
+		int           n  = op_successors(c, pc, succ);
+
+		for (int i = 0; i < n; i++) {
+			if (succ[i] < c->pc && ! reach[succ[i]]) {
+				reach[succ[i]]  = true;
+				work[nwork++]   = succ[i];
 			}
-			break;
 		}
-		case ONUMBER:
-		case OATOM:
-		case OSTRING:
-			gen_node(g, n);
-			break;
-		default:
-			// Ignore
-			break;
 	}
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+
+		if (! in) /* Terminator */
+			continue;
+
+		dead[pc] = ! reach[pc] ||
+		           (iOP(in) == OP_JUMP && iJ(in) == 0 && ! table[pc] && ! branch[pc]);
+	}
+
+	unsigned long n = gen_compact(c, dead);
+
+	free(table), free(branch), free(reach), free(dead), free(work);
+
+	return n;
 }
 
-static int gen_path(Generator *g, struct node *n)
+/* Register sets, for liveness */
+typedef uint64_t RegSet[(OPMAX_A + 1) / 64];
+
+#define REGSET_HAS(s, r)  ((s)[(r) / 64] &   ((uint64_t)1 << ((r) % 64)))
+#define REGSET_ADD(s, r)  ((s)[(r) / 64] |=  ((uint64_t)1 << ((r) % 64)))
+#define REGSET_DEL(s, r)  ((s)[(r) / 64] &= ~((uint64_t)1 << ((r) % 64)))
+
+/*
+ * Store the registers live after instruction `pc` in `out`, from the
+ * registers `live` on entry to each instruction.
+ */
+static void gen_liveout(ClauseEntry *c, unsigned long pc, RegSet *live, RegSet out)
 {
-	char *name = n->o.path.name->src;
+	unsigned long succ[OPMAX_C + 2];
+	int           n = op_successors(c, pc, succ);
 
-	Sym *k = symtab_lookup(g->tree->psymbols, name);
+	memset(out, 0, sizeof(RegSet));
 
-	if (k) {
-		nreportf(REPORT_ERROR, n, "path '%s' already defined.", name);
-		exit(1);
+	for (int i = 0; i < n; i++) {
+		for (int w = 0; succ[i] < c->pc && w < (int)(sizeof(RegSet) / sizeof(uint64_t)); w++)
+			out[w] |= live[succ[i]][w];
 	}
+}
 
-	g->path = g->paths[g->pathsn] = pathentry(name, n, g->pathsn);
+/*
+ * Compute the registers live on entry to each instruction of `c` in
+ * `live`. Code only jumps forward, so a single backward pass will do.
+ * `loop` restarts the clause with the `nparams` parameters.
+ */
+static void gen_liveness(ClauseEntry *c, int nparams, RegSet *live)
+{
+	for (long pc = (long)c->pc - 1; pc >= 0; pc--) {
+		Instruction in = c->code[pc];
+		OpCode      o  = iOP(in);
+		int         regs[3];
 
-	symtab_insert(g->tree->psymbols, name, psymbol(name, g->path));
+		gen_liveout(c, pc, live, live[pc]);
 
-	g->pathsn ++;
+		if (! in)
+			continue;
 
-	return gen_clause(g, n->o.path.clause);
+		op_regs(in, regs);
+
+		if (op_defines(o))
+			REGSET_DEL(live[pc], regs[0]);
+		else
+			for (int r = regs[0]; r >= 0 && r < regs[0] + op_span(in); r++)
+				REGSET_ADD(live[pc], r);
+
+		if (regs[1] >= 0) REGSET_ADD(live[pc], regs[1]);
+		if (regs[2] >= 0) REGSET_ADD(live[pc], regs[2]);
+
+		if (o == OP_LOOP) {
+			for (int r = 0; r < nparams; r++)
+				REGSET_ADD(live[pc], r);
+		}
+	}
 }
 
-static int gen_num(Generator *g, struct node *n)
+/*
+ * Forward the value of `move` or `loadk` instruction `def` into `use`,
+ * the instruction which follows it, replacing the reads of register `A`.
+ * Returns false if `use` can't read the value from its source.
+ */
+static bool gen_forward1(Instruction def, Instruction *use)
 {
-	// TODO: Use number(const char *)
+	OpCode o   = iOP(*use);
+	int    a   = iA(def),
+	       src = iOP(def) == OP_LOADK ? RKASK(iD(def)) : (int)iB(def),
+	       ops[3] = { iA(*use), iB(*use), iC(*use) },
+	       regs[3],
+	       n   = 0;
+
+	if (iOP(def) == OP_LOADK && iD(def) > MAXINDEXRK)
+		return false;
+
+	/* Registers bound by `match` are left alone */
+	if (OPMODE(o) != ABC || o == OP_MATCH)
+		return false;
+
+	op_regs(*use, regs);
+
+	/* Register groups, or `A` operands which are read */
+	if (regs[0] >= 0 && a >= regs[0] && a < regs[0] + op_span(*use) && ! op_defines(o)) {
+		if (o != OP_RETURN)
+			return false;
+		ops[0] = src, n++;
+	}
+	for (int k = 1; k < 3; k++) {
+		if (regs[k] != a)
+			continue;
+		if (ISK(src) && (k == 1 ? BMODE(o) : CMODE(o)) != OPARG_K)
+			return false;
+		ops[k] = src, n++;
+	}
+	if (n == 0)
+		return false;
 
-	int number = atoi(n->src);
+	*use = iABC(o, ops[0], ops[1], ops[2]);
 
-	Value v = (Value){ .number = number };
+	return true;
+}
 
-	struct tvalue *tval = tvalue(TYPE_NUMBER, v);
+/*
+ * Find the `move` which copies the result of instruction `pc` to
+ * another register, within a few instructions which don't refer to
+ * the result. These may only be simple loads and arithmetic, which
+ * can't read a register through a pattern or a list. Returns `c->pc`
+ * if there is none.
+ */
+static unsigned long gen_moveof(ClauseEntry *c, unsigned long pc, bool *target, bool *dead)
+{
+	int a = iA(c->code[pc]);
+
+	for (unsigned long j = pc + 1; j < c->pc && j <= pc + 8; j++) {
+		Instruction in = c->code[j];
+		OpCode      o  = iOP(in);
 
-	// TODO: Think about inlining small numbers
+		if (! in || target[j] || dead[j])
+			break;
+		if (o == OP_MOVE && iB(in) == (unsigned)a)
+			return j;
+		if (op_mentions(in, a))
+			break;
 
-	return RKASK(gen_constant(g, n->src, tval));
+		switch (o) {
+			case OP_MOVE: case OP_LOADK:
+			case OP_ADD:  case OP_SUB:  case OP_ADDI: case OP_SUBI:
+			case OP_GETT: case OP_TUPLE: case OP_SETTUPLE:
+				continue;
+			default:
+				return c->pc;
+		}
+	}
+	return c->pc;
 }
 
-static int gen_tuple(Generator *g, struct node *n)
+/*
+ * Forward values through `move` and `loadk`, and remove pure
+ * instructions whose result is never read. Returns the number of
+ * instructions removed.
+ */
+static unsigned long gen_forward(Generator *g, ClauseEntry *c, int nparams)
 {
-	struct nodelist *ns;
+	int n = c->nreg;
 
-	unsigned reg = nextreg(g);
+	if (n == 0 || n > OPMAX_A + 1)
+		return 0;
 
-	gen(g, iABC(OP_TUPLE, reg, n->o.tuple.arity, 0));
+	bool pinned[n];
 
-	ns = n->o.tuple.members;
-	for (int i = 0; i < n->o.tuple.arity; i++) {
-		gen(g, iABC(OP_SETTUPLE, reg, i, gen_node(g, ns->head)));
-		ns = ns->tail;
+	if (! gen_pinned(g, c, nparams, pinned))
+		return 0;
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		int regs[3];
+
+		op_regs(c->code[pc], regs);
+
+		for (int k = 0; k < 3; k++) {
+			if (regs[k] >= n)
+				return 0;
+		}
 	}
-	return reg;
+
+	RegSet *live   = calloc(c->pc + 1, sizeof(RegSet));
+	bool   *target = calloc(c->pc + 1, sizeof(bool)),
+	       *dead   = calloc(c->pc + 1, sizeof(bool));
+
+	gen_liveness(c, nparams, live);
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		if (c->code[pc] && OPMODE(iOP(c->code[pc])) == AJ)
+			target[pc + 1 + iJ(c->code[pc])] = true;
+	}
+
+	for (unsigned long pc = 0; pc + 1 < c->pc; pc++) {
+		Instruction in   = c->code[pc],
+		            next = c->code[pc + 1];
+		OpCode      o    = iOP(in);
+		int         a    = iA(in);
+
+		if (! in || dead[pc])
+			continue;
+
+		if (o == OP_SWITCH || o == OP_SWITCHK) {
+			pc += iC(in) + 1;
+			continue;
+		}
+		if (! op_defines(o) || pinned[a])
+			continue;
+
+		RegSet after;
+
+		/* Dead stores */
+		if (op_pure(o) && ! REGSET_HAS(live[pc + 1], a)) {
+			dead[pc] = true;
+			continue;
+		}
+		/* `op rA, .. ; .. ; move rB, rA` => `op rB, .. ; ..`, if the
+		 * instructions in between don't refer to either register. */
+		unsigned long j = gen_moveof(c, pc, target, dead);
+
+		if (j < c->pc) {
+			Instruction move = c->code[j];
+			int         b    = iA(move);
+			bool        ok   = b != a;
+
+			for (unsigned long k = pc + 1; ok && k < j; k++)
+				ok = ! op_mentions(c->code[k], b);
+
+			gen_liveout(c, j, live, after);
+
+			if (ok && ! REGSET_HAS(after, a)) {
+				c->code[pc] = iSETA(in, b);
+				dead[j]     = true;
+				continue;
+			}
+		}
+
+		if (target[pc + 1] || ! next || dead[pc + 1])
+			continue;
+
+		gen_liveout(c, pc + 1, live, after);
+
+		/* `move rA, rB ; op .., rA` => `op .., rB` */
+		if ((o == OP_MOVE || o == OP_LOADK) &&
+		    (! REGSET_HAS(after, a) || (op_defines(iOP(next)) && iA(next) == (unsigned)a)) &&
+		    gen_forward1(in, &next)) {
+			c->code[pc + 1] = next;
+			dead[pc]        = true;
+			pc ++;
+		}
+	}
+
+	unsigned long removed = gen_compact(c, dead);
+
+	free(live), free(target), free(dead);
+
+	return removed;
 }
 
-static int gen_list(Generator *g, struct node *n)
+/*
+ * Run the peephole optimizer over clause `c` until it finds nothing
+ * more to remove. Returns the number of instructions removed.
+ */
+static unsigned long gen_peephole(Generator *g, ClauseEntry *c, int nparams)
 {
-	unsigned reg = nextreg(g);
+	unsigned long total = 0, n;
 
-	gen(g, iABC(OP_LIST, reg, 0, 0));
+	do {
+		n  = gen_jumps(g, c);
+		n += gen_forward(g, c, nparams);
 
-	return reg;
+		total += n;
+	} while (n > 0);
+
+	return total;
 }
 
-static int gen_cons(Generator *g, struct node *n)
+/*
+ * Type specialization
+ *
+ * Arithmetic and comparisons fail if their operands aren't numbers.
+ * Past such an instruction, its register operands are known to be
+ * numbers, as are the results of arithmetic, number constants, and
+ * registers which matched a number, until they are overwritten.
+ * Instructions whose operands are all known to be numbers are
+ * replaced by variants which don't check them.
+ */
+
+/* Variant of op-code `o` which doesn't check its operands, if any */
+static OpCode op_unchecked(OpCode o)
 {
-	struct node *lval = n->o.cons.lval,
-	            *rval = n->o.cons.rval;
+	switch (o) {
+		case OP_ADD:  return OP_ADDNN;
+		case OP_SUB:  return OP_SUBNN;
+		case OP_ADDI: return OP_ADDINN;
+		case OP_SUBI: return OP_SUBINN;
+		case OP_GT:   return OP_GTNN;
+		case OP_GTJ:  return OP_GTJNN;
+		case OP_GTI:  return OP_GTINN;
+		case OP_LTI:  return OP_LTINN;
+		case OP_GTIJ: return OP_GTIJNN;
+		case OP_LTIJ: return OP_LTIJNN;
+		default:      return OP_INVALID;
+	}
+}
 
-	unsigned reg = -1;
+/* Is RK operand `x` a number constant, or a register in `nums` */
+static bool gen_isnumber(Generator *g, RegSet nums, int x)
+{
+	if (ISK(x))
+		return TV_TYPE(*g->kheader[INDEXK(x)]) == TYPE_NUMBER;
 
-	if (rval == NULL) {
-		reg = nextreg(g);
-		gen(g, iABC(OP_LIST, reg, 0, 0));
-	} else {
-		reg = gen_cons(g, rval);
-	}
+	return REGSET_HAS(nums, x);
+}
 
-	if (lval)
-		gen(g, iABC(OP_CONS, reg, reg, gen_node(g, lval)));
+/* Merge the registers known to be numbers `nums` into those on entry to `pc` */
+static void gen_flow(ClauseEntry *c, RegSet *known, bool *reached, unsigned long pc, RegSet nums)
+{
+	if (pc >= c->pc)
+		return;
 
-	return reg;
+	if (! reached[pc]) {
+		memcpy(known[pc], nums, sizeof(RegSet));
+		reached[pc] = true;
+	} else {
+		for (int w = 0; w < (int)(sizeof(RegSet) / sizeof(uint64_t)); w++)
+			known[pc][w] &= nums[w];
+	}
 }
 
-static int gen_bind(Generator *g, struct node *n)
+/*
+ * Replace the arithmetic and comparisons of clause `c` whose operands
+ * are known to be numbers by their unchecked variants. Code only jumps
+ * forward, and `loop` restarts the clause, where nothing is known, so
+ * a single forward pass will do.
+ */
+static void gen_specialize(Generator *g, ClauseEntry *c)
 {
-	struct node *lval = n->o.match.lval,
-	            *rval = n->o.match.rval;
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		if (c->code[pc] && OPMODE(iOP(c->code[pc])) == AJ && iJ(c->code[pc]) < 0)
+			return;
+	}
 
-	int lreg, rreg;
+	RegSet *known   = calloc(c->pc + 1, sizeof(RegSet));
+	bool   *reached = calloc(c->pc + 1, sizeof(bool));
+
+	reached[0] = true;
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+		OpCode      o  = iOP(in),
+		            u  = op_unchecked(o);
+		RegSet      nums, pass;
+		int         regs[3];
+
+		if (! in || ! reached[pc])
+			continue;
+
+		memcpy(nums, known[pc], sizeof(RegSet));
+
+		if (u != OP_INVALID && gen_isnumber(g, nums, iB(in)) &&
+		    (CMODE(o) != OPARG_K || gen_isnumber(g, nums, iC(in))))
+			c->code[pc] = in = iABC(u, iA(in), iB(in), iC(in));
+
+		op_regs(in, regs);
+
+		switch (o) {
+			case OP_ADD:  case OP_SUB:  case OP_ADDI: case OP_SUBI:
+			case OP_GT:   case OP_GTJ:  case OP_GTI:  case OP_LTI:
+			case OP_GTIJ: case OP_LTIJ:
+				if (regs[1] >= 0) REGSET_ADD(nums, regs[1]);
+				if (regs[2] >= 0) REGSET_ADD(nums, regs[2]);
+				if (op_defines(o))
+					REGSET_ADD(nums, regs[0]);
+				break;
+			case OP_MOVE:
+				if (REGSET_HAS(nums, iB(in)))
+					REGSET_ADD(nums, iA(in));
+				else
+					REGSET_DEL(nums, iA(in));
+				break;
+			case OP_LOADK:
+				if (TV_TYPE(*g->kheader[iD(in)]) == TYPE_NUMBER)
+					REGSET_ADD(nums, iA(in));
+				else
+					REGSET_DEL(nums, iA(in));
+				break;
+			case OP_MATCH: /* Binds registers */
+				memset(nums, 0, sizeof(RegSet));
+				break;
+			default:
+				for (int r = regs[0]; r >= 0 && r < regs[0] + op_span(in); r++)
+					REGSET_DEL(nums, r);
+				break;
+		}
 
-	switch (rval->op) {
-		case OIDENT:
-			rreg = gen_defined(g, rval);
-			if (rreg == -1) {
-				return rreg;
-			}
-			break;
-		case OTUPLE:
-			rreg = gen_tuple(g, rval);
-			break;
-		default:
-			rreg = gen_node(g, rval);
-			break;
+		/* Registers known to be numbers if a test passes */
+		memcpy(pass, nums, sizeof(RegSet));
+
+		if ((o == OP_EQI || o == OP_EQIJ) && regs[1] >= 0)
+			REGSET_ADD(pass, regs[1]);
+
+		if (o == OP_EQV && regs[1] >= 0 && ISK(iC(in)) && gen_isnumber(g, nums, iC(in)))
+			REGSET_ADD(pass, regs[1]);
+		if (o == OP_EQV && regs[2] >= 0 && ISK(iB(in)) && gen_isnumber(g, nums, iB(in)))
+			REGSET_ADD(pass, regs[2]);
+
+		if (o == OP_SWITCH) { /* Only numbers are looked up in the table */
+			memcpy(pass, nums, sizeof(RegSet));
+			REGSET_ADD(pass, iA(in));
+
+			for (int e = 1; e <= iC(in); e++)
+				gen_flow(c, known, reached, pc + e, pass);
+			gen_flow(c, known, reached, pc + iC(in) + 1, nums);
+		} else if (o == OP_SWITCHK) {
+			for (int e = 1; e <= iC(in) + 1; e++)
+				gen_flow(c, known, reached, pc + e, nums);
+		} else if (o == OP_JUMP) {
+			gen_flow(c, known, reached, pc + 1 + iJ(in), nums);
+		} else if (TMODE(o)) {
+			gen_flow(c, known, reached, pc + 1, nums);
+			gen_flow(c, known, reached, pc + 2, pass);
+		} else if (OPMODE(o) == JBC) {
+			gen_flow(c, known, reached, pc + 1, pass);
+			gen_flow(c, known, reached, pc + 1 + iA(in), nums);
+		} else if (! op_ends(o)) {
+			gen_flow(c, known, reached, pc + 1, nums);
+		}
 	}
+	free(known), free(reached);
+}
 
-	if (lval->op == OIDENT) {
-		Sym  *ident = tree_lookup(g->tree, lval->src);
+/*
+ * Escape analysis
+ *
+ * Tuples and lists are built on the heap, as they may outlive the
+ * clause which builds them. Those which are only ever tested and
+ * taken apart by that clause, as when a select is made over a tuple
+ * of arguments, don't: they are built in registers past the locals
+ * of the clause instead, see `tuplef`, `listf` and `consf`. These
+ * are part of the frame, so they are reclaimed when the clause
+ * returns or tail-calls, and reused when it loops.
+ */
 
-		g->path->clause->nlocals ++;
+/* Frame-local variant of allocation `o`, if any */
+static OpCode op_local(OpCode o)
+{
+	switch (o) {
+		case OP_TUPLE: return OP_TUPLEF;
+		case OP_LIST:  return OP_LISTF;
+		case OP_CONS:  return OP_CONSF;
+		default:       return OP_INVALID;
+	}
+}
 
-		if (ident) {
-			nreportf(REPORT_ERROR, n, ERR_REDEFINITION, lval->src);
-		} else { /* Create variable binding */
-			lreg = define(g, lval->src, nextreg(g));
-			if (ISK(rreg)) {
-				gen(g, iAD(OP_LOADK, lreg, rreg));
-			} else {
-				gen(g, iABC(OP_MOVE, lreg, rreg, 0));
-			}
-		}
-	} else {
-		// TODO
+/* Number of registers taken by the value built by allocation `in` */
+static int op_scratch(Instruction in)
+{
+	size_t size = iOP(in) == OP_TUPLE ? sizeof(Tuple) + sizeof(struct tvalue) * iB(in)
+	                                  : sizeof(List);
+
+	return (size + sizeof(struct tvalue) - 1) / sizeof(struct tvalue);
+}
+
+/* Add register `a` to `s` if register `b` is in it, else remove it */
+static void regset_follow(RegSet s, int a, int b)
+{
+	if (REGSET_HAS(s, b))
+		REGSET_ADD(s, a);
+	else
+		REGSET_DEL(s, a);
+}
+
+/* Merge the registers `regs` into those on entry to `pc`, as their union or intersection */
+static void gen_merge(ClauseEntry *c, RegSet *sets, bool *reached, unsigned long pc, RegSet regs, bool all)
+{
+	if (pc >= c->pc)
+		return;
+
+	for (int w = 0; w < (int)(sizeof(RegSet) / sizeof(uint64_t)); w++) {
+		if (! reached[pc])
+			sets[pc][w] = regs[w];
+		else if (all)
+			sets[pc][w] &= regs[w];
+		else
+			sets[pc][w] |= regs[w];
 	}
-	return 0;
 }
 
-static int gen_match(Generator *g, struct node *n)
+/*
+ * Does the value built by allocation `pc` of clause `c` escape it?
+ *
+ * The registers which may hold the value, or a list it is the tail
+ * of, are tracked forward from `pc`. These may be tested and taken
+ * apart, copied, and consed onto, but the value escapes if it is
+ * read in any other way, as by a `return`, a call, or a `match`,
+ * which may bind it, or if it is stored in a tuple or list.
+ *
+ * The registers which must hold the value itself are tracked too,
+ * as tests of these are known to pass or fail. This matters, as
+ * a select returns its value if no pattern matches it.
+ */
+static bool gen_escapes(ClauseEntry *c, int nparams, unsigned long pc)
 {
-	struct node *lval = n->o.match.lval,
-	            *rval = n->o.match.rval;
+	Instruction def     = c->code[pc];
+	RegSet     *holds   = calloc(c->pc + 1, sizeof(RegSet));
+	RegSet     *musts   = calloc(c->pc + 1, sizeof(RegSet));
+	bool       *reached = calloc(c->pc + 1, sizeof(bool));
+	bool        escapes = false;
+
+	REGSET_ADD(holds[pc + 1], iA(def));
+	REGSET_ADD(musts[pc + 1], iA(def));
+	reached[pc + 1] = true;
+
+	for (unsigned long n = pc + 1; n < c->pc && ! escapes; n++) {
+		Instruction   in      = c->code[n];
+		OpCode        o       = iOP(in);
+		int           outcome = -1; /* Of a test, if known */
+		RegSet        h, m;
+		int           regs[3];
+		unsigned long succ[OPMAX_C + 2];
+
+		if (! in || ! reached[n])
+			continue;
+
+		memcpy(h, holds[n], sizeof(RegSet));
+		memcpy(m, musts[n], sizeof(RegSet));
+		op_regs(in, regs);
+
+		switch (o) {
+			case OP_TESTT:
+				if (REGSET_HAS(m, regs[1]))
+					outcome = iOP(def) == OP_TUPLE && iB(def) == iC(in);
+				break;
+			case OP_TESTL: /* `list` builds an empty list, `cons` a non-empty one */
+				if (REGSET_HAS(m, regs[1]))
+					outcome = iOP(def) == OP_TUPLE ? 0 : iC(in) == 2 || iC(in) == (iOP(def) == OP_CONS);
+				break;
+			case OP_EQV:
+				break;
+			case OP_GETT: case OP_HEAD:
+				REGSET_DEL(h, regs[0]);
+				REGSET_DEL(m, regs[0]);
+				break;
+			case OP_MOVE:
+				regset_follow(h, regs[0], regs[1]);
+				regset_follow(m, regs[0], regs[1]);
+				break;
+			case OP_TAIL:
+				regset_follow(h, regs[0], regs[1]);
+				REGSET_DEL(m, regs[0]);
+				break;
+			case OP_SETTUPLE:
+				escapes = regs[2] >= 0 && REGSET_HAS(h, regs[2]);
+				break;
+			case OP_CONS:
+				escapes = regs[2] >= 0 && REGSET_HAS(h, regs[2]);
+
+				regset_follow(h, regs[0], regs[1]);
+				REGSET_DEL(m, regs[0]);
+				break;
+			default:
+				for (int k = 1; k < 3; k++)
+					escapes |= regs[k] >= 0 && REGSET_HAS(h, regs[k]);
+
+				if (op_defines(o)) {
+					REGSET_DEL(h, regs[0]);
+					REGSET_DEL(m, regs[0]);
+					break;
+				}
+				for (int r = regs[0]; r >= 0 && r < regs[0] + op_span(in); r++)
+					escapes |= REGSET_HAS(h, r);
 
-	int larg = gen_node(g, lval),
-	    rarg = gen_node(g, rval);
+				if (o == OP_LOOP) { /* Passes the parameters on */
+					for (int r = 0; r < nparams; r++)
+						escapes |= REGSET_HAS(h, r);
+				}
+				if (o == OP_MATCH) /* May bind registers */
+					memset(m, 0, sizeof(RegSet));
+				break;
+		}
 
-	gen(g, iABC(OP_MATCH, 0, larg, rarg));
-	gen(g, iAJ(OP_JUMP, 0, 0));
+		int ns = op_successors(c, n, succ);
 
-	// TODO: gen error in case of bad-match
+		for (int i = 0; i < ns; i++) {
+			if (TMODE(o) && outcome == (succ[i] == n + 1)) /* Jump taken if the test fails */
+				continue;
 
-	return 0;
+			gen_merge(c, holds, reached, succ[i], h, false);
+			gen_merge(c, musts, reached, succ[i], m, true);
+
+			if (succ[i] < c->pc)
+				reached[succ[i]] = true;
+		}
+	}
+	free(holds), free(musts), free(reached);
+
+	return escapes;
 }
 
-static int gen_node(Generator *g, struct node *n)
+/*
+ * Replace the allocations of clause `c` whose value doesn't escape
+ * it by their frame-local variants, growing its registers to hold
+ * them. Each allocation has registers of its own, as code only jumps
+ * forward, so it runs at most once per call of the clause.
+ */
+static void gen_escape(Generator *g, ClauseEntry *c, int nparams)
 {
-	return OP_GENERATORS[n->op](g, n);
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+		OpCode      o  = iOP(in);
+
+		if (o == OP_SEND || o == OP_LAMBDA)
+			return;
+		if (in && OPMODE(o) == AJ && iJ(in) < 0)
+			return;
+	}
+
+	for (unsigned long pc = 0; pc < c->pc; pc++) {
+		Instruction in = c->code[pc];
+		OpCode      o  = iOP(in);
+		int         r  = c->nreg;
+
+		if (! in || op_local(o) == OP_INVALID)
+			continue;
+		if (o == OP_CONS && iA(in) != iB(in)) /* `consf` has no room for `B` */
+			continue;
+		if (r + op_scratch(in) > OPMAX_A || gen_escapes(c, nparams, pc))
+			continue;
+
+		switch (o) {
+			case OP_TUPLE: c->code[pc] = iABC(OP_TUPLEF, iA(in), iB(in), r); break;
+			case OP_LIST:  c->code[pc] = iABC(OP_LISTF,  iA(in), 0,      r); break;
+			default:       c->code[pc] = iABC(OP_CONSF,  iA(in), r,  iC(in)); break;
+		}
+		c->nreg += op_scratch(in);
+		g->nframed ++;
+	}
 }
 
 static void dump_atom(struct node *n, FILE *out)
@@ -768,55 +3056,62 @@ static void dump_pattern(struct node *pattern, FILE *out)
 static void dump_constant(struct tvalue *tval, FILE *out)
 {
 	/* Write constant type */
-	fputc(tval->t, out);
+	fputc(TV_TAG(*tval), out);
 
 	/* Write constant value */
-	switch (tval->t & TYPE_MASK) {
-		case TYPE_PATHID:
-			fwrite(tval->v.pathid->module, strlen(tval->v.pathid->module), 1, out);
+	switch (TV_TYPE(*tval)) {
+		case TYPE_PATHID: {
+			struct PathID *id = TV_PATHID(*tval);
+
+			fwrite(id->module, strlen(id->module), 1, out);
 			fputc('\0', out);
-			fwrite(tval->v.pathid->path,   strlen(tval->v.pathid->path), 1, out);
+			fwrite(id->path,   strlen(id->path), 1, out);
 			fputc('\0', out);
 			break;
+		}
 		case TYPE_BIN:
 		case TYPE_STRING:
 			assert(0);
 			break;
 		case TYPE_TUPLE: {
-			uint8_t arity = tval->v.tuple->arity;
+			uint8_t arity = TV_TUPLE(*tval)->arity;
 			fputc(arity, out);
 			for (int i = 0; i < arity; i++) {
-				dump_constant(&tval->v.tuple->members[i], out);
+				dump_constant(&TV_TUPLE(*tval)->members[i], out);
 			}
 			break;
 		}
 		case TYPE_LIST: {
 			size_t len = 0;
 
-			for (List *l = tval->v.list; l; l = l->tail)
+			for (List *l = TV_LIST(*tval); l; l = l->tail)
 				len ++;
 
 			len --; // Account for empty list
 
 			fwrite(&len, sizeof(len), 1, out);
 
-			List *l = tval->v.list;
+			List *l = TV_LIST(*tval);
 			for (int i = 0; i < len; i++) {
-				dump_constant(l->head, out);
+				dump_constant(&l->head, out);
 				l = l->tail;
 			}
 			break;
 		}
 		case TYPE_ATOM:
-			fwrite(tval->v.atom, strlen(tval->v.atom) + 1, 1, out);
+			fwrite(TV_ATOM(*tval), strlen(TV_ATOM(*tval)) + 1, 1, out);
 			break;
-		case TYPE_NUMBER:
-			fwrite(&tval->v.number, sizeof(int), 1, out);
+		case TYPE_NUMBER: {
+			int number = TV_NUMBER(*tval);
+			fwrite(&number, sizeof(number), 1, out);
 			break;
+		}
 		case TYPE_VAR:
-		case TYPE_ANY:
-			fwrite(&tval->v.ident, sizeof(tval->v.ident), 1, out);
+		case TYPE_ANY: {
+			unsigned char ident = TV_IDENT(*tval);
+			fwrite(&ident, sizeof(ident), 1, out);
 			break;
+		}
 		default:
 			assert(0);
 			break;
@@ -825,24 +3120,12 @@ static void dump_constant(struct tvalue *tval, FILE *out)
 
 static void dump_clause(ClauseEntry *c, FILE *out)
 {
-	struct tvalue *tval;
-
 	/* Write clause pattern */
 	dump_pattern(c->node->o.clause.lval, out);
 
 	/* Write local variable count */
 	fputc(c->nreg, out);
 
-	/* Write table entry count */
-	fputc(c->kindex, out);
-
-	/* Write header */
-	for (int i = 0; i < c->kindex; i++) {
-		tval = c->kheader[i];
-
-		/* Write constant */
-		dump_constant(tval, out);
-	}
 	/* Write byte-code length */
 	fwrite(&c->pc, sizeof(c->pc), 1, out);
 
@@ -13,11 +13,22 @@ typedef struct {
 	PathEntry     **paths;
 	struct module  *module;
 	struct node    *block; /* Current block */
+	struct node    *tail;  /* Block or select whose value is returned */
 	int             env; /* Index of root module */
 	int             head;
 	char           *out;
 	unsigned        pathsn; /* TODO: Rename to `npaths` */
 	uint8_t         slot;
+	int             optimize;  /* Optimization level, from `-O` */
+	unsigned long   ninstrs;   /* Instructions emitted */
+	unsigned long   nremoved;  /* Instructions optimized away */
+	unsigned long   nframed;   /* Tuples and lists built in frames, see `gen_escape` */
+
+	/* Constant pool, shared by all clauses */
+	SymTable       *ktable;
+	struct tvalue **kheader;
+	unsigned        kindex;
+	unsigned        ksize;
 } Generator;
 
 Generator *generator (Tree *tree, struct source *source);
@@ -0,0 +1,500 @@
+/*
+ * arbre
+ *
+ * (c) 2011-2012, Alexis Sellier
+ *
+ * jit.c
+ *
+ *   baseline x86-64 compiler for hot clauses
+ *
+ */
+#define _DEFAULT_SOURCE /* For `MAP_ANONYMOUS` */
+
+#include <stdbool.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <unistd.h>
+
+#include "value.h"
+#include "op.h"
+#include "runtime.h"
+#include "vm.h"
+#include "jit.h"
+#include "error.h"
+#include "assert.h"
+
+/*
+ * Whether op-code `o` can be compiled to native code, by
+ * the JIT or ahead of time.
+ */
+bool jit_compiles(OpCode o)
+{
+	switch (o) {
+		case OP_MOVE:
+		case OP_LOADK:
+		case OP_JUMP:
+		case OP_LOOP:
+		case OP_ADD:   case OP_ADDNN:
+		case OP_SUB:   case OP_SUBNN:
+		case OP_ADDI:  case OP_ADDINN:
+		case OP_SUBI:  case OP_SUBINN:
+		case OP_GT:    case OP_GTNN:
+		case OP_GTJ:   case OP_GTJNN:
+		case OP_GTI:   case OP_GTINN:
+		case OP_LTI:   case OP_LTINN:
+		case OP_GTIJ:  case OP_GTIJNN:
+		case OP_LTIJ:  case OP_LTIJNN:
+		case OP_EQ:
+		case OP_EQJ:
+		case OP_EQI:
+		case OP_EQIJ:
+		case OP_EQV:
+			return true;
+		default:
+			return false;
+	}
+}
+
+#if defined(VM_JIT)
+
+#include <sys/mman.h>
+
+/*
+ * Each instruction is translated on its own, into a fixed template
+ * of machine code. Registers are read from and written back to the
+ * frame, which the generated code gets in `rdi`, and constants are
+ * read from `rsi`. A pointer to the credits of the process is kept in
+ * `r8`. Only `rax`, `rcx`, `rdx` and `r8` are used, so no register
+ * has to be saved.
+ *
+ * Instructions which aren't compiled, like calls and returns, are
+ * compiled into a stub which returns to the interpreter.
+ */
+
+#define RAX  0
+#define RCX  1
+#define RDX  2
+
+/* Condition codes of `jcc` */
+#define CC_JMP  -1
+#define CC_E    0x4
+#define CC_NE   0x5
+#define CC_L    0xc
+#define CC_LE   0xe
+#define CC_G    0xf
+
+/* Invert condition code `cc` */
+#define CC_NOT(cc)  ((cc) ^ 1)
+
+/*
+ * A `rel32` operand, to be patched once the code of
+ * instruction `target` or a stub is emitted.
+ */
+struct fixup {
+	size_t         at;
+	long           target;  /* Instruction, or `-1` for a stub */
+	unsigned long  ret;     /* Return value of the stub */
+};
+
+typedef struct {
+	uint8_t        *code;
+	size_t          len;
+	size_t          cap;
+	size_t         *labels;  /* Offset of each instruction */
+	struct fixup   *fixups;
+	size_t          nfixups;
+	size_t          capfixups;
+} Assembler;
+
+static void emit(Assembler *as, int n, ...)
+{
+	va_list ap;
+
+	if (as->len + n > as->cap) {
+		as->cap  = as->cap * 2 + n;
+		as->code = realloc(as->code, as->cap);
+	}
+
+	va_start(ap, n);
+	for (int i = 0; i < n; i++)
+		as->code[as->len++] = (uint8_t)va_arg(ap, int);
+	va_end(ap);
+}
+
+static void emit32(Assembler *as, uint32_t v)
+{
+	emit(as, 4, v & 0xff, (v >> 8) & 0xff, (v >> 16) & 0xff, v >> 24);
+}
+
+static void emit64(Assembler *as, uint64_t v)
+{
+	emit32(as, (uint32_t)v);
+	emit32(as, (uint32_t)(v >> 32));
+}
+
+/*
+ * Emit a `rel32` placeholder for a jump to instruction `target`,
+ * or if `target` is `-1`, to a stub returning `ret`.
+ */
+static void emit_rel32(Assembler *as, long target, unsigned long ret)
+{
+	if (as->nfixups == as->capfixups) {
+		as->capfixups = as->capfixups * 2 + 16;
+		as->fixups    = realloc(as->fixups, sizeof(struct fixup) * as->capfixups);
+	}
+	as->fixups[as->nfixups++] = (struct fixup){ as->len, target, ret };
+
+	emit32(as, 0);
+}
+
+/* `mov eax, ret; ret` */
+static void emit_return(Assembler *as, unsigned long ret)
+{
+	emit(as, 1, 0xb8);
+	emit32(as, (uint32_t)ret);
+	emit(as, 1, 0xc3);
+}
+
+/* `mov reg, [rdi + 8 * r]` */
+static void emit_loadr(Assembler *as, int reg, OpArg r)
+{
+	emit(as, 3, 0x48, 0x8b, 0x87 | (reg << 3));
+	emit32(as, r * sizeof(struct tvalue));
+}
+
+/* `mov [rdi + 8 * r], rax` */
+static void emit_store(Assembler *as, OpArg r)
+{
+	emit(as, 3, 0x48, 0x89, 0x87);
+	emit32(as, r * sizeof(struct tvalue));
+}
+
+/* `mov reg, imm64` */
+static void emit_imm64(Assembler *as, int reg, uint64_t v)
+{
+	emit(as, 2, 0x48, 0xb8 + reg);
+	emit64(as, v);
+}
+
+/* `mov reg, [rsi + 8 * k]` */
+static void emit_loadk(Assembler *as, int reg, unsigned k)
+{
+	emit(as, 3, 0x48, 0x8b, 0x86 | (reg << 3));
+	emit32(as, k * sizeof(struct tvalue));
+}
+
+/* Load RK operand `x` into `reg` */
+static void emit_loadrk(Assembler *as, int reg, OpArg x)
+{
+	if (ISK(x))
+		emit_loadk(as, reg, INDEXK(x));
+	else
+		emit_loadr(as, reg, x);
+}
+
+/*
+ * Check that `reg` holds a number, else return to the interpreter,
+ * to run instruction `n` with its generic handler.
+ */
+static void emit_checknum(Assembler *as, int reg, unsigned long n)
+{
+	emit(as, 2, 0x89, 0xc0 | (reg << 3) | RDX);  /* mov edx, reg */
+	emit(as, 3, 0x83, 0xe2, TYPE_MASK);          /* and edx, TYPE_MASK */
+	emit(as, 3, 0x83, 0xfa, TYPE_NUMBER);        /* cmp edx, TYPE_NUMBER */
+	emit(as, 2, 0x0f, 0x80 | CC_NE);             /* jne stub */
+	emit_rel32(as, -1, n << 1 | 1);
+}
+
+/* `shr reg, TV_TAGBITS`, leaving the number in the low half of `reg` */
+static void emit_untag(Assembler *as, int reg)
+{
+	emit(as, 4, 0x48, 0xc1, 0xe8 | reg, TV_TAGBITS);
+}
+
+/* Tag the number in `eax` */
+static void emit_tag(Assembler *as)
+{
+	emit(as, 4, 0x48, 0xc1, 0xe0, TV_TAGBITS);   /* shl rax, TV_TAGBITS */
+	emit(as, 4, 0x48, 0x83, 0xc8, TYPE_NUMBER);  /* or rax, TYPE_NUMBER */
+}
+
+/*
+ * Jump from instruction `n` to instruction `target`, if condition
+ * `cc` holds. Backward jumps spend a credit, and return to the
+ * interpreter to yield once the process runs out of them.
+ */
+static void emit_goto(Assembler *as, int cc, unsigned long n, long target)
+{
+	if (target > (long)n) {
+		if (cc == CC_JMP)
+			emit(as, 1, 0xe9);
+		else
+			emit(as, 2, 0x0f, 0x80 | cc);
+
+		emit_rel32(as, target, 0);
+		return;
+	}
+
+	if (cc != CC_JMP)
+		emit(as, 2, 0x70 | CC_NOT(cc), 16);  /* Skip the next 16 bytes */
+
+	emit(as, 5, 0x66, 0x41, 0x83, 0x28, 0x01);  /* sub word [r8], 1 */
+	emit(as, 2, 0x0f, 0x80 | CC_E);           /* jz stub */
+	emit_rel32(as, -1, (unsigned long)target << 1);
+	emit(as, 1, 0xe9);                        /* jmp target */
+	emit_rel32(as, target, 0);
+}
+
+/*
+ * Compile instruction `n` of clause `c`.
+ */
+static void jit_instruction(Assembler *as, struct clause *c, unsigned long n)
+{
+	Instruction i = c->code[n];
+	OpCode      o = iOP(i);
+
+	/* Test instructions skip the following jump if they hold,
+	 * which is compiled next, and JBC instructions skip `A`
+	 * instructions if they don't. */
+	long pass = TMODE(o) ? (long)n + 2 : (long)n + 1,
+	     fail = (long)n + 1 + iA(i);
+
+	bool checked = false;
+	int  cc      = CC_JMP;
+
+	switch (o) {
+		case OP_MOVE:
+			emit_loadr(as, RAX, iB(i));
+			emit_store(as, iA(i));
+			return;
+
+		case OP_LOADK:
+			emit_loadk(as, RAX, iD(i));
+			emit_store(as, iA(i));
+			return;
+
+		case OP_JUMP:
+			emit_goto(as, CC_JMP, n, (long)n + 1 + iJ(i));
+			return;
+
+		case OP_LOOP:
+			emit_goto(as, CC_JMP, n, 0);
+			return;
+
+		case OP_ADD:
+		case OP_SUB:
+			checked = true;
+			/* Fallthrough */
+		case OP_ADDNN:
+		case OP_SUBNN:
+			emit_loadrk(as, RAX, iB(i));
+			emit_loadrk(as, RCX, iC(i));
+
+			if (checked) {
+				emit_checknum(as, RAX, n);
+				emit_checknum(as, RCX, n);
+			}
+			emit_untag(as, RAX);
+			emit_untag(as, RCX);
+
+			if (o == OP_ADD || o == OP_ADDNN)
+				emit(as, 2, 0x01, 0xc8);  /* add eax, ecx */
+			else
+				emit(as, 2, 0x29, 0xc8);  /* sub eax, ecx */
+
+			emit_tag(as);
+			emit_store(as, iA(i));
+			return;
+
+		case OP_ADDI:
+		case OP_SUBI:
+			checked = true;
+			/* Fallthrough */
+		case OP_ADDINN:
+		case OP_SUBINN:
+			emit_loadrk(as, RAX, iB(i));
+
+			if (checked)
+				emit_checknum(as, RAX, n);
+
+			emit_untag(as, RAX);
+
+			if (o == OP_ADDI || o == OP_ADDINN)
+				emit(as, 1, 0x05);        /* add eax, imm32 */
+			else
+				emit(as, 1, 0x2d);        /* sub eax, imm32 */
+
+			emit32(as, (uint32_t)(int32_t)iSC(i));
+			emit_tag(as);
+			emit_store(as, iA(i));
+			return;
+
+		case OP_GT:
+		case OP_GTJ:
+			checked = true;
+			/* Fallthrough */
+		case OP_GTNN:
+		case OP_GTJNN:
+			emit_loadrk(as, RAX, iB(i));
+			emit_loadrk(as, RCX, iC(i));
+
+			if (checked) {
+				emit_checknum(as, RAX, n);
+				emit_checknum(as, RCX, n);
+			}
+			emit_untag(as, RAX);
+			emit_untag(as, RCX);
+			emit(as, 2, 0x39, 0xc8);          /* cmp eax, ecx */
+			cc = CC_G;
+			break;
+
+		case OP_GTI:
+		case OP_LTI:
+		case OP_GTIJ:
+		case OP_LTIJ:
+			checked = true;
+			/* Fallthrough */
+		case OP_GTINN:
+		case OP_LTINN:
+		case OP_GTIJNN:
+		case OP_LTIJNN:
+			emit_loadrk(as, RAX, iB(i));
+
+			if (checked)
+				emit_checknum(as, RAX, n);
+
+			emit_untag(as, RAX);
+			emit(as, 1, 0x3d);                /* cmp eax, imm32 */
+			emit32(as, (uint32_t)(int32_t)iSC(i));
+
+			cc = (o == OP_GTI  || o == OP_GTINN ||
+			      o == OP_GTIJ || o == OP_GTIJNN) ? CC_G : CC_L;
+			break;
+
+		case OP_EQ:
+		case OP_EQJ:
+		case OP_EQV:
+			emit_loadrk(as, RAX, iB(i));
+			emit_loadrk(as, RCX, iC(i));
+			emit(as, 3, 0x48, 0x39, 0xc8);    /* cmp rax, rcx */
+			cc = CC_E;
+			break;
+
+		case OP_EQI:
+		case OP_EQIJ:
+			emit_loadrk(as, RAX, iB(i));
+			emit_imm64(as, RCX, TVNUMBER(iSC(i)).word);
+			emit(as, 3, 0x48, 0x39, 0xc8);    /* cmp rax, rcx */
+			cc = CC_E;
+			break;
+
+		default:
+			assert(0);
+	}
+
+	/* Test instructions fall through to their jump if they fail,
+	 * JBC instructions to the next instruction if they pass. */
+	if (TMODE(o))
+		emit_goto(as, cc, n, pass);
+	else
+		emit_goto(as, CC_NOT(cc), n, fail);
+}
+
+/*
+ * Compile clause `c` into native code. Returns `NULL` if none
+ * of its instructions can be compiled.
+ */
+struct native *jit_compile(struct clause *c)
+{
+	Assembler as = { NULL, 0, 0, NULL, NULL, 0, 0 };
+	bool     *compiled = malloc(sizeof(bool) * c->codelen);
+	unsigned long ncompiled = 0;
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		if ((compiled[n] = jit_compiles(iOP(c->code[n]))))
+			ncompiled ++;
+	}
+	if (ncompiled == 0) {
+		free(compiled);
+		return NULL;
+	}
+
+	as.labels = malloc(sizeof(size_t) * c->codelen);
+
+	/* Jump to the entry point of instruction `n`, from
+	 * the table which follows the code. */
+	emit(&as, 3, 0x49, 0x89, 0xd0);  /* mov r8, rdx */
+	emit(&as, 3, 0x48, 0x8d, 0x05);  /* lea rax, [rip + table] */
+	emit32(&as, 0);
+	emit(&as, 3, 0xff, 0x24, 0xc8);  /* jmp [rax + rcx * 8] */
+
+	size_t lea = as.len - 3;
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		as.labels[n] = as.len;
+
+		if (compiled[n])
+			jit_instruction(&as, c, n);
+		else
+			emit_return(&as, n << 1);
+	}
+
+	/* Resolve jumps, emitting stubs at the end of the code */
+	for (size_t f = 0; f < as.nfixups; f++) {
+		struct fixup *fx = &as.fixups[f];
+		size_t        to;
+
+		if (fx->target >= 0 && fx->target < (long)c->codelen) {
+			to = as.labels[fx->target];
+		} else {
+			to = as.len;
+			emit_return(&as, fx->target >= 0 ? (unsigned long)fx->target << 1 : fx->ret);
+		}
+		int32_t rel = (int32_t)(to - (fx->at + 4));
+		memcpy(as.code + fx->at, &rel, sizeof(rel));
+	}
+
+	while (as.len % sizeof(void *))
+		emit(&as, 1, 0xcc);  /* int3 */
+
+	size_t  table = as.len;
+	int32_t rel   = (int32_t)(table - lea);
+
+	memcpy(as.code + lea - 4, &rel, sizeof(rel));
+
+	long    page = sysconf(_SC_PAGESIZE);
+	size_t  len  = table + sizeof(void *) * c->codelen,
+	        size = (len + page - 1) & ~(size_t)(page - 1);
+	uint8_t *mem = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (mem == MAP_FAILED)
+		error(1, errno, "couldn't map memory for native code");
+
+	memcpy(mem, as.code, as.len);
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		uint8_t *entry = mem + as.labels[n];
+		memcpy(mem + table + sizeof(void *) * n, &entry, sizeof(entry));
+	}
+
+	if (mprotect(mem, size, PROT_READ | PROT_EXEC) == -1)
+		error(1, errno, "couldn't make native code executable");
+
+	struct native *native = malloc(sizeof(*native));
+
+	memcpy(&native->code, &mem, sizeof(mem));
+	native->compiled = compiled;
+
+	free(as.code);
+	free(as.labels);
+	free(as.fixups);
+
+	return native;
+}
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * arbre
+ *
+ * (c) 2011-2012, Alexis Sellier
+ *
+ * jit.h
+ *
+ */
+/*
+ * The JIT emits x86-64 code, into memory mapped with `mmap`,
+ * and runs it from the threaded dispatcher.
+ */
+#if defined(__x86_64__) && defined(__linux__) && defined(VM_THREADED)
+#define VM_JIT
+#endif
+
+#define JIT_THRESHOLD  64  /* Calls of a clause before it is compiled */
+
+/*
+ * Native code of a clause, compiled by the JIT, or ahead of time
+ * by `arbre aot`, see `aot.c`.
+ *
+ * `code` runs the clause from instruction `n`, which must have been
+ * compiled, with registers `R` and constants `K`, until it gets to an
+ * instruction which wasn't, such as a call or return, or until
+ * `credits` run out on a backward jump. It returns the index of the
+ * instruction to carry on from in the interpreter, shifted left by
+ * one. The low bit is set if that instruction was compiled, but its
+ * operands weren't of the type it was compiled for, so it should be
+ * run by its generic handler instead.
+ */
+typedef unsigned long (*NativeCode)(struct tvalue *R, struct tvalue *K,
+                                    uint16_t *credits, unsigned long n);
+
+struct native {
+	NativeCode   code;
+	const bool  *compiled;  /* Whether each instruction was compiled */
+};
+
+bool           jit_compiles (OpCode o);
+struct native *jit_compile  (struct clause *c);
+void           vm_native    (VM *vm, struct clause *c, struct native *native);
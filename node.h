@@ -52,6 +52,14 @@ typedef enum {
 	PATH_PUB
 } PATH;
 
+/* Inlining hints, given with a `--! inline` or
+ * `--! noinline` comment before a path. */
+typedef enum {
+	INLINE_AUTO,
+	INLINE_ALWAYS,
+	INLINE_NEVER
+} INLINE;
+
 extern TYPE OP_TYPES[];
 
 /*
@@ -122,6 +130,7 @@ struct node {
 
 		struct {
 			PATH          type;
+			INLINE        inlining;
 			struct node  *name;
 			struct node  *clause;
 		} path;
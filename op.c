@@ -33,7 +33,53 @@ const char *OPCODE_STRINGS[] = {
 	[OP_CALL]     = "call",
 	[OP_TAILCALL] = "tcall",
 	[OP_LAMBDA]   = "lambda",
-	[OP_PATH]     = "path"
+	[OP_PATH]     = "path",
+	[OP_EQJ]      = "eqj",
+	[OP_GTJ]      = "gtj",
+	[OP_MATCHJ]   = "matchj",
+	[OP_RETK]     = "retk",
+	[OP_ADDI]     = "addi",
+	[OP_SUBI]     = "subi",
+	[OP_EQI]      = "eqi",
+	[OP_GTI]      = "gti",
+	[OP_LTI]      = "lti",
+	[OP_EQIJ]     = "eqij",
+	[OP_GTIJ]     = "gtij",
+	[OP_LTIJ]     = "ltij",
+	[OP_SWITCH]   = "switch",
+	[OP_SWITCHK]  = "switchk",
+	[OP_TESTT]    = "testt",
+	[OP_TESTL]    = "testl",
+	[OP_EQV]      = "eqv",
+	[OP_GETT]     = "gett",
+	[OP_HEAD]     = "head",
+	[OP_TAIL]     = "tail",
+	[OP_LOOP]     = "loop",
+	[OP_CALLN]    = "calln",
+	[OP_TAILCALLN] = "tcalln",
+	[OP_UNPACK]   = "unpack",
+	[OP_RETURNN]  = "returnn",
+	[OP_ADDNN]    = "addnn",
+	[OP_SUBNN]    = "subnn",
+	[OP_ADDINN]   = "addinn",
+	[OP_SUBINN]   = "subinn",
+	[OP_GTNN]     = "gtnn",
+	[OP_GTJNN]    = "gtjnn",
+	[OP_GTINN]    = "gtinn",
+	[OP_LTINN]    = "ltinn",
+	[OP_GTIJNN]   = "gtijnn",
+	[OP_LTIJNN]   = "ltijnn",
+	[OP_TUPLEF]   = "tuplef",
+	[OP_LISTF]    = "listf",
+	[OP_CONSF]    = "consf",
+	[OP_ADDQ]     = "addq",
+	[OP_SUBQ]     = "subq",
+	[OP_ADDIQ]    = "addiq",
+	[OP_SUBIQ]    = "subiq",
+	[OP_MATCHATOM]  = "matchatom",
+	[OP_MATCHJATOM] = "matchjatom",
+	[OP_CALLDIRECT]  = "calldirect",
+	[OP_CALLNDIRECT] = "callndirect"
 };
 
 #define MODE(t, a, b, c, m) (((t) << 7) | ((a) << 6) | ((b) << 4) | ((c) << 2) | (m))
@@ -54,10 +100,56 @@ const unsigned char OPCODE_MODES[] = {
 	[OP_LIST]     = MODE(0,  1, OPARG__, OPARG__, ABC),
 	[OP_CONS]     = MODE(0,  1, OPARG_R, OPARG_K, ABC),
 	[OP_CALL]     = MODE(0,  1, OPARG_K, OPARG_K, ABC),
-	[OP_TAILCALL] = MODE(0,  1, OPARG_U, OPARG_R, ABC), // TODO: Don't use C
+	[OP_TAILCALL] = MODE(0,  1, OPARG_K, OPARG_K, ABC),
 	[OP_SEND]     = MODE(0,  0, OPARG_R, OPARG_K, ABC),
 	[OP_LAMBDA]   = MODE(0,  1, OPARG_U,       0, AD ),
-	[OP_PATH]     = MODE(0,  1, OPARG_K, OPARG_K, ABC)
+	[OP_PATH]     = MODE(0,  1, OPARG_K, OPARG_K, ABC),
+	[OP_EQJ]      = MODE(0,  0, OPARG_K, OPARG_K, JBC),
+	[OP_GTJ]      = MODE(0,  0, OPARG_K, OPARG_K, JBC),
+	[OP_MATCHJ]   = MODE(0,  0, OPARG_K, OPARG_K, JBC),
+	[OP_RETK]     = MODE(0,  0, OPARG_K,       0, AD ),
+	[OP_ADDI]     = MODE(0,  1, OPARG_K, OPARG_U, ABC),
+	[OP_SUBI]     = MODE(0,  1, OPARG_K, OPARG_U, ABC),
+	[OP_EQI]      = MODE(1,  0, OPARG_K, OPARG_U, ABC),
+	[OP_GTI]      = MODE(1,  0, OPARG_K, OPARG_U, ABC),
+	[OP_LTI]      = MODE(1,  0, OPARG_K, OPARG_U, ABC),
+	[OP_EQIJ]     = MODE(0,  0, OPARG_K, OPARG_U, JBC),
+	[OP_GTIJ]     = MODE(0,  0, OPARG_K, OPARG_U, JBC),
+	[OP_LTIJ]     = MODE(0,  0, OPARG_K, OPARG_U, JBC),
+	[OP_SWITCH]   = MODE(0,  1, OPARG_K, OPARG_U, ABC),
+	[OP_SWITCHK]  = MODE(0,  1, OPARG__, OPARG_U, ABC),
+	[OP_TESTT]    = MODE(1,  0, OPARG_R, OPARG_U, ABC),
+	[OP_TESTL]    = MODE(1,  0, OPARG_R, OPARG_U, ABC),
+	[OP_EQV]      = MODE(1,  0, OPARG_K, OPARG_K, ABC),
+	[OP_GETT]     = MODE(0,  1, OPARG_R, OPARG_U, ABC),
+	[OP_HEAD]     = MODE(0,  1, OPARG_R,       0, ABC),
+	[OP_TAIL]     = MODE(0,  1, OPARG_R,       0, ABC),
+	[OP_LOOP]     = MODE(0,  0, OPARG__, OPARG__, ABC),
+	[OP_CALLN]    = MODE(0,  1, OPARG_K, OPARG_U, ABC),
+	[OP_TAILCALLN] = MODE(0, 1, OPARG_K, OPARG_U, ABC),
+	[OP_UNPACK]   = MODE(1,  1, OPARG__, OPARG_U, ABC),
+	[OP_RETURNN]  = MODE(0,  1, OPARG__, OPARG_U, ABC),
+	[OP_ADDNN]    = MODE(0,  1, OPARG_K, OPARG_K, ABC),
+	[OP_SUBNN]    = MODE(0,  1, OPARG_K, OPARG_K, ABC),
+	[OP_ADDINN]   = MODE(0,  1, OPARG_K, OPARG_U, ABC),
+	[OP_SUBINN]   = MODE(0,  1, OPARG_K, OPARG_U, ABC),
+	[OP_GTNN]     = MODE(1,  0, OPARG_K, OPARG_K, ABC),
+	[OP_GTJNN]    = MODE(0,  0, OPARG_K, OPARG_K, JBC),
+	[OP_GTINN]    = MODE(1,  0, OPARG_K, OPARG_U, ABC),
+	[OP_LTINN]    = MODE(1,  0, OPARG_K, OPARG_U, ABC),
+	[OP_GTIJNN]   = MODE(0,  0, OPARG_K, OPARG_U, JBC),
+	[OP_LTIJNN]   = MODE(0,  0, OPARG_K, OPARG_U, JBC),
+	[OP_TUPLEF]   = MODE(0,  1, OPARG_U, OPARG_R, ABC),
+	[OP_LISTF]    = MODE(0,  1, OPARG__, OPARG_R, ABC),
+	[OP_CONSF]    = MODE(0,  1, OPARG_R, OPARG_K, ABC),
+	[OP_ADDQ]     = MODE(0,  1, OPARG_K, OPARG_K, ABC),
+	[OP_SUBQ]     = MODE(0,  1, OPARG_K, OPARG_K, ABC),
+	[OP_ADDIQ]    = MODE(0,  1, OPARG_K, OPARG_U, ABC),
+	[OP_SUBIQ]    = MODE(0,  1, OPARG_K, OPARG_U, ABC),
+	[OP_MATCHATOM]  = MODE(1, 1, OPARG_K, OPARG_K, ABC),
+	[OP_MATCHJATOM] = MODE(0, 0, OPARG_K, OPARG_K, JBC),
+	[OP_CALLDIRECT]  = MODE(0, 1, OPARG_K, OPARG_K, ABC),
+	[OP_CALLNDIRECT] = MODE(0, 1, OPARG_K, OPARG_U, ABC)
 };
 
 #undef MODE
@@ -72,19 +164,39 @@ void op_pp(Instruction i)
 	    d = iD(i),
 	    j = iJ(i);
 
+	switch (o) { /* Immediate operands are signed */
+		case OP_ADDI: case OP_SUBI:
+		case OP_EQI:  case OP_GTI:  case OP_LTI:
+		case OP_EQIJ: case OP_GTIJ: case OP_LTIJ:
+		case OP_ADDINN: case OP_SUBINN:
+		case OP_GTINN:  case OP_LTINN:
+		case OP_GTIJNN: case OP_LTIJNN:
+			c = iSC(i);
+			break;
+		default:
+			break;
+	}
+
 	printf("%-9s\t", OPCODE_STRINGS[o]);
 
-	oparg_pp(a, -1, AMODE(o));
+	if (o == OP_RETURN) /* `A` is an RK operand */
+		oparg_pp(a, OPARG_K, 0);
+	else
+		oparg_pp(a, -1, AMODE(o));
 	putchar('\t');
 
 	switch (OPMODE(o)) {
 		case ABC:
+		case JBC:
 			oparg_pp(b, BMODE(o), 0);
 			putchar('\t');
 			oparg_pp(c, CMODE(o), 0);
 			break;
 		case AD:
-			oparg_pp(d, BMODE(o), 0);
+			if (BMODE(o) == OPARG_K)
+				printf("k%-4d", d);
+			else
+				oparg_pp(d, BMODE(o), 0);
 			putchar('\t');
 			break;
 		case AJ:
@@ -18,7 +18,7 @@ extern const unsigned char OPCODE_MODES[];
 
 typedef uint32_t OpArg;                 /* Instruction argument */
 typedef uint32_t Instruction;           /* Byte-code instruction */
-enum             IMode {ABC, AD, AJ};   /* Instruction mode/format */
+enum             IMode {ABC, AD, AJ, JBC};  /* Instruction mode/format */
 
 /*
  * Size and position of opcode arguments
@@ -37,6 +37,10 @@ enum             IMode {ABC, AD, AJ};   /* Instruction mode/format */
 #define OPMAX_D        0xffff
 #define OPMAX_J        (OPMAX_D >> 1)  /* `J` is signed */
 
+/* Limits for immediate operands, which are signed `C` arguments */
+#define OPMIN_I        INT8_MIN
+#define OPMAX_I        INT8_MAX
+
 /*
  * Instruction field macros
  */
@@ -46,6 +50,7 @@ enum             IMode {ABC, AD, AJ};   /* Instruction mode/format */
 #define iC(i)    ((OpArg)((i) >> OPPOS_C) & 0xff)
 #define iD(i)    ((OpArg)((i) >> OPPOS_D))
 #define iJ(i)    ((ptrdiff_t)(iD(i) - OPMAX_J))
+#define iSC(i)   ((int8_t)iC(i))
 
 /*
  * Instruction creation macros
@@ -61,6 +66,10 @@ enum             IMode {ABC, AD, AJ};   /* Instruction mode/format */
 
 #define iAJ(o,a,j)   iAD(o, a, ((int32_t)(j) + OPMAX_J))
 
+/* Replace argument `A` of instruction `i` */
+#define iSETA(i,a)   (((i) & ~((Instruction)OPMAX_A << OPPOS_A)) \
+	                 | ((Instruction)(a) << OPPOS_A))
+
 /*
  * RK operands
  */
@@ -79,6 +88,10 @@ enum             IMode {ABC, AD, AJ};   /* Instruction mode/format */
 /* Create an RK operand from a constant index */
 #define RKASK(x)        ((x) | BITRK)
 
+/* Constants which don't fit an RK operand are loaded into a register
+ * first, with `loadk`: its `D` operand, like that of `retk`, is a
+ * plain index into the constant pool, of up to `OPMAX_D`. */
+
 #define NO_REG          OPMAX_A
 #define NO_JMP          (~(int32_t)0)
 
@@ -104,7 +117,89 @@ typedef enum {
 	OP_TAILCALL,
 	OP_SEND,
 	OP_LAMBDA,
-	OP_PATH
+	OP_PATH,
+
+	/* Super-instructions */
+	OP_EQJ,         /* `eq` + `jump`, with the jump offset in `A` */
+	OP_GTJ,         /* `gt` + `jump`, with the jump offset in `A` */
+	OP_MATCHJ,      /* `match` + `jump`, for patterns without bindings */
+	OP_RETK,        /* `loadk` + `return` */
+
+	/* Immediate operands, in `C` */
+	OP_ADDI,
+	OP_SUBI,
+	OP_EQI,
+	OP_GTI,
+	OP_LTI,
+	OP_EQIJ,
+	OP_GTIJ,
+	OP_LTIJ,
+
+	/* Multi-way branches on register `A`. These are followed by a
+	 * table of `C` jumps, and a default jump. `switch` indexes the
+	 * table by number, and `switchk` searches it by the constant
+	 * in argument `A` of each jump. */
+	OP_SWITCH,      /* On numbers `kB` to `kB + C - 1` */
+	OP_SWITCHK,     /* On constant keys, sorted at load-time */
+
+	/* Primitive pattern tests and destructuring, emitted by
+	 * the pattern-matching compiler in place of `match`. */
+	OP_TESTT,       /* Is `rB` a tuple of arity `C` */
+	OP_TESTL,       /* Is `rB` an empty (`C` = 0), non-empty (1), or any (2) list */
+	OP_EQV,         /* Are `B` and `C` the same atom or number */
+	OP_GETT,        /* `rA` = member `C` of tuple `rB` */
+	OP_HEAD,        /* `rA` = head of list `rB` */
+	OP_TAIL,        /* `rA` = tail of list `rB` */
+
+	OP_LOOP,        /* Restart the current clause, see `gen_loop` */
+
+	/* Calls with `C` arguments in registers `rA` and up, instead
+	 * of a tuple. The return value is stored in `rA`. */
+	OP_CALLN,
+	OP_TAILCALLN,
+
+	/* Multiple return values. `returnn` returns the `C` values in
+	 * `rA` and up. If the caller's next instruction is an `unpack`
+	 * of as many values, they are stored straight into its registers
+	 * and the `unpack` is skipped, else a tuple is returned. */
+	OP_UNPACK,      /* Spread tuple `rA` of arity `C` over `rA` and up */
+	OP_RETURNN,
+
+	/* Variants of the arithmetic and comparison ops, for operands
+	 * which are known to be numbers, see `gen_specialize`. Unlike
+	 * the generic ops, these don't check the type of `B` or `C`. */
+	OP_ADDNN,
+	OP_SUBNN,
+	OP_ADDINN,
+	OP_SUBINN,
+	OP_GTNN,
+	OP_GTJNN,
+	OP_GTINN,
+	OP_LTINN,
+	OP_GTIJNN,
+	OP_LTIJNN,
+
+	/* Variants of the allocations, for values which don't escape the
+	 * clause, see `gen_escape`. These build the value in registers
+	 * of the frame, rather than on the heap. */
+	OP_TUPLEF,      /* `tuple`, stored in `rC` and up */
+	OP_LISTF,       /* `list`, stored in `rC` and up */
+	OP_CONSF,       /* `cons` onto `rA`, stored in `rB` and up */
+
+	/* Quickened ops, which the threaded dispatcher rewrites generic
+	 * ops into once it has seen their operands, see `vm_quicken`.
+	 * They never appear in byte-code. Each guards the assumption it
+	 * was made under, and reverts to its generic op if that fails. */
+	OP_ADDQ,        /* `add` of two numbers */
+	OP_SUBQ,        /* `sub` of two numbers */
+	OP_ADDIQ,       /* `addi` of a number */
+	OP_SUBIQ,       /* `subi` of a number */
+	OP_MATCHATOM,   /* `match` against an atom */
+	OP_MATCHJATOM,  /* `matchj` against an atom */
+	OP_CALLDIRECT,  /* `call` of a path with a single clause */
+	OP_CALLNDIRECT, /* `calln` of a path with a single clause */
+
+	OPCODE_MAX      /* Number of op-codes */
 } OpCode;
 
 /*
@@ -123,5 +218,30 @@ enum OpArgMask {
 #define AMODE(m)   (OPCODE_MODES[m] & (1 << 6))
 #define TMODE(m)   (OPCODE_MODES[m] & (1 << 7))
 
+/*
+ * Pre-decoded instruction, as run by the threaded dispatcher.
+ *
+ * Instructions are decoded once, when a clause is loaded. RK operands
+ * which refer to constants point straight into the constant table,
+ * and `handler` is specialized on whether `B` and `C` are registers
+ * or constants, so no operand is tested at run-time.
+ */
+typedef struct {
+	const void     *handler;  /* Address of op-code handler */
+	struct tvalue  *b;        /* `B` or `D` constant operand */
+	struct tvalue  *c;        /* `C` constant operand */
+	int32_t         j;        /* Jump offset, of self or following jump */
+	uint8_t         a;
+	uint8_t         rb;       /* `B` register operand or unsigned value */
+	uint8_t         rc;       /* `C` register operand */
+	int8_t          imm;      /* `C` immediate operand */
+} Operation;
+
+/* RK operand kinds, used to select a handler variant */
+#define OPK_RR  0
+#define OPK_RK  1
+#define OPK_KR  2
+#define OPK_KK  3
+
 void  oparg_pp   (int arg, int mode, int amode);
 void  op_pp      (Instruction i);
@@ -67,6 +67,7 @@ Parser *parser(struct source *src)
 	p->tok     = p->token->tok;
 	p->errors  = 0;
 	p->block   = NULL;
+	p->inlining = INLINE_AUTO;
 
 	return p;
 }
@@ -889,8 +890,11 @@ static struct node *parse_path(Parser *p)
 	} else {
 		error(p, "expected ident");
 	}
-	n->o.path.type   = type;
-	n->o.path.clause = node(p->token, OCLAUSE);
+	n->o.path.type     = type;
+	n->o.path.inlining = p->inlining;
+	n->o.path.clause   = node(p->token, OCLAUSE);
+
+	p->inlining = INLINE_AUTO;
 
 	if (p->tok == T_EQ) {
 		next(p);
@@ -1119,6 +1123,20 @@ static struct node *parse_toplevel(Parser *p)
 }
 
 
+/*
+ * Parse a top-level comment, which may be a pragma
+ * for the path that follows. Example:
+ *
+ *     --! noinline
+ */
+static void parse_pragma(Parser *p)
+{
+	if (! strcmp(p->src, "--! inline"))
+		p->inlining = INLINE_ALWAYS;
+	else if (! strcmp(p->src, "--! noinline"))
+		p->inlining = INLINE_NEVER;
+}
+
 /*
  * Parse from `p->source` until we reach the
  * `T_EOF` end-of-file token.
@@ -1130,6 +1148,9 @@ Tree *parse(Parser *p)
 	next(p);
 
 	while (p->tok != T_EOF) {
+		if (p->tok == T_COMMENT)
+			parse_pragma(p);
+
 		if (p->tok == T_LF || p->tok == T_COMMENT) {
 			next(p); continue;
 		}
@@ -15,6 +15,7 @@ typedef struct {
 	size_t           pos;       /* token->pos */
 	char            *src;       /* token->src */
 	int              errors;    /* Error count */
+	INLINE           inlining;  /* Inlining hint of the next path */
 	struct scanner  *scanner;
 	void           (*ontoken)(Token *);
 } Parser;
@@ -6,10 +6,34 @@
  * reduce.h
  *
  */
+/* Largest path body inlined without an `inline` pragma, in nodes */
+#define INLINE_SIZE 16
+
+typedef struct {
+	const char **items;
+	unsigned     count;
+} Names;
+
+/* Top-level path, as a candidate for inlining */
+typedef struct {
+	struct node *path;      /* First definition */
+	unsigned     nclauses;  /* Number of definitions */
+	enum { PATH_NEW, PATH_REDUCING, PATH_REDUCED } state;
+} ReducerPath;
+
 typedef struct {
-	int _;
+	int          optimize;  /* Fold constants, simplify expressions and inline paths */
+	bool         verbose;   /* Report inlining decisions */
+	bool         inlining;  /* Inline calls, off in code which was inlined */
+	ReducerPath *paths;
+	unsigned     npaths;
+	struct node *caller;    /* Path being reduced */
+	Names        names;     /* Identifiers used in `caller` */
+	unsigned     ncalls;
+	unsigned     ninlined;
 } Reducer;
 
+static void reduce_node(Reducer *r, struct node **n);
 static struct nodelist *reduce_nodelist(Reducer *r, struct nodelist *ns);
 static struct node *reduce_path(Reducer *r, struct node *n);
 static struct node *reduce_list(Reducer *r, struct node *n);
@@ -18,22 +42,26 @@ static struct node *reduce_bind(Reducer *r, struct node *n);
 static struct node *reduce_apply(Reducer *r, struct node *n);
 static struct node *reduce_select(Reducer *r, struct node *n);
 static struct node *reduce_pipe(Reducer *r, struct node *n);
+static struct node *reduce_clause(Reducer *r, struct node *n);
+static struct node *reduce_tuple(Reducer *r, struct node *n);
+static struct node *reduce_arith(Reducer *r, struct node *n);
+static struct node *reduce_cmp(Reducer *r, struct node *n);
 
 struct node *(*REDUCERS[])(Reducer *, struct node *) = {
 	[OBLOCK]    =  reduce_block,  [ODECL]     =  NULL,
 	[OMATCH]    =  NULL,          [OBIND]     =  reduce_bind,
 	[OMODULE]   =  NULL,          [OSELECT]   =  reduce_select,
 	[OWAIT]     =  NULL,          [OIDENT]    =  NULL,
-	[OTYPE]     =  NULL,          [OADD]      =  NULL,
+	[OTYPE]     =  NULL,          [OADD]      =  reduce_arith,
 	[OPATH]     =  reduce_path,   [OMPATH]    =  NULL,
 	[OSTRING]   =  NULL,          [OATOM]     =  NULL,
 	[OCHAR]     =  NULL,          [ONUMBER]   =  NULL,
-	[OTUPLE]    =  NULL,          [OLIST]     =  reduce_list,
+	[OTUPLE]    =  reduce_tuple,  [OLIST]     =  reduce_list,
 	[OACCESS]   =  NULL,          [OAPPLY]    =  reduce_apply,
 	[OSEND]     =  NULL,          [ORANGE]    =  NULL,
-	[OCLAUSE]   =  NULL,          [OPIPE]     =  reduce_pipe,
-	[OSUB]      =  NULL,          [OLT]       =  NULL,
-	[OGT]       =  NULL
+	[OCLAUSE]   =  reduce_clause, [OPIPE]     =  reduce_pipe,
+	[OSUB]      =  reduce_arith,  [OLT]       =  reduce_cmp,
+	[OGT]       =  reduce_cmp
 };
 
 #define node_access(l, r) (binop(OACCESS, l, r))
@@ -100,6 +128,105 @@ static struct node *cons(struct node *lval, struct node *rval)
 	return n;
 }
 
+/*
+ * Constant folding
+ *
+ * Numbers are folded with the same 32-bit wrap-around as the
+ * run-time. Identities such as `x + 0` only hold for numbers, as
+ * arithmetic on anything else fails at run-time, so they're only
+ * applied to operands which are known to be numbers.
+ */
+static bool node_isnumber(struct node *n, int32_t *number)
+{
+	if (n->op != ONUMBER)
+		return false;
+
+	*number = (int32_t)strtol(n->src, NULL, 10);
+
+	return true;
+}
+
+/* Is `n` known to evaluate to a number, if it evaluates at all */
+static bool node_isnumeric(struct node *n)
+{
+	return n->op == ONUMBER || n->op == OADD || n->op == OSUB;
+}
+
+static struct node *node_number(struct node *from, int32_t number)
+{
+	struct node *n   = anode(ONUMBER);
+	char        *src = malloc(12);
+
+	sprintf(src, "%d", number);
+
+	n->src      = src;
+	n->o.number = src;
+	n->pos      = from->pos;
+	n->source   = from->source;
+
+	return n;
+}
+
+/*
+ * Truth value of the comparison `n`, if it is known at compile-time:
+ * `1` if it always holds, `0` if it never does, and `-1` otherwise.
+ */
+static int node_truth(struct node *n)
+{
+	int32_t a, b;
+
+	if (n->op != OGT && n->op != OLT)
+		return -1;
+
+	struct node *lval = n->o.cmp.lval,
+	            *rval = n->o.cmp.rval;
+
+	if (node_isnumber(lval, &a) && node_isnumber(rval, &b))
+		return n->op == OGT ? a > b : a < b;
+
+	return -1;
+}
+
+static struct node *reduce_arith(Reducer *r, struct node *n)
+{
+	int32_t a, b;
+
+	reduce_node(r, &n->o.binop.lval);
+	reduce_node(r, &n->o.binop.rval);
+
+	if (! r->optimize)
+		return n;
+
+	struct node *lval = n->o.binop.lval,
+	            *rval = n->o.binop.rval;
+
+	if (node_isnumber(lval, &a) && node_isnumber(rval, &b)) {
+		uint32_t ua = (uint32_t)a, ub = (uint32_t)b;
+		return node_number(n, (int32_t)(n->op == OADD ? ua + ub : ua - ub));
+	}
+
+	/* x + 0, x - 0 */
+	if (node_isnumber(rval, &b) && b == 0 && node_isnumeric(lval))
+		return lval;
+
+	/* 0 + x */
+	if (n->op == OADD && node_isnumber(lval, &a) && a == 0 && node_isnumeric(rval))
+		return rval;
+
+	return n;
+}
+
+/*
+ * Comparisons only have a value as guards, where they're
+ * folded by `reduce_guards`.
+ */
+static struct node *reduce_cmp(Reducer *r, struct node *n)
+{
+	reduce_node(r, &n->o.cmp.lval);
+	reduce_node(r, &n->o.cmp.rval);
+	return n;
+}
+
 static struct node *reduce_pipe(Reducer *r, struct node *n)
 {
 	struct node *t = ntuple(2, n->o.pipe.lval, n->o.pipe.rval);
@@ -140,6 +267,455 @@ static void reduce_node(Reducer *r, struct node **n)
 	}
 }
 
+/*
+ * Inlining
+ *
+ * Calls to small paths of the current module are replaced by the
+ * path's body, with its parameters replaced by the call arguments.
+ * Only paths with a single clause, whose parameters are distinct
+ * identifiers, and whose body is a single expression, are inlined.
+ */
+static void names_add(Names *ns, const char *name)
+{
+	ns->items = realloc(ns->items, sizeof(*ns->items) * (ns->count + 1));
+	ns->items[ns->count ++] = name;
+}
+
+static bool names_has(Names *ns, const char *name)
+{
+	for (unsigned i = 0; i < ns->count; i++)
+		if (! strcmp(ns->items[i], name))
+			return true;
+
+	return false;
+}
+
+/*
+ * Call `f` on each child of node `n`
+ */
+static void node_children(struct node *n, void (*f)(struct node *, void *), void *data)
+{
+	struct nodelist *ns = NULL;
+
+	switch (n->op) {
+		case OBLOCK:   ns = n->o.block.body;      break;
+		case OTUPLE:   ns = n->o.tuple.members;   break;
+		case OLIST:    ns = n->o.list.items;      break;
+		case OPATH:    f(n->o.path.clause, data); break;
+		case OSPAWN:   f(n->o.spawn.apply, data); break;
+		case OWAIT:    f(n->o.wait.proc, data);   break;
+		case OSELECT:
+			if (n->o.select.arg)
+				f(n->o.select.arg, data);
+			ns = n->o.select.clauses;
+			break;
+		case OCLAUSE: {
+			struct nodelist *gs = n->o.clause.guards;
+
+			if (n->o.clause.lval)
+				f(n->o.clause.lval, data);
+
+			for (int i = 0; i < n->o.clause.nguards; i++, gs = gs->tail)
+				f(gs->head, data);
+
+			f(n->o.clause.rval, data);
+			break;
+		}
+		case OBIND:   case OMATCH:  case OACCESS: case OAPPLY:
+		case OSEND:   case ORANGE:  case OADD:    case OSUB:
+		case OPIPE:   case OCONS:   case OLT:     case OGT:
+		case OEQ:     case OTYPE:
+			if (n->o.binop.lval)
+				f(n->o.binop.lval, data);
+			if (n->o.binop.rval)
+				f(n->o.binop.rval, data);
+			break;
+		default:
+			break;
+	}
+	for (; ns; ns = ns->tail)
+		if (ns->head)
+			f(ns->head, data);
+}
+
+static void node_names(struct node *n, void *names)
+{
+	if (n->op == OIDENT)
+		names_add(names, n->src);
+
+	node_children(n, node_names, names);
+}
+
+/* Name of the path of the current module called by `n`, or NULL */
+static const char *node_callee(struct node *n)
+{
+	if (n->op != OAPPLY || n->o.apply.lval->op != OACCESS)
+		return NULL;
+
+	struct node *module = n->o.apply.lval->o.access.lval,
+	            *path   = n->o.apply.lval->o.access.rval;
+
+	if (module->op != OMODULE || module->o.module.type != MODULE_CURRENT || path->op != OIDENT)
+		return NULL;
+
+	return path->src;
+}
+
+static ReducerPath *reducer_path(Reducer *r, const char *name)
+{
+	for (unsigned i = 0; i < r->npaths; i++)
+		if (! strcmp(r->paths[i].path->o.path.name->src, name))
+			return &r->paths[i];
+
+	return NULL;
+}
+
+/* What an inlining candidate's body does */
+typedef struct {
+	const char *name;      /* Of the path */
+	unsigned    size;      /* In nodes */
+	bool        binds;     /* Binds variables outside of patterns */
+	bool        effects;   /* Calls paths or sends messages */
+	bool        recursive; /* Calls its own path */
+	Names       patterns;  /* Identifiers bound by clause patterns */
+	Names       idents;    /* Identifiers used */
+} InlineScan;
+
+static void inline_scan(struct node *n, void *data)
+{
+	InlineScan *s = data;
+
+	s->size ++;
+
+	switch (n->op) {
+		case OBIND: case OMATCH: case OPATH: case OMPATH:
+			s->binds = true;
+			break;
+		case OAPPLY: {
+			const char *callee = node_callee(n);
+
+			if (callee && ! strcmp(callee, s->name))
+				s->recursive = true;
+		} /* Fallthrough */
+		case OSEND: case OSPAWN: case OWAIT:
+			s->effects = true;
+			break;
+		case OACCESS: /* The attribute isn't a variable */
+			inline_scan(n->o.access.lval, s);
+			return;
+		case OIDENT:
+			names_add(&s->idents, n->src);
+			break;
+		case OCLAUSE: {
+			struct nodelist *gs = n->o.clause.guards;
+
+			if (n->o.clause.lval)
+				node_names(n->o.clause.lval, &s->patterns);
+
+			for (int i = 0; i < n->o.clause.nguards; i++, gs = gs->tail)
+				inline_scan(gs->head, s);
+
+			inline_scan(n->o.clause.rval, s);
+			return;
+		}
+		default:
+			break;
+	}
+	node_children(n, inline_scan, s);
+}
+
+/* Uses of parameter `name` in an inlining candidate's body */
+typedef struct {
+	const char *name;
+	unsigned    count;
+	bool        conditional; /* Whether a use is in a select clause */
+	unsigned    depth;       /* Of select clauses */
+} InlineUses;
+
+static void inline_uses(struct node *n, void *data)
+{
+	InlineUses *u = data;
+
+	switch (n->op) {
+		case OIDENT:
+			if (! strcmp(n->src, u->name)) {
+				u->count ++;
+				u->conditional = u->conditional || u->depth > 0;
+			}
+			break;
+		case OACCESS:
+			inline_uses(n->o.access.lval, u);
+			return;
+		case OCLAUSE:
+			u->depth ++;
+			node_children(n, inline_uses, u);
+			u->depth --;
+			return;
+		default:
+			break;
+	}
+	node_children(n, inline_uses, u);
+}
+
+static bool node_isleaf(struct node *n)
+{
+	switch (n->op) {
+		case OIDENT: case ONUMBER: case OATOM: case OSTRING: case OCHAR:
+			return true;
+		default:
+			return false;
+	}
+}
+
+/* Parameter `i` of `params`, an identifier or a tuple of identifiers */
+static struct node *node_member(struct node *n, unsigned i)
+{
+	if (n->op != OTUPLE)
+		return n;
+
+	struct nodelist *ns = n->o.tuple.members;
+
+	while (i--)
+		ns = ns->tail;
+
+	return ns->head;
+}
+
+static unsigned node_arity(struct node *n)
+{
+	return n->op == OTUPLE ? n->o.tuple.arity : 1;
+}
+
+/*
+ * Check whether the call of path `p` with argument `arg` can be
+ * inlined. Returns NULL if so, or the reason why not.
+ */
+static const char *inline_check(Reducer *r, ReducerPath *p, struct node *arg)
+{
+	struct node *clause = p->path->o.path.clause,
+	            *params = clause->o.clause.lval,
+	            *body   = clause->o.clause.rval;
+	INLINE       hint   = p->path->o.path.inlining;
+	unsigned     arity  = node_arity(params);
+
+	if (hint == INLINE_NEVER)
+		return "noinline pragma";
+
+	if (p->nclauses > 1)
+		return "has more than one clause";
+
+	if (p->state == PATH_REDUCING)
+		return "recursive";
+
+	for (unsigned i = 0; i < arity; i++) {
+		struct node *param = node_member(params, i);
+
+		if (param->op != OIDENT)
+			return "parameters aren't identifiers";
+
+		for (unsigned j = 0; j < i; j++)
+			if (! strcmp(param->src, node_member(params, j)->src))
+				return "parameters aren't identifiers";
+	}
+
+	if (params->op == OTUPLE && (! arg || arg->op != OTUPLE || arg->o.tuple.arity != arity))
+		return "arity mismatch";
+
+	if (body->o.block.body->tail)
+		return "body isn't a single expression";
+
+	InlineScan s = { .name = p->path->o.path.name->src };
+
+	inline_scan(body->o.block.body->head, &s);
+
+	const char *reason = NULL;
+
+	if (s.recursive)
+		reason = "recursive";
+	else if (s.binds)
+		reason = "body binds variables";
+	else if (hint == INLINE_AUTO && s.size > INLINE_SIZE)
+		reason = "too large";
+
+	/* Variables bound in the body mustn't clash with the caller's,
+	 * or with the parameters, and the body mustn't use any other. */
+	for (unsigned i = 0; ! reason && i < s.patterns.count; i++) {
+		const char *name = s.patterns.items[i];
+
+		if (names_has(&r->names, name))
+			reason = "body binds variables";
+
+		for (unsigned j = 0; j < arity; j++)
+			if (! strcmp(node_member(params, j)->src, name))
+				reason = "body binds variables";
+	}
+	for (unsigned i = 0; ! reason && i < s.idents.count; i++) {
+		const char *name = s.idents.items[i];
+		bool        bound = names_has(&s.patterns, name);
+
+		for (unsigned j = 0; j < arity; j++)
+			bound = bound || ! strcmp(node_member(params, j)->src, name);
+
+		if (! bound)
+			reason = "body uses free variables";
+	}
+
+	/* Arguments which aren't variables or literals are only
+	 * substituted if they're evaluated exactly once, and can't
+	 * change the order of side-effects. */
+	for (unsigned i = 0, impure = 0; ! reason && i < arity; i++) {
+		struct node *a = params->op == OTUPLE ? node_member(arg, i) : arg;
+
+		if (! a || node_isleaf(a))
+			continue;
+
+		InlineUses  u = { .name = node_member(params, i)->src };
+		InlineScan  e = { .name = "" };
+
+		inline_uses(body, &u);
+		inline_scan(a, &e);
+
+		if (u.count != 1 || u.conditional)
+			reason = "argument would not be evaluated once";
+		else if (e.effects && (s.effects || impure ++))
+			reason = "argument has side-effects";
+	}
+	free(s.patterns.items);
+	free(s.idents.items);
+
+	return reason;
+}
+
+/* Parameters of an inlined path, and its call's argument */
+typedef struct {
+	struct node *params;
+	struct node *arg;
+} InlineArgs;
+
+static struct node *node_copy(struct node *n, InlineArgs *args);
+
+static struct nodelist *nodelist_copy(struct nodelist *ns, int count, InlineArgs *args)
+{
+	struct nodelist *copy = nodelist(NULL);
+
+	for (int i = 0; ns && i != count; i++, ns = ns->tail)
+		if (ns->head)
+			append(copy, node_copy(ns->head, args));
+
+	return copy;
+}
+
+/*
+ * Copy node `n`, replacing the parameters in `args` by the
+ * matching members of the argument
+ */
+static struct node *node_copy(struct node *n, InlineArgs *args)
+{
+	if (n == NULL)
+		return NULL;
+
+	if (n->op == OIDENT && args) {
+		for (unsigned i = 0; i < node_arity(args->params); i++) {
+			if (! strcmp(node_member(args->params, i)->src, n->src)) {
+				return node_copy(args->params->op == OTUPLE ? node_member(args->arg, i)
+				                                            : args->arg, NULL);
+			}
+		}
+	}
+
+	struct node *c = malloc(sizeof(*c));
+	            *c = *n;
+
+	switch (n->op) {
+		case OBLOCK:
+			c->o.block.body = nodelist_copy(n->o.block.body, -1, args);
+			break;
+		case OTUPLE:
+			c->o.tuple.members = nodelist_copy(n->o.tuple.members, -1, args);
+			break;
+		case OLIST:
+			c->o.list.items = nodelist_copy(n->o.list.items, -1, args);
+			break;
+		case OSELECT:
+			c->o.select.arg     = node_copy(n->o.select.arg, args);
+			c->o.select.clauses = nodelist_copy(n->o.select.clauses, -1, args);
+			break;
+		case OCLAUSE:
+			c->o.clause.lval   = node_copy(n->o.clause.lval, NULL);
+			c->o.clause.guards = nodelist_copy(n->o.clause.guards, n->o.clause.nguards, args);
+			c->o.clause.rval   = node_copy(n->o.clause.rval, args);
+			break;
+		case OSPAWN:
+			c->o.spawn.apply = node_copy(n->o.spawn.apply, args);
+			break;
+		case OWAIT:
+			c->o.wait.proc = node_copy(n->o.wait.proc, args);
+			break;
+		case OACCESS:
+			c->o.access.lval = node_copy(n->o.access.lval, args);
+			c->o.access.rval = node_copy(n->o.access.rval, NULL);
+			break;
+		case OAPPLY:  case OSEND:   case ORANGE:  case OADD:
+		case OSUB:    case OPIPE:   case OCONS:   case OLT:
+		case OGT:     case OEQ:     case OTYPE:
+			c->o.binop.lval = node_copy(n->o.binop.lval, args);
+			c->o.binop.rval = node_copy(n->o.binop.rval, args);
+			break;
+		default:
+			break;
+	}
+	return c;
+}
+
+/*
+ * Inline call `n`, if it calls a path which can be inlined.
+ */
+static struct node *reduce_inline(Reducer *r, struct node *n)
+{
+	const char  *name = node_callee(n);
+	ReducerPath *p    = name ? reducer_path(r, name) : NULL;
+
+	if (! p)
+		return n;
+
+	INLINE hint = p->path->o.path.inlining;
+
+	/* Paths are only inlined without a pragma at -O2 */
+	if (hint == INLINE_AUTO && r->optimize < 2)
+		return n;
+
+	r->ncalls ++;
+
+	/* Inline the reduced body */
+	if (p->state == PATH_NEW)
+		reduce_path(r, p->path);
+
+	const char *reason = inline_check(r, p, n->o.apply.rval);
+
+	if (r->verbose) {
+		printf("%s ./%s into ./%s", reason ? "not inlining" : "inlining",
+		       name, r->caller->o.path.name->src);
+		reason ? printf(": %s\n", reason) : putchar('\n');
+	}
+	if (reason)
+		return n;
+
+	struct node *clause = p->path->o.path.clause;
+	InlineArgs   args   = { clause->o.clause.lval, n->o.apply.rval };
+	struct node *body   = node_copy(clause->o.clause.rval->o.block.body->head, &args);
+
+	r->ninlined ++;
+
+	/* Fold the arguments into the body */
+	bool inlining = r->inlining;
+
+	r->inlining = false;
+	reduce_node(r, &body);
+	r->inlining = inlining;
+
+	return body;
+}
+
 static struct node *reduce_bind(Reducer *r, struct node *n)
 {
 	reduce_node(r, &n->o.bind.lval);
@@ -151,25 +727,140 @@ static struct node *reduce_apply(Reducer *r, struct node *n)
 {
 	reduce_node(r, &n->o.apply.lval);
 	reduce_node(r, &n->o.apply.rval);
+
+	if (r->optimize && r->inlining)
+		return reduce_inline(r, n);
+
 	return n;
 }
 
+static struct node *reduce_tuple(Reducer *r, struct node *n)
+{
+	reduce_nodelist(r, n->o.tuple.members);
+	return n;
+}
+
+/* Does clause `c` have a guard which never holds */
+static bool clause_isdead(struct node *c)
+{
+	struct nodelist *ns = c->o.clause.guards;
+
+	for (int i = 0; i < c->o.clause.nguards; i++, ns = ns->tail)
+		if (node_truth(ns->head) == 0)
+			return true;
+
+	return false;
+}
+
+/*
+ * Remove the clauses which can never be selected, because one
+ * of their guards never holds. This doesn't change what the
+ * select does when nothing matches. If every clause is dead,
+ * the select is left alone, as it needs at least one clause.
+ */
 static struct node *reduce_select(Reducer *r, struct node *n)
 {
 	reduce_node(r, &n->o.select.arg);
 	reduce_nodelist(r, n->o.select.clauses);
+
+	if (! r->optimize)
+		return n;
+
+	struct nodelist *ns;
+	unsigned         nclauses = 0;
+
+	for (ns = n->o.select.clauses; ns; ns = ns->tail)
+		nclauses += ! clause_isdead(ns->head);
+
+	if (nclauses == 0 || nclauses == n->o.select.nclauses)
+		return n;
+
+	struct nodelist *clauses = nodelist(NULL);
+
+	for (ns = n->o.select.clauses; ns; ns = ns->tail)
+		if (! clause_isdead(ns->head))
+			append(clauses, ns->head);
+
+	n->o.select.clauses  = clauses;
+	n->o.select.nclauses = nclauses;
+
 	return n;
 }
 
+/*
+ * Reduce the guards of clause `n`, and drop those which always hold.
+ * Clauses which are left without guards can then be compiled to
+ * a switch, if their patterns allow it.
+ */
+static void reduce_guards(Reducer *r, struct node *n)
+{
+	struct nodelist *ns = n->o.clause.guards;
+	int              nguards = n->o.clause.nguards;
+
+	if (nguards == 0)
+		return;
+
+	for (int i = 0; i < nguards; i++, ns = ns->tail)
+		reduce_node(r, &ns->head);
+
+	if (! r->optimize)
+		return;
+
+	struct nodelist *guards = nodelist(NULL);
+
+	n->o.clause.nguards = 0;
+
+	ns = n->o.clause.guards;
+
+	for (int i = 0; i < nguards; i++, ns = ns->tail) {
+		if (node_truth(ns->head) != 1) {
+			append(guards, ns->head);
+			n->o.clause.nguards ++;
+		}
+	}
+	n->o.clause.guards = guards;
+}
+
+/*
+ * The clause patterns in `lval` aren't reduced, since
+ * the generator matches list patterns as lists.
+ */
 static struct node *reduce_clause(Reducer *r, struct node *n)
 {
+	reduce_guards(r, n);
 	reduce_block(r, n->o.clause.rval);
 	return n;
 }
 
 static struct node *reduce_path(Reducer *r, struct node *n)
 {
+	ReducerPath *p = reducer_path(r, n->o.path.name->src);
+
+	/* Paths are reduced before they're inlined,
+	 * which may be before their turn comes. */
+	if (p && p->path == n) {
+		if (p->state != PATH_NEW)
+			return n;
+		p->state = PATH_REDUCING;
+	}
+
+	struct node *caller = r->caller;
+	Names        names  = r->names;
+
+	r->caller = n;
+	r->names  = (Names){ NULL, 0 };
+
+	node_names(n, &r->names);
 	reduce_clause(r, n->o.path.clause);
+
+	free(r->names.items);
+
+	r->caller = caller;
+	r->names  = names;
+
+	if (p && p->path == n)
+		p->state = PATH_REDUCED;
+
 	return n;
 }
 
@@ -189,11 +880,44 @@ static struct nodelist *reduce_nodelist(Reducer *r, struct nodelist *ns)
 	return ns;
 }
 
-void reduce(Tree *tree)
+/*
+ * Index the paths of the module, which calls may be inlined to
+ */
+static void reduce_paths(Reducer *r, struct node *root)
+{
+	r->paths  = NULL;
+	r->npaths = 0;
+
+	for (struct nodelist *ns = root->o.block.body; ns; ns = ns->tail) {
+		if (! ns->head || ns->head->op != OPATH)
+			continue;
+
+		ReducerPath *p = reducer_path(r, ns->head->o.path.name->src);
+
+		if (p) {
+			p->nclauses ++;
+			continue;
+		}
+		r->paths = realloc(r->paths, sizeof(*r->paths) * (r->npaths + 1));
+		r->paths[r->npaths ++] = (ReducerPath){ ns->head, 1, PATH_NEW };
+	}
+}
+
+void reduce(Tree *tree, int optimize, bool verbose)
 {
-	Reducer *r = malloc(sizeof(*r));
+	Reducer *r = calloc(1, sizeof(*r));
+
+	r->optimize = optimize;
+	r->verbose  = verbose;
+	r->inlining = optimize > 0;
+
+	reduce_paths(r, tree->root);
 
 	reduce_block(r, tree->root);
 
+	if (r->verbose && r->ncalls)
+		printf("inlined %u of %u calls..\n", r->ninlined, r->ncalls);
+
+	free(r->paths);
 	free(r);
 }
@@ -15,31 +15,61 @@
 #include <stddef.h>
 
 #include "arbre.h"
+#include "hash.h"
 #include "op.h"
 #include "runtime.h"
 #include "assert.h"
 
-struct stack *stack(void)
+/*
+ * Get a segment of at least `size` bytes from `pool`,
+ * or allocate one.
+ */
+static struct segment *segment(struct segpool *pool, size_t size)
 {
-	struct stack *s = malloc(sizeof(*s));
+	struct segment *seg;
 
-	s->size = 0;
-	s->capacity = sizeof(struct frame) + sizeof(struct tvalue);
-	s->base = malloc(s->capacity);
-	s->frame = NULL;
-	s->depth = 0;
+	if (size <= STACK_SEGMENT && pool->free) {
+		seg        = pool->free;
+		pool->free = seg->next;
+		pool->nfree --;
+	} else {
+		size_t capacity = size > STACK_SEGMENT ? size : STACK_SEGMENT;
 
-	return s;
+		seg = malloc(sizeof(*seg) + capacity);
+		seg->capacity = capacity;
+	}
+	seg->prev = NULL;
+	seg->next = NULL;
+	seg->size = 0;
+
+	return seg;
 }
 
-void stack_correct(struct stack *s, struct frame *old)
+/*
+ * Return segment `seg` to `pool`, or free it if it is
+ * oversized or the pool is full.
+ */
+static void segment_free(struct segpool *pool, struct segment *seg)
 {
-	for (struct frame *f = s->frame; f != NULL; f = f->prev) {
-		if (f->prev) {
-			ptrdiff_t diff = (ptrdiff_t)f->prev - (ptrdiff_t)old;
-			f->prev = (struct frame *)(diff + (ptrdiff_t)s->base);
-		}
+	if (seg->capacity != STACK_SEGMENT || pool->nfree >= SEGMENT_POOL) {
+		free(seg);
+		return;
 	}
+	seg->next  = pool->free;
+	pool->free = seg;
+	pool->nfree ++;
+}
+
+struct stack *stack(struct segpool *pool)
+{
+	struct stack *s = malloc(sizeof(*s));
+
+	s->pool = pool;
+	s->segment = segment(pool, STACK_SEGMENT);
+	s->frame = NULL;
+	s->depth = 0;
+
+	return s;
 }
 
 /*
@@ -47,66 +77,78 @@ void stack_correct(struct stack *s, struct frame *old)
  */
 void stack_push(struct stack *s, struct clause *c)
 {
-	int nsize = s->size + sizeof(struct frame)
-	                    + sizeof(struct tvalue) * c->nlocals;
+	size_t size = sizeof(struct frame) + sizeof(struct tvalue) * c->nlocals;
 
-	struct frame *oldbase = NULL,
-	             *prev = s->frame,
-	             *f;
+	struct segment *seg  = s->segment;
+	struct frame   *prev = s->frame,
+	               *f;
 
-	if (s->capacity < nsize) {
-		oldbase = s->base;
+	if (seg->size + size > seg->capacity) { /* Move up to the next segment */
+		struct segment *next = seg->next;
 
-		s->capacity = (s->capacity) * 2;
+		if (! next || next->capacity < size) {
+			if (next)
+				segment_free(s->pool, next);
 
-		if (s->capacity < nsize)
-			s->capacity = nsize;
-
-		s->base = realloc(s->base, s->capacity);
-		memset((struct frame *)((ptrdiff_t)s->base + s->size + sizeof(struct frame)), 0,
-			   s->capacity - s->size - sizeof(struct frame));
+			next       = segment(s->pool, size);
+			next->prev = seg;
+			seg->next  = next;
+		}
+		seg = s->segment = next;
 	}
 
-	s->frame  = (struct frame *)((ptrdiff_t)s->base + s->size);
-	s->size   = nsize;
-
-	f         = s->frame;
+	f         = (struct frame *)(seg->data + seg->size);
 	f->prev   = prev;
 	f->pc     = c->code;
 	f->clause = c;
 
-	if (s->depth > 0 && oldbase)
-		stack_correct(s, oldbase);
-
+	seg->size += size;
+	s->frame   = f;
 	s->depth  ++;
 
-	assert(s->size <= s->capacity);
+	assert(seg->size <= seg->capacity);
 }
 
 /*
- * Pop the current frame from the stack
+ * Pop the current frame from the stack. The frame stays
+ * valid until the next push.
  */
 struct frame *stack_pop(struct stack *s)
 {
-	struct frame *f = s->frame, *old;
-
-	s->size -= sizeof(*f) + sizeof(struct tvalue) * f->clause->nlocals;
+	struct segment *seg = s->segment;
+	struct frame   *f   = s->frame;
 
-	assert(s->size >= 0);
+	seg->size -= sizeof(*f) + sizeof(struct tvalue) * f->clause->nlocals;
 
 	s->depth --;
 	s->frame = f->prev;
 
-	if (s->capacity - s->size * 2 > STACK_MAXDIFF) {
-		old = s->base;
-		s->capacity = s->size * 2;
-		s->base = realloc(s->base, s->capacity);
-		if (s->base != old)
-			stack_correct(s, old);
+	/* Move down to the previous segment, keeping this one, and
+	 * releasing the one above it. */
+	if (seg->size == 0 && seg->prev) {
+		if (seg->next) {
+			segment_free(s->pool, seg->next);
+			seg->next = NULL;
+		}
+		s->segment = seg->prev;
 	}
 	return f;
 }
 
+/*
+ * Free empty stack `s`, returning its segments to the pool
+ */
+void stack_free(struct stack *s)
+{
+	assert(s->depth == 0);
+
+	if (s->segment->next)
+		segment_free(s->pool, s->segment->next);
+
+	segment_free(s->pool, s->segment);
+	free(s);
+}
+
 /*
  * Module allocator
  */
@@ -117,6 +159,11 @@ struct module *module(const char *name, unsigned pathc)
 	m->name = name;
 	m->paths = pathc ? malloc(sizeof(struct path *) * pathc) : NULL;
 	m->pathc = pathc;
+	m->version = 0;
+	m->index = NULL;
+	m->indexmask = 0;
+	m->constants = NULL;
+	m->nconstants = 0;
 
 	return m;
 }
@@ -139,17 +186,61 @@ void module_prepend(struct modulelist *list, struct module *m)
 {
 	struct modulelist *head;
 
-	if (list->head) {
-		head = modulelist(m);
-		head->tail = list;
+	if (list->head) { /* `list` is referenced, so move its head down */
+		head = modulelist(list->head);
+		head->tail = list->tail;
+		list->head = m;
+		list->tail = head;
 	} else { /* empty */
 		list->head = m;
 	}
 }
 
+/*
+ * Build the path index of module `m`, an open-addressed
+ * hash table which is at most half full.
+ */
+void module_index(struct module *m)
+{
+	unsigned size = 1;
+
+	while (size < m->pathc * 2)
+		size <<= 1;
+
+	free(m->index);
+
+	m->index     = calloc(size, sizeof(struct path *));
+	m->indexmask = size - 1;
+
+	for (int i = 0; i < m->pathc; i++) {
+		const char *name = m->paths[i]->name;
+
+		if (! name)
+			continue;
+
+		unsigned key = hash(name, strlen(name)) & m->indexmask;
+
+		while (m->index[key])
+			key = (key + 1) & m->indexmask;
+
+		m->index[key] = m->paths[i];
+	}
+}
+
 struct path *module_path(struct module *m, const char *path)
 {
-	/* TODO: Optimize with hash table */
+	if (m->index) {
+		struct path *p;
+		unsigned     key = hash(path, strlen(path)) & m->indexmask;
+
+		for (; (p = m->index[key]); key = (key + 1) & m->indexmask) {
+			if (! strcmp(p->name, path))
+				return p;
+		}
+		return NULL;
+	}
+
+	/* Not indexed yet, see `vm_link` */
 	for (int i = 0; i < m->pathc; i++) {
 		if (! strcmp(m->paths[i]->name, path)) {
 			return m->paths[i];
@@ -165,18 +256,149 @@ struct path *path(const char *name, int nclauses)
 	p->name = name;
 	p->nclauses = nclauses;
 	p->clauses = calloc(nclauses, sizeof(struct clause));
+	p->index = NULL;
 
 	return p;
 }
 
-struct clause *clause(struct tvalue pattern, int nlocals, int clen)
+/*
+ * Index key of `e`, the first member of an argument tuple
+ */
+static bool index_keyof(struct tvalue e, uint64_t *key)
+{
+	switch (TV_TYPE(e)) {
+		case TYPE_NONE:
+		case TYPE_ANY:
+		case TYPE_VAR:
+			return false;
+		case TYPE_ATOM:
+		case TYPE_NUMBER:
+			*key = e.word;
+			break;
+		case TYPE_TUPLE:
+			*key = TV(TYPE_TUPLE, TV_TUPLE(e)->arity).word;
+			break;
+		default:
+			*key = TV(TV_TYPE(e), 0).word;
+			break;
+	}
+	return true;
+}
+
+/*
+ * Index key of `v`, the pattern or argument of a clause: the type of its
+ * first element, with the atom, number or tuple arity if there is one.
+ * Returns `false` if `v` is a pattern which matches any value.
+ */
+static bool index_key(struct tvalue *v, uint64_t *key)
+{
+	struct tvalue e;
+
+	if (v == NULL) { /* Empty argument */
+		*key = TV(TYPE_TUPLE, 0).word;
+		return true;
+	}
+	e = *v;
+
+	if (TV_TYPE(e) == TYPE_TUPLE && TV_TUPLE(e)->arity > 0)
+		e = TV_TUPLE(e)->members[0];
+
+	return index_keyof(e, key);
+}
+
+static unsigned index_hash(uint64_t key, unsigned mask)
+{
+	return (unsigned)((key * 0x9e3779b97f4a7c15ULL) >> 32) & mask;
+}
+
+static struct indexentry *index_slot(struct clauseindex *idx, uint64_t key)
+{
+	unsigned h = index_hash(key, idx->mask);
+
+	while (idx->entries[h].nclauses && idx->entries[h].key != key)
+		h = (h + 1) & idx->mask;
+
+	return &idx->entries[h];
+}
+
+/*
+ * Build the clause index of path `p`, so that the clauses which may
+ * match an argument can be found without trying every pattern.
+ *
+ * Each distinct key in the clause patterns gets an entry, holding the
+ * clauses with that key as well as the ones matching any key.
+ */
+void path_index(struct path *p)
+{
+	struct clauseindex *idx = malloc(sizeof(*idx));
+	unsigned            size = 1;
+	uint64_t            key;
+
+	while (size < p->nclauses * 2)
+		size <<= 1;
+
+	idx->mask    = size - 1;
+	idx->entries = calloc(size, sizeof(struct indexentry));
+
+	idx->any.nclauses = 0;
+	idx->any.clauses  = malloc(sizeof(struct clause *) * p->nclauses);
+
+	for (int i = 0; i < p->nclauses; i++) {
+		if (! index_key(&p->clauses[i]->pattern, &key))
+			idx->any.clauses[idx->any.nclauses ++] = p->clauses[i];
+	}
+
+	for (int i = 0; i < p->nclauses; i++) {
+		if (! index_key(&p->clauses[i]->pattern, &key))
+			continue;
+
+		struct indexentry *e = index_slot(idx, key);
+
+		if (e->nclauses) /* Already filled in */
+			continue;
+
+		e->key     = key;
+		e->clauses = malloc(sizeof(struct clause *) * p->nclauses);
+
+		for (int j = 0; j < p->nclauses; j++) {
+			uint64_t k;
+
+			if (! index_key(&p->clauses[j]->pattern, &k) || k == key)
+				e->clauses[e->nclauses ++] = p->clauses[j];
+		}
+	}
+	p->index = idx;
+}
+
+/*
+ * Return the clauses of `p` which may match `arg`, or if `nargs`
+ * is non-zero, the tuple of the `nargs` values at `arg`.
+ */
+struct indexentry *path_clauses(struct path *p, struct tvalue *arg, int nargs)
+{
+	uint64_t           key;
+	struct indexentry *e;
+
+	if (! (nargs ? index_keyof(*arg, &key) : index_key(arg, &key)))
+		return &p->index->any;
+
+	e = index_slot(p->index, key);
+
+	return e->nclauses ? e : &p->index->any;
+}
+
+struct clause *clause(struct tvalue pattern, int nlocals, struct module *m)
 {
 	struct clause *c = malloc(sizeof(*c));
 
 	c->pattern = pattern;
 	c->nlocals = nlocals;
-	c->constants = malloc(sizeof(struct tvalue) * clen);
-	c->constantsn = clen;
+	c->constants = m->constants;
+	c->constantsn = m->nconstants;
+	c->ops = NULL;
+	c->caches = NULL;
+	c->native = NULL;
+	c->ncalls = 0;
 	c->pc = -1;
 
 	return c;
@@ -192,10 +414,10 @@ struct tvalue *select_(int nclauses)
 	return tvalue(TYPE_SELECT, (Value){ .select = s });
 }
 
-Process *process(struct module *m, struct path *path)
+Process *process(struct segpool *pool, struct module *m, struct path *path)
 {
 	Process *p = malloc(sizeof(*p));
-	p->stack = stack();
+	p->stack = stack(pool);
 	p->module = m;
 	p->path = path;
 	p->credits = 0;
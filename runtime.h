@@ -6,25 +6,55 @@
  * runtime.h
  *
  */
-#define  STACK_MAXDIFF  4096
+#define  STACK_SEGMENT  16384  /* Default size of a stack segment, in bytes */
+#define  SEGMENT_POOL   64     /* Free stack segments kept for reuse, at most */
 
 struct clause {
 	struct path    *path;
 	struct tvalue   pattern;
 	Instruction    *code;
+	Operation      *ops;     /* Pre-decoded `code`, for threaded dispatch */
+	struct callcache *caches; /* Inline caches of call sites, by instruction */
+	struct native  *native;  /* Native code, once the clause is hot */
+	unsigned long   ncalls;  /* Calls, counted until it is compiled */
 	unsigned long   codelen; /* TODO: Rename to ncode */
 	int            nlocals;
-	struct tvalue  *constants;
+	struct tvalue  *constants;  /* Constant pool of the module */
 	int             constantsn; /* TODO: Rename to nconstants */
 	int             pc;
 };
 
+/*
+ * Inline cache of a call site, holding the path
+ * its callee was last resolved to.
+ */
+struct callcache {
+	struct path    *path;
+	unsigned        version;  /* Version of `path->module` when resolved */
+};
+
 struct Select {
 	int            nclauses : 8;
 	struct clause  *clauses[];
 };
 typedef struct Select Select;
 
+/*
+ * Clauses of a path which may match arguments with a given key,
+ * in definition order. See `path_index`.
+ */
+struct indexentry {
+	uint64_t        key;
+	int             nclauses;
+	struct clause **clauses;
+};
+
+struct clauseindex {
+	unsigned           mask;
+	struct indexentry *entries;  /* Hashed by key, empty if `nclauses == 0` */
+	struct indexentry  any;      /* Clauses which match any key */
+};
+
 struct path {
 	const char     *name;
 	struct module  *module;
@@ -33,12 +63,20 @@ struct path {
 	int            nclauses;
 	struct clause  *clause;
 	struct clause **clauses;
+	struct clauseindex *index;
 };
 
 struct module {
 	const char   *name;
 	struct path **paths;
 	unsigned      pathc;
+	unsigned      version;  /* Bumped when the module is reloaded */
+	struct path **index;    /* Paths, hashed by name */
+	unsigned      indexmask;
+
+	/* Constants, shared by the clauses of all paths */
+	struct tvalue *constants;
+	unsigned       nconstants;
 };
 
 struct modulelist {
@@ -54,11 +92,36 @@ struct frame {
 	struct tvalue    locals[];
 };
 
-struct stack {
-	struct frame   *base;  /* Base of the stack */
-	struct frame   *frame; /* struct frame pointer */
-	size_t          size;
+/*
+ * Stack segment
+ *
+ * Stacks are made of linked segments, so that frames never move
+ * once pushed. The segment above the current one is kept when it
+ * empties, so that calls around a segment boundary don't allocate.
+ */
+struct segment {
+	struct segment *prev;      /* Segment below */
+	struct segment *next;      /* Empty segment above, if any */
+	size_t          size;      /* Bytes in use */
 	size_t          capacity;
+	char            data[];
+};
+
+/*
+ * Pool of free stack segments, shared by the stacks of a VM
+ *
+ * Only segments of the default size are pooled, so that any of them
+ * will do, and only up to `SEGMENT_POOL` of them. Others are freed.
+ */
+struct segpool {
+	struct segment *free;
+	unsigned        nfree;
+};
+
+struct stack {
+	struct segpool *pool;    /* Pool segments are taken from */
+	struct segment *segment; /* Current segment */
+	struct frame   *frame;   /* struct frame pointer */
 	int             depth;
 };
 
@@ -77,18 +140,22 @@ typedef struct {
 
 struct module     *module          (const char *name, unsigned pathc);
 struct path       *module_path     (struct module *m, const char *path);
+void               module_index    (struct module *m);
 void               module_prepend  (struct modulelist *list, struct module *m);
 struct modulelist *modulelist      (struct module *head);
 
-struct stack   *stack           (void);
+struct stack   *stack           (struct segpool *pool);
 void            stack_push      (struct stack *s, struct clause *c);
 struct frame   *stack_pop       (struct stack *s);
+void            stack_free      (struct stack *s);
 void            stack_pp        (struct stack *s);
 
 struct path       *path            (const char *name, int nclauses);
-Process           *process         (struct module *m, struct path *path);
+void               path_index      (struct path *p);
+struct indexentry *path_clauses    (struct path *p, struct tvalue *arg, int nargs);
+Process           *process         (struct segpool *pool, struct module *m, struct path *path);
 struct frame      *frame           (struct tvalue *locals, int nlocals);
 void               frame_pp        (struct frame *);
 
-struct clause     *clause          (struct tvalue pattern, int nlocals, int clen);
+struct clause     *clause          (struct tvalue pattern, int nlocals, struct module *m);
 struct tvalue     *select_         (int nclauses);
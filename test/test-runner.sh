@@ -10,6 +10,14 @@
 #
 #     ./test-runner.sh FILE...
 #
+# ARBRE_FLAGS are passed on to each `arbre` command, as in
+# `ARBRE_FLAGS=--dispatch=switch`. With ARBRE_AOT set, `arbre run`
+# test-cases are compiled with `arbre aot` instead, and the
+# executable is run.
+#
+# Test-cases which should fail at run-time say so with a
+# `-- fails: MESSAGE` line, MESSAGE being part of the error.
+#
 
 main () {
 
@@ -60,7 +68,12 @@ main () {
 }
 
 arbre () {
-    bin/arbre $@
+    if [ -n "$ARBRE_AOT" ] && [ "$1" = "run" ]; then
+        shift
+        bin/arbre aot $@ $ARBRE_FLAGS -o $TMP.aot > /dev/null && $TMP.aot
+    else
+        bin/arbre $@ $ARBRE_FLAGS
+    fi
 }
 
 run_test () {
@@ -82,6 +95,13 @@ run_test () {
 
     local R=$?
 
+    # Expected run-time failure
+    local FAILS=$(egrep -oe '-- fails: .*' $FILE | sed -e 's/^-- fails: //')
+
+    if [ -n "$FAILS" ]; then
+        [ $R -ne 0 ] && grep -qF -- "$FAILS" $TMP.errors && R=0 || R=1
+    fi
+
     if [ ! $? -eq 0 ]; then
         return $R
     fi
@@ -85,11 +85,9 @@ ClauseEntry *clauseentry(struct node *n, uint8_t index)
 {
 		ClauseEntry  *c = malloc(sizeof(*c));
 		              c->node      = n;
-		              c->kheader   = calloc(128,  sizeof(struct tvalue*));
-		              c->ktable    = symtab(128);
-		              c->kindex    = 0;
 		              c->nreg      = 0;
 		              c->nlocals   = 0;
+		              c->params    = NULL;
 		              c->pc        = 0;
 		              c->code      = calloc(4096, sizeof(uint32_t));
 		              c->codesize  = 4096;
@@ -29,14 +29,10 @@ void        pp_tree(Tree *);
 struct ClauseEntry {
 	struct node    *node;
 
-	/* Constants */
-	SymTable       *ktable;
-	struct tvalue **kheader;
-	unsigned        kindex;
-
 	/* Locals */
 	int            nlocals;
 	uint8_t        nreg;
+	struct node   *params;  /* Parameters, if self tail-calls can loop */
 
 	/* Code */
 	uint32_t       *code;
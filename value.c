@@ -7,13 +7,26 @@
  *
  */
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 
 #include "value.h"
+#include "hash.h"
 
-void tuple_pp (Value v);
+#define ATOMS_SIZE 1024
+
+void tuple_pp (Tuple *t);
+
+/*
+ * Interned atoms, by hash of their name
+ */
+static struct atomlist {
+	const char      *head;
+	struct atomlist *tail;
+} *ATOMS[ATOMS_SIZE];
 
 const char *TYPE_STRINGS[] = {
 	[TYPE_INVALID] = "INVALID",
@@ -33,12 +46,46 @@ struct tvalue *tvalue(TYPE type, Value val)
 {
 	struct tvalue *tval = malloc(sizeof(*tval));
 
-	tval->v = val;
-	tval->t = type;
+	*tval = tv(type, val);
 
 	return tval;
 }
 
+/*
+ * Pack `val` into a tagged value of type `type`
+ */
+struct tvalue tv(TYPE type, Value val)
+{
+	switch (type & TYPE_MASK) {
+		case TYPE_INVALID:
+		case TYPE_NONE:
+			return TV(type, 0);
+		case TYPE_ANY:
+		case TYPE_VAR:
+			return TV(type, val.ident);
+		case TYPE_NUMBER:
+			return TVNUMBER(val.number);
+		default:
+			return TVPTR(type, val.tval);
+	}
+}
+
+/*
+ * Unpack the payload of `tval`
+ */
+Value tv_value(struct tvalue tval)
+{
+	switch (TV_TYPE(tval)) {
+		case TYPE_ANY:
+		case TYPE_VAR:
+			return (Value){ .ident = TV_IDENT(tval) };
+		case TYPE_NUMBER:
+			return (Value){ .number = TV_NUMBER(tval) };
+		default:
+			return (Value){ .tval = TV_PTR(tval) };
+	}
+}
+
 void tvalue_pp(struct tvalue *tval)
 {
 	if (tval == NULL) {
@@ -46,31 +93,30 @@ void tvalue_pp(struct tvalue *tval)
 		return;
 	}
 
-	TYPE t = tval->t;
-	Value v = tval->v;
+	TYPE t = TV_TAG(*tval);
 
 	switch (t & TYPE_MASK) {
 		case TYPE_TUPLE:
-			tuple_pp(v);
+			tuple_pp(TV_TUPLE(*tval));
 			break;
 		case TYPE_BIN:
 			printf("<bin>");
 			break;
 		case TYPE_ATOM:
-			printf("%s", v.atom);
+			printf("%s", TV_ATOM(*tval));
 			break;
 		case TYPE_STRING:
 			printf("<string>");
 			break;
 		case TYPE_NUMBER:
-			printf("%d", v.number);
+			printf("%d", TV_NUMBER(*tval));
 			break;
 		case TYPE_LIST: {
-			List *l = v.list;
+			List *l = TV_LIST(*tval);
 			printf("[");
-			while (l->head) {
-				tvalue_pp(l->head);
-				if ((l = l->tail)->head)
+			while (! LIST_ISEMPTY(l)) {
+				tvalue_pp(&l->head);
+				if (! LIST_ISEMPTY(l = l->tail))
 					printf(", ");
 			}
 			printf("]");
@@ -82,13 +128,13 @@ void tvalue_pp(struct tvalue *tval)
 	}
 }
 
-void tuple_pp(Value v)
+void tuple_pp(Tuple *t)
 {
 	putchar('(');
-	for (int i = 0; i < v.tuple->arity; i++) {
-		tvalue_pp(&v.tuple->members[i]);
+	for (int i = 0; i < t->arity; i++) {
+		tvalue_pp(&t->members[i]);
 
-		if (i < v.tuple->arity - 1)
+		if (i < t->arity - 1)
 			printf(", ");
 	}
 	putchar(')');
@@ -115,16 +161,17 @@ struct tvalue *tuple(int arity)
 	return tvalue(TYPE_TUPLE, (Value){ .tuple = t });
 }
 
-struct tvalue *list(struct tvalue *head)
+/* Empty list */
+List *list(void)
 {
 	List *l = malloc(sizeof(*l));
-	      l->head = head;
+	      l->head = TV(TYPE_INVALID, 0);
 	      l->tail = NULL;
 
-	return tvalue(TYPE_LIST, (Value){ .list = l });
+	return l;
 }
 
-List *list_cons(List *list, struct tvalue *head)
+List *list_cons(List *list, struct tvalue head)
 {
 	List *l = malloc(sizeof(*l));
 	      l->head = head;
@@ -137,7 +184,36 @@ struct tvalue *atom(const char *name)
 {
 	assert(name);
 
-	return tvalue(TYPE_ATOM, (Value){ .atom = name });
+	return tvalue(TYPE_ATOM, (Value){ .atom = atom_intern(name, strlen(name)) });
+}
+
+/*
+ * Return the canonical copy of atom `name`, of length `len`,
+ * adding it to the atom table if it isn't there yet.
+ *
+ * Two atoms are equal if and only if their interned pointers
+ * are equal, so atoms can be compared without `strcmp`.
+ */
+const char *atom_intern(const char *name, size_t len)
+{
+	uint32_t key = hash(name, len) % ATOMS_SIZE;
+
+	for (struct atomlist *l = ATOMS[key]; l; l = l->tail) {
+		if (! strncmp(l->head, name, len) && l->head[len] == '\0')
+			return l->head;
+	}
+
+	char *copy = malloc(len + 1);
+	memcpy(copy, name, len);
+	copy[len] = '\0';
+
+	struct atomlist *l = malloc(sizeof(*l));
+	l->head = copy;
+	l->tail = ATOMS[key];
+
+	ATOMS[key] = l;
+
+	return copy;
 }
 
 struct tvalue *number(const char *src)
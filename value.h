@@ -66,7 +66,7 @@ typedef union {
 	unsigned char   ident;
 	bool            boolean;
 	int             number;
-	const char     *atom;
+	const char     *atom;      /* Interned, see `atom_intern` */
 	String         *string;
 	struct clause  *clause;
 	struct Tuple   *tuple;
@@ -76,11 +76,45 @@ typedef union {
 	struct PathID  *pathid;
 } Value;
 
+/*
+ * Tagged value
+ *
+ * Values are a single 64-bit word: the low byte holds the type and
+ * its qualifiers, and the upper bits hold the payload, which is a
+ * number, an ident, or a pointer. Pointers are assumed to fit in 56
+ * bits, as is the case for user-space addresses on 64-bit platforms.
+ *
+ * Values are only accessed through the `TV_*` macros below.
+ */
 struct tvalue {
-	TYPE    t;
-	Value   v;
+	uint64_t  word;
 };
 
+#define  TV_TAGBITS  8
+#define  TV_TAGMASK  0xff
+
+/* Type, with and without qualifiers */
+#define  TV_TAG(tv)      ((TYPE)((tv).word & TV_TAGMASK))
+#define  TV_TYPE(tv)     (TV_TAG(tv) & TYPE_MASK)
+
+/* Payload */
+#define  TV_BITS(tv)     ((tv).word >> TV_TAGBITS)
+#define  TV_PTR(tv)      ((void *)(uintptr_t)TV_BITS(tv))
+#define  TV_NUMBER(tv)   ((int)(int32_t)(uint32_t)TV_BITS(tv))
+#define  TV_IDENT(tv)    ((unsigned char)TV_BITS(tv))
+#define  TV_ATOM(tv)     ((const char *)TV_PTR(tv))
+#define  TV_TUPLE(tv)    ((struct Tuple *)TV_PTR(tv))
+#define  TV_LIST(tv)     ((struct List *)TV_PTR(tv))
+#define  TV_PATH(tv)     ((struct path *)TV_PTR(tv))
+#define  TV_PATHID(tv)   ((struct PathID *)TV_PTR(tv))
+#define  TV_CLAUSE(tv)   ((struct clause *)TV_PTR(tv))
+#define  TV_SELECT(tv)   ((struct Select *)TV_PTR(tv))
+
+/* Constructors */
+#define  TV(t, bits)     ((struct tvalue){ ((uint64_t)(bits) << TV_TAGBITS) | (uint8_t)(t) })
+#define  TVNUMBER(n)     TV(TYPE_NUMBER, (uint32_t)(n))
+#define  TVPTR(t, p)     TV(t, (uintptr_t)(p))
+
 struct tvaluelist {
 	struct tvalue     *head;
 	struct tvaluelist *tail;
@@ -92,18 +126,29 @@ struct Tuple {
 };
 typedef struct Tuple Tuple;
 
+/*
+ * List cell
+ *
+ * The head is stored in the cell, as a copy. Lists end with an
+ * empty cell, whose head is invalid, see `LIST_ISEMPTY`.
+ */
 struct List {
-	struct tvalue *head;
+	struct tvalue  head;
 	struct List   *tail;
 };
 typedef struct List List;
 
+#define  LIST_ISEMPTY(l)  (TV_TAG((l)->head) == TYPE_INVALID)
+
 struct tvalue *tvalue(TYPE type, Value val);
+struct tvalue  tv(TYPE type, Value val);
+Value          tv_value(struct tvalue tval);
 void           tvalue_pp(struct tvalue *tval);
 void           tvalues_pp(struct tvalue *tval, int size);
 
 struct tvalue *tuple(int arity);
-struct tvalue *list(struct tvalue *);
+List          *list(void);
 struct tvalue *atom(const char *);
+const char    *atom_intern(const char *name, size_t len);
 struct tvalue *number(const char *);
-List   *list_cons(List *list, struct tvalue *e);
+List   *list_cons(List *list, struct tvalue e);
@@ -10,7 +10,7 @@
  * +  vm
  * -  vm_free
  *
- * -> vm_open, vm_run
+ * -> vm_open, vm_link, vm_run
  *
  * TODO: Document functions
  * TODO: Abstract module/path retrieval
@@ -30,6 +30,7 @@
 #include "op.h"
 #include "runtime.h"
 #include "vm.h"
+#include "jit.h"
 #include "error.h"
 #include "bin.h"
 #include "assert.h"
@@ -45,6 +46,24 @@
 struct module *vm_module  (VM *vm, const char *name);
 struct tvalue *vm_execute (VM *vm, Process *proc);
 
+#if defined(VM_THREADED)
+static void           vm_decode   (VM *vm, struct clause *c);
+static struct tvalue *vm_threaded (VM *vm, Process *proc);
+#endif
+
+#if defined(VM_JIT)
+static void           vm_jit      (VM *vm, struct clause *c);
+
+/* Count a call of clause `c`, and compile it once it is hot */
+#define JITCOUNT(vm, c) \
+	do { \
+		if ((vm)->jit && ++ (c)->ncalls == JIT_THRESHOLD) \
+			vm_jit(vm, c); \
+	} while (0)
+#else
+#define JITCOUNT(vm, c)
+#endif
+
 int match (struct tvalue *locals, struct tvalue *pattern, struct tvalue *v, struct tvalue *local);
 
 VM *vm(void)
@@ -57,6 +76,28 @@ VM *vm(void)
 	vm->procs  = malloc(sizeof(Process*) * 1024);
 	vm->proc   = NULL;
 
+	vm->segments.free  = NULL;
+	vm->segments.nfree = 0;
+
+	vm->icache_hits   = 0;
+	vm->icache_misses = 0;
+
+	vm->jit  = false;
+	vm->njit = 0;
+
+	memset(vm->quickened, 0, sizeof(vm->quickened));
+	memset(vm->deopts,    0, sizeof(vm->deopts));
+
+#if defined(VM_THREADED)
+	vm->dispatch = DISPATCH_THREADED;
+	vm_threaded(vm, NULL);
+#else
+	vm->dispatch = DISPATCH_SWITCH;
+#endif
+#if defined(VM_JIT)
+	vm->jit = true;
+#endif
+
 	memset(vm->modules, 0, msize);
 
 	return vm;
@@ -75,12 +116,12 @@ uint8_t *vm_readlist(VM *vm, uint8_t *b, Value *v)
 
 	b += sizeof(length);
 
-	List *l = list_cons(NULL, NULL);
+	List *l = list();
 
 	for (size_t i = 0; i < length; i++) {
-		struct tvalue *val = malloc(sizeof(*val));
+		struct tvalue val;
 
-		b = vm_readk(vm, b, val);
+		b = vm_readk(vm, b, &val);
 		l = list_cons(l, val);
 
 		if (i < length - 1)
@@ -110,11 +151,14 @@ uint8_t *vm_readk(VM *vm, uint8_t *b, struct tvalue *k)
 			debug("]");
 			break;
 		}
-		case TYPE_ATOM:
-			v.atom = (char *)b;
-			b += strlen(v.atom) + 1;
+		case TYPE_ATOM: {
+			size_t len = strlen((char *)b);
+
+			v.atom = atom_intern((char *)b, len);
+			b += len + 1;
 			debug("%s", v.atom);
 			break;
+		}
 		case TYPE_STRING:
 			assert(0);
 			break;
@@ -153,12 +197,46 @@ uint8_t *vm_readk(VM *vm, uint8_t *b, struct tvalue *k)
 			assert(0);
 			break;
 	}
-	k->t = t;
-	k->v = v;
+	*k = tv(t, v);
 
 	return b;
 }
 
+/*
+ * Sort the jump table of the `switchk` at `n` in the code of clause `c`
+ * by key, so that it can be binary searched. The order of atom keys is
+ * only known once they are interned.
+ */
+static void vm_sortswitch(struct clause *c, unsigned long n)
+{
+	Instruction   *t    = c->code + n + 1;
+	int            size = iC(c->code[n]);
+	struct tvalue *K    = c->constants;
+
+	struct {
+		Instruction in;
+		long        target;
+	} e[size], tmp;
+
+	for (int i = 0; i < size; i++) {
+		e[i].in     = t[i];
+		e[i].target = i + 1 + iJ(t[i]);
+	}
+
+	for (int i = 1; i < size; i++) {
+		tmp = e[i];
+
+		int j = i;
+		for (; j > 0 && K[iA(e[j - 1].in)].word > K[iA(tmp.in)].word; j--)
+			e[j] = e[j - 1];
+
+		e[j] = tmp;
+	}
+
+	for (int i = 0; i < size; i++)
+		t[i] = iAJ(OP_JUMP, iA(e[i].in), e[i].target - i - 1);
+}
+
 /* TODO: Paths should be per-module */
 uint8_t *vm_readclause(VM *vm, struct path *p, int index, uint8_t *b)
 {
@@ -168,21 +246,11 @@ uint8_t *vm_readclause(VM *vm, struct path *p, int index, uint8_t *b)
 	/* Number of locals */
 	uint8_t nlocals = *b ++;
 
-	/* Size of constants table */
-	uint8_t ksize = *b ++;
+	debug("reading clause with %d local(s)..\n", nlocals);
 
-	debug("reading clause with %d constant(s) and %d local(s)..\n", ksize, nlocals);
-
-	struct clause *c = clause(pattern, nlocals, ksize);
+	struct clause *c = clause(pattern, nlocals, p->module);
 	c->path = p;
 
-	for (int i = 0; i < ksize; i++) {
-		debug("\tk%d = ", i);
-		b = vm_readk(vm, b, &c->constants[i]);
-		debug("\n");
-	}
-	debug("\n");
-
 	c->codelen = *((unsigned long*)b);
 	b += sizeof(c->codelen);
 
@@ -191,6 +259,29 @@ uint8_t *vm_readclause(VM *vm, struct path *p, int index, uint8_t *b)
 	/* Skip all code */
 	b += c->codelen * sizeof(Instruction);
 
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		if (iOP(c->code[n]) == OP_SWITCHK)
+			vm_sortswitch(c, n);
+	}
+
+	/* Allocate inline caches, if the clause calls out by path id */
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		OpCode o = iOP(c->code[n]);
+
+		bool call = o == OP_CALL  || o == OP_TAILCALL ||
+		            o == OP_CALLN || o == OP_TAILCALLN;
+
+		if (call && ISK(iB(c->code[n]))) {
+			c->caches = calloc(c->codelen, sizeof(struct callcache));
+			break;
+		}
+	}
+
+#if defined(VM_THREADED)
+	if (vm->dispatch == DISPATCH_THREADED)
+		vm_decode(vm, c);
+#endif
+
 	p->clauses[index] = c;
 
 	return b;
@@ -229,6 +320,9 @@ uint8_t *vm_readpath(VM *vm, struct module *m, int index, uint8_t *b)
 		b = vm_readclause(vm, p, i, b);
 	}
 
+	if (nclauses > 1)
+		path_index(p);
+
 	return b;
 }
 
@@ -246,6 +340,20 @@ void vm_open(VM *vm, const char *name, uint8_t *buffer)
 
 	debug("version %d.%d.%d\n", v.major, v.minor, v.patch);
 
+	/* Constant pool, shared by all clauses */
+	uint32_t nconstants = *((uint32_t *)buffer);
+	buffer += sizeof(uint32_t);
+
+	debug("reading %u constant(s)..\n", nconstants);
+
+	struct tvalue *constants = malloc(sizeof(*constants) * nconstants);
+
+	for (uint32_t i = 0; i < nconstants; i++) {
+		debug("\tk%u = ", i);
+		buffer = vm_readk(vm, buffer, &constants[i]);
+		debug("\n");
+	}
+
 	int pathsn = *((int*)buffer);
 	buffer += sizeof(int);
 
@@ -253,12 +361,25 @@ void vm_open(VM *vm, const char *name, uint8_t *buffer)
 
 	struct module *m = module(name, pathsn);
 
+	m->constants  = constants;
+	m->nconstants = nconstants;
+
 	for (int i = 0; i < pathsn; i++) {
 		buffer = vm_readpath(vm, m, i, buffer);
 	}
 
 	uint32_t key = hash(name, strlen(name)) % 512;
 
+	/* Reloading a module supersedes the previous version, and
+	 * invalidates the call sites which were resolved into it. */
+	for (struct modulelist *ms = vm->modules[key]; ms && ms->head; ms = ms->tail) {
+		if (! strcmp(ms->head->name, name)) {
+			m->version = ++ ms->head->version;
+			ms->head   = m;
+			return;
+		}
+	}
+
 	if (vm->modules[key]) {
 		module_prepend(vm->modules[key], m);
 	} else {
@@ -266,25 +387,100 @@ void vm_open(VM *vm, const char *name, uint8_t *buffer)
 	}
 }
 
-int match_atom(Value pattern, Value v, struct tvalue *local)
+/*
+ * Link constant `k` of module `from`, if it refers to a path.
+ * Returns `1` if the reference couldn't be resolved, else `0`.
+ */
+static int vm_linkk(VM *vm, struct module *from, struct tvalue *k)
+{
+	const char    *module, *path;
+	struct module *m;
+	struct path   *p;
+
+	switch (TV_TAG(*k)) {
+		case TYPE_PATH: /* Already linked, unless its module was reloaded */
+			p = TV_PATH(*k);
+
+			if (vm_module(vm, p->module->name) == p->module)
+				return 0;
+
+			module = p->module->name;
+			path   = p->name;
+			break;
+		case TYPE_PATHID:
+			module = TV_PATHID(*k)->module;
+			path   = TV_PATHID(*k)->path;
+			break;
+		default:
+			return 0;
+	}
+
+	if ((m = vm_module(vm, module)) && (p = module_path(m, path))) {
+		*k = TVPTR(TYPE_PATH, p);
+		return 0;
+	}
+	error(0, 0, "unresolved reference to `%s/%s` from `%s`",
+	      module, path, from->name);
+
+	return 1;
+}
+
+/*
+ * Link the loaded modules: index their paths by name, and rewrite the
+ * path ids of their constant pools into the paths they refer to, so
+ * that calls don't resolve names at run-time.
+ *
+ * All unresolved references are reported at once. This should be
+ * called again after a module is reloaded.
+ */
+void vm_link(VM *vm)
+{
+	int unresolved = 0;
+
+	for (int i = 0; i < 512; i++) {
+		for (struct modulelist *ms = vm->modules[i]; ms && ms->head; ms = ms->tail) {
+			if (! ms->head->index)
+				module_index(ms->head);
+		}
+	}
+
+	for (int i = 0; i < 512; i++) {
+		for (struct modulelist *ms = vm->modules[i]; ms && ms->head; ms = ms->tail) {
+			struct module *m = ms->head;
+
+			for (unsigned k = 0; k < m->nconstants; k++)
+				unresolved += vm_linkk(vm, m, &m->constants[k]);
+		}
+	}
+
+	if (unresolved)
+		error(1, 0, "%d unresolved reference(s)", unresolved);
+}
+
+/*
+ * Atoms are interned as they are loaded, so matching
+ * them is a single word comparison.
+ */
+int match_atom(struct tvalue *pattern, struct tvalue *v, struct tvalue *local)
 {
-	// TODO: If we keep a global store of atoms, we only
-	// need a pointer comparison here.
-	if (! strcmp(pattern.atom, v.atom))
+	if (pattern->word == v->word)
 		return 0;
 
 	return -1;
 }
 
-int match_tuple(struct tvalue *locals, Value pattern, Value v, struct tvalue *local)
+int match_tuple(struct tvalue *locals, struct tvalue *pattern, struct tvalue *v, struct tvalue *local)
 {
 	int m = 0, nmatches = 0;
 
-	if (pattern.tuple->arity != v.tuple->arity)
+	Tuple *pat = TV_TUPLE(*pattern);
+	Tuple *val = TV_TUPLE(*v);
+
+	if (pat->arity != val->arity)
 		return -1;
 
-	for (int i = 0; i < v.tuple->arity; i++) {
-		m = match(locals, pattern.tuple->members + i, v.tuple->members + i, local + nmatches);
+	for (int i = 0; i < val->arity; i++) {
+		m = match(locals, pat->members + i, val->members + i, local + nmatches);
 
 		if (m == -1)
 			return -1;
@@ -294,34 +490,34 @@ int match_tuple(struct tvalue *locals, Value pattern, Value v, struct tvalue *lo
 	return nmatches;
 }
 
-int match_list(struct tvalue *locals, Value pattern, Value v, struct tvalue *local)
+int match_list(struct tvalue *locals, struct tvalue *pattern, struct tvalue *v, struct tvalue *local)
 {
 	int m = 0, nmatches = 0;
 
-	List *pat = pattern.list;
-	List *val = v.list;
+	List *pat = TV_LIST(*pattern);
+	List *val = TV_LIST(*v);
 
 	while (val) {
-		if (!val->head && !pat->head) { /* Reached end of both lists (match) */
+		if (LIST_ISEMPTY(val) && LIST_ISEMPTY(pat)) { /* Reached end of both lists (match) */
 			break;
 		}
 
-		if (val->head && !pat->head) { /* pattern is shorter than value */
+		if (! LIST_ISEMPTY(val) && LIST_ISEMPTY(pat)) { /* pattern is shorter than value */
 			return -1;
 		}
 
-		if (pat->head->t & Q_RANGE) {
-			struct tvalue *t = tvalue(TYPE_LIST, (Value){ .list = val });
-			m = match(locals, pat->head, t, local + nmatches);
+		if (TV_TAG(pat->head) & Q_RANGE) {
+			struct tvalue t = TVPTR(TYPE_LIST, val);
+			m = match(locals, &pat->head, &t, local + nmatches);
 			return nmatches + m;
-		} else {
-			m = match(locals, pat->head, val->head, local + nmatches);
 		}
 
-		if (!val->head && pat->head) { /* value is shorter than pattern */
+		if (LIST_ISEMPTY(val)) { /* value is shorter than pattern */
 			return -1;
 		}
 
+		m = match(locals, &pat->head, &val->head, local + nmatches);
+
 		if (m == -1)
 			return -1;
 
@@ -337,47 +533,97 @@ int match(struct tvalue *locals, struct tvalue *pattern, struct tvalue *v, struc
 {
 	assert(pattern);
 
+	TYPE t = TV_TYPE(*pattern);
+
 	if (v == NULL) {
-		if ((pattern->t & TYPE_MASK) == TYPE_TUPLE &&
-			pattern->v.tuple->arity == 0) {
+		if (t == TYPE_TUPLE && TV_TUPLE(*pattern)->arity == 0) {
 			return 0;
 		} else {
 			return -1;
 		}
 	}
 
-	if ((pattern->t & TYPE_MASK) == TYPE_ANY) {
+	if (t == TYPE_ANY) {
 		*local = *v;
 		return 1;
-	} else if ((pattern->t & TYPE_MASK) == TYPE_VAR) {
-		return match(locals, &locals[pattern->v.ident], v, local);
-	} else if ((pattern->t & TYPE_MASK) != (v->t & TYPE_MASK)) {
+	} else if (t == TYPE_VAR) {
+		return match(locals, &locals[TV_IDENT(*pattern)], v, local);
+	} else if (t != TV_TYPE(*v)) {
 		return -1;
 	}
 
-	switch (pattern->t & TYPE_MASK) {
+	switch (t) {
 		case TYPE_TUPLE:
-			return match_tuple(locals, pattern->v, v->v, local);
+			return match_tuple(locals, pattern, v, local);
 		case TYPE_LIST:
-			return match_list(locals, pattern->v, v->v, local);
+			return match_list(locals, pattern, v, local);
 		case TYPE_ATOM:
-			return match_atom(pattern->v, v->v, local);
+			return match_atom(pattern, v, local);
 		case TYPE_NUMBER:
-			return (pattern->v.number == v->v.number) ? 0 : -1;
+			return (TV_NUMBER(*pattern) == TV_NUMBER(*v)) ? 0 : -1;
 		default:
 			assert(0);
 	}
 	return -1;
 }
 
-int vm_tailcall(VM *vm, Process *proc, struct clause *c, struct tvalue *arg)
+/*
+ * Match the pattern of clause `c` against its argument: `arg`, or if
+ * `nargs` is non-zero, the tuple of the `nargs` values at `arg`. That
+ * tuple is only built if the pattern binds it as a whole.
+ */
+static int match_args(struct clause *c, struct tvalue *arg, int nargs, struct tvalue *local)
+{
+	struct tvalue *pattern = &c->pattern;
+
+	if (nargs == 0)
+		return match(NULL, pattern, arg, local);
+
+	if (TV_TYPE(*pattern) == TYPE_TUPLE) {
+		Tuple *pat      = TV_TUPLE(*pattern);
+		int    nmatches = 0;
+
+		if (pat->arity != nargs)
+			return -1;
+
+		for (int i = 0; i < nargs; i++) {
+			int m = match(NULL, pat->members + i, arg + i, local + nmatches);
+
+			if (m == -1)
+				return -1;
+
+			nmatches += m;
+		}
+		return nmatches;
+	}
+
+	struct tvalue *t = tuple(nargs);
+
+	memcpy(TV_TUPLE(*t)->members, arg, sizeof(struct tvalue) * nargs);
+
+	return match(NULL, pattern, t, local);
+}
+
+int vm_tailcall(VM *vm, Process *proc, struct clause *c, struct tvalue *arg, int nargs)
 {
 	struct frame  *frame = proc->stack->frame;
+
+	/* The frame is sized for its clause, replace it if `c`
+	 * has a different number of locals. */
+	if (frame->clause->nlocals != c->nlocals) {
+		uint8_t result = frame->result;
+
+		stack_pop(proc->stack);
+		stack_push(proc->stack, c);
+
+		frame = proc->stack->frame;
+		frame->result = result;
+	}
 	struct tvalue *local = frame->locals;
 
 	memset(local, 0, sizeof(struct tvalue) * c->nlocals);
 
-	int nlocals = match(NULL, &c->pattern, arg, local);
+	int nlocals = match_args(c, arg, nargs, local);
 
 	if (nlocals == -1)
 		return -1;
@@ -387,7 +633,7 @@ int vm_tailcall(VM *vm, Process *proc, struct clause *c, struct tvalue *arg)
 			debug(INDENT);
 
 		printf("%s/%s ", c->path->module->name, c->path->name);
-		tvalue_pp(arg);
+		nargs ? tvalues_pp(arg, nargs) : tvalue_pp(arg);
 		printf("\n");
 	#endif
 
@@ -397,10 +643,12 @@ int vm_tailcall(VM *vm, Process *proc, struct clause *c, struct tvalue *arg)
 	frame->clause = c;
 	frame->pc     = c->code;
 
+	JITCOUNT(vm, c);
+
 	return nlocals;
 }
 
-int vm_call(VM *vm, Process *proc, struct clause *c, struct tvalue *arg)
+int vm_call(VM *vm, Process *proc, struct clause *c, struct tvalue *arg, int nargs)
 {
 	/* TODO: Perform pattern-match */
 
@@ -414,7 +662,7 @@ int vm_call(VM *vm, Process *proc, struct clause *c, struct tvalue *arg)
 	struct tvalue *locals = s->frame->locals,
 				  *local  = locals;
 
-	int nlocals = match(NULL, &c->pattern, arg, local);
+	int nlocals = match_args(c, arg, nargs, local);
 
 	if (nlocals == -1) {
 		return -1;
@@ -424,16 +672,41 @@ int vm_call(VM *vm, Process *proc, struct clause *c, struct tvalue *arg)
 	for (int i = 0; i < proc->stack->depth; i++)
 		printf(INDENT);
 	printf("%s/%s ", c->path->module->name, c->path->name);
-	tvalue_pp(arg);
+	nargs ? tvalues_pp(arg, nargs) : tvalue_pp(arg);
 	printf("\n");
 #endif
 
+	JITCOUNT(vm, c);
+
 	return nlocals;
 }
 
+/*
+ * Call path `p` with `arg`, or the `nargs` arguments at `arg`, trying
+ * the clauses which its index selects until one matches. Returns the
+ * number of matches, or `-1` if there was no matching clause.
+ */
+int vm_callpath(VM *vm, Process *proc, struct path *p, struct tvalue *arg, int nargs)
+{
+	if (p->nclauses == 1)
+		return vm_call(vm, proc, p->clauses[0], arg, nargs);
+
+	struct indexentry *e = path_clauses(p, arg, nargs);
+
+	for (int i = 0; i < e->nclauses; i++) {
+		int matches = vm_call(vm, proc, e->clauses[i], arg, nargs);
+
+		if (matches >= 0)
+			return matches;
+
+		stack_pop(proc->stack);
+	}
+	return -1;
+}
+
 Process *vm_spawn(VM *vm, struct module *m, struct path *p)
 {
-	Process *proc = process(m, p);
+	Process *proc = process(&vm->segments, m, p);
 
 	proc->flags |= PROC_READY;
 
@@ -469,6 +742,195 @@ Process *vm_select(VM *vm)
 	return NULL;
 }
 
+/*
+ * Resolve `callee`, a path or path id, to a path.
+ *
+ * Path ids are resolved through `cache`, the inline cache of the call
+ * site, if there is one. Cache entries are valid for as long as the
+ * module they point into isn't reloaded.
+ */
+static struct path *vm_resolve(VM *vm, struct tvalue *callee, struct callcache *cache)
+{
+	struct module *m;
+	struct path   *p;
+
+	switch (TV_TAG(*callee)) {
+		case TYPE_PATH:
+			return TV_PATH(*callee);
+		case 0:
+		case TYPE_PATHID:
+			break;
+		default:
+			assert(0);
+	}
+
+	if (cache && cache->path && cache->path->module->version == cache->version) {
+		vm->icache_hits ++;
+		return cache->path;
+	}
+
+	const char *module = TV_PATHID(*callee)->module;
+	const char *path   = TV_PATHID(*callee)->path;
+
+	if (! (m = vm_module(vm, module)))
+		error(1, 0, "module `%s` not found", module);
+
+	if (! (p = module_path(m, path)))
+		error(1, 0, "path `%s` not found in `%s` module", path, module);
+
+	if (cache) {
+		vm->icache_misses ++;
+		cache->path    = p;
+		cache->version = m->version;
+	}
+	return p;
+}
+
+/*
+ * Call `callee` with `arg`, or the `nargs` arguments at `arg`, pushing
+ * a new frame on the stack of `proc`. The return value will be stored
+ * in register `result` of the caller.
+ *
+ * Arguments may be read from the caller's frame, as frames don't move.
+ */
+static void vm_invoke(VM *vm, Process *proc, struct tvalue *callee, struct callcache *cache,
+                      struct tvalue *arg, int nargs, uint8_t result)
+{
+	struct path   *p       = NULL;
+	int            matches = -1;
+
+	if (TV_TAG(*callee) == TYPE_CLAUSE) {
+		p = TV_CLAUSE(*callee)->path;
+		matches = vm_call(vm, proc, TV_CLAUSE(*callee), arg, nargs);
+	} else {
+		p = vm_resolve(vm, callee, cache);
+		matches = vm_callpath(vm, proc, p, arg, nargs); /* Create & push stack call-frame */
+	}
+	if (matches < 0)
+		error(1, 0, "no matches for %s/%s", p->module->name, p->name);
+
+	proc->stack->frame->result = result; /* Set return-value register */
+}
+
+/*
+ * Replace the current frame with a call to `callee`, selecting the
+ * clause to call by `arg`, or the `nargs` arguments at `arg`. The
+ * callee may be any path or clause, in this module or another.
+ */
+static void vm_retail(VM *vm, Process *proc, struct tvalue *callee, struct callcache *cache,
+                      struct tvalue *arg, int nargs)
+{
+	struct tvalue      val[nargs ? nargs : 1]; /* `arg` is in the frame being replaced */
+	struct path       *p;
+	struct indexentry *e;
+
+	memcpy(val, arg, sizeof(struct tvalue) * (nargs ? nargs : 1));
+
+	if (TV_TAG(*callee) == TYPE_CLAUSE) {
+		p = TV_CLAUSE(*callee)->path;
+
+		if (vm_tailcall(vm, proc, TV_CLAUSE(*callee), val, nargs) >= 0)
+			return;
+	} else if ((p = vm_resolve(vm, callee, cache))->nclauses == 1) {
+		if (vm_tailcall(vm, proc, p->clauses[0], val, nargs) >= 0) /* Replace stack call-frame */
+			return;
+	} else {
+		e = path_clauses(p, val, nargs);
+
+		for (int i = 0; i < e->nclauses; i++) {
+			if (vm_tailcall(vm, proc, e->clauses[i], val, nargs) >= 0)
+				return;
+		}
+	}
+	error(1, 0, "no matches for %s/%s", p->module->name, p->name);
+}
+
+/*
+ * Search the jump table `t` of a `switchk`, of `n` entries, for
+ * the entry with key `v`. Returns `n`, the index of the default
+ * entry, if there is none.
+ */
+static inline int vm_searchk(struct tvalue *K, Instruction *t, int n, struct tvalue v)
+{
+	int lo = 0, hi = n - 1;
+
+	while (lo <= hi) {
+		int      mid = (lo + hi) / 2;
+		uint64_t key = K[iA(t[mid])].word;
+
+		if (key == v.word)
+			return mid;
+		else if (key < v.word)
+			lo = mid + 1;
+		else
+			hi = mid - 1;
+	}
+	return n;
+}
+
+/*
+ * Pop the current frame, and hand `v`, or the `n` values at `v` if
+ * `n` is non-zero, over to the caller. Returns `NULL`, or the final
+ * value if we reached the top of the stack.
+ *
+ * Values are stored in registers `result` and up of the caller if it
+ * unpacks exactly `n` of them (see `OP_UNPACK`), else as a tuple.
+ */
+static struct tvalue *vm_return(VM *vm, Process *proc, struct tvalue *v, int n)
+{
+	struct stack  *s   = proc->stack;
+	struct tvalue  val = *v;
+	struct frame  *old = stack_pop(s);
+
+	if (n > 0 && s->depth > 0 && iOP(*s->frame->pc) == OP_UNPACK
+	          && iC(*s->frame->pc) == (unsigned)n) {
+		memcpy(&s->frame->locals[old->result], v, sizeof(*v) * n);
+		s->frame->pc += 2; /* Skip the `unpack`, and its jump */
+
+		return NULL;
+	}
+
+	if (n > 0) {
+		val = *tuple(n);
+		memcpy(TV_TUPLE(val)->members, v, sizeof(*v) * n);
+	}
+
+	/* We reached the top of the stack,
+	 * exit loop & return last register value. */
+	if (s->depth == 0) {
+		struct tvalue *ret = malloc(sizeof(*ret));
+		*ret = val;
+		return ret;
+	}
+
+	assert(s->frame->locals);
+	assert(old);
+
+	s->frame->locals[old->result] = val;
+
+#if defined(DEBUG)
+	for (int i = 0; i < proc->stack->depth; i++)
+		debug(INDENT);
+	debug("%s/%s\n", s->frame->clause->path->module->name,
+					 s->frame->clause->path->name);
+#endif
+
+	return NULL;
+}
+
+/*
+ * Fail with a type error, as operand of op-code `o` isn't a number
+ */
+void vm_badarg(OpCode o)
+{
+	error(1, 0, "bad argument to `%s`: not a number", OPCODE_STRINGS[o]);
+}
+
+/* Check that operand `v` of op-code `o` is a number. Ops whose
+ * operands are known to be numbers have unchecked variants. */
+#define CHECKNUM(v, o) \
+	do { if (TV_TYPE(v) != TYPE_NUMBER) vm_badarg(o); } while (0)
+
 #define RK(x) (ISK(x) ? K[INDEXK(x)] : R[x])
 #define OP    (iOP(i))
 #define A     (iA(i))
@@ -477,7 +939,11 @@ Process *vm_select(VM *vm)
 #define D     (iD(i))
 #define J     (iJ(i))
 
-struct tvalue *vm_execute(VM *vm, Process *proc)
+/*
+ * Run `proc`, decoding each instruction as it is reached,
+ * and dispatching on its op-code.
+ */
+static struct tvalue *vm_switch(VM *vm, Process *proc)
 {
 	struct clause *c;
 
@@ -513,28 +979,24 @@ reentry:
 				R[A] = R[B];
 				break;
 			case OP_LOADK:
-				assert(A < f->nlocals);
+				assert(A < c->nlocals);
 
-				R[A] = K[INDEXK(D)];
+				R[A] = K[D];
 				break;
-			case OP_ADD: {
-				assert(RK(B).t == TYPE_NUMBER);
-				assert(RK(C).t == TYPE_NUMBER);
-
-				R[A].t        = TYPE_NUMBER;
-				R[A].v.number = RK(B).v.number +
-								RK(C).v.number;
+			case OP_ADD:
+				CHECKNUM(RK(B), OP);
+				CHECKNUM(RK(C), OP);
+				/* Fallthrough */
+			case OP_ADDNN:
+				R[A] = TVNUMBER(TV_NUMBER(RK(B)) + TV_NUMBER(RK(C)));
 				break;
-			}
-			case OP_SUB: {
-				assert(RK(B).t == TYPE_NUMBER);
-				assert(RK(C).t == TYPE_NUMBER);
-
-				R[A].t        = TYPE_NUMBER;
-				R[A].v.number = RK(B).v.number -
-								RK(C).v.number;
+			case OP_SUB:
+				CHECKNUM(RK(B), OP);
+				CHECKNUM(RK(C), OP);
+				/* Fallthrough */
+			case OP_SUBNN:
+				R[A] = TVNUMBER(TV_NUMBER(RK(B)) - TV_NUMBER(RK(C)));
 				break;
-			}
 			case OP_JUMP:
 				f->pc += J;
 				break;
@@ -549,14 +1011,15 @@ reentry:
 
 				break;
 			}
-			case OP_GT: {
+			case OP_GT:
+				CHECKNUM(RK(B), OP);
+				CHECKNUM(RK(C), OP);
+				/* Fallthrough */
+			case OP_GTNN: {
 				struct tvalue b = RK(B),
 							  c = RK(C);
 
-				assert(b.t == TYPE_NUMBER);
-				assert(c.t == TYPE_NUMBER);
-
-				if (b.v.number > c.v.number)
+				if (TV_NUMBER(b) > TV_NUMBER(c))
 					f->pc ++;
 				else
 					f->pc += iJ(*f->pc) + 1;
@@ -567,112 +1030,260 @@ reentry:
 				struct tvalue b = RK(B),
 							  c = RK(C);
 
-				if (b.v.number == c.v.number)
+				if (b.word == c.word)
 					f->pc ++;
 				else
 					f->pc += iJ(*f->pc) + 1;
 
 				break;
 			}
-			case OP_TUPLE:
-				R[A] = *tuple(B);
+			case OP_EQJ:
+				if (RK(B).word != RK(C).word)
+					f->pc += A;
 				break;
-			case OP_SETTUPLE:
-				assert(R[A].t == TYPE_TUPLE);
-				assert(B < R[A].v.tuple->arity);
+			case OP_GTJ:
+				CHECKNUM(RK(B), OP);
+				CHECKNUM(RK(C), OP);
+				/* Fallthrough */
+			case OP_GTJNN:
+				if (TV_NUMBER(RK(B)) <= TV_NUMBER(RK(C)))
+					f->pc += A;
+				break;
+			case OP_MATCHJ: {
+				struct tvalue b = RK(B),
+							  c = RK(C);
 
-				R[A].v.tuple->members[B] = RK(C);
+				if (match(R, &b, &c, NULL) < 0)
+					f->pc += A;
 				break;
-			case OP_LIST:
-				R[A] = *list(0);
+			}
+			case OP_ADDI:
+				CHECKNUM(RK(B), OP);
+				/* Fallthrough */
+			case OP_ADDINN:
+				R[A] = TVNUMBER(TV_NUMBER(RK(B)) + iSC(i));
 				break;
-			case OP_CONS: {
-				int c = C;
+			case OP_SUBI:
+				CHECKNUM(RK(B), OP);
+				/* Fallthrough */
+			case OP_SUBINN:
+				R[A] = TVNUMBER(TV_NUMBER(RK(B)) - iSC(i));
+				break;
+			case OP_EQI:
+			case OP_GTI:
+			case OP_LTI:
+			case OP_EQIJ:
+			case OP_GTIJ:
+			case OP_LTIJ:
+			case OP_GTINN:
+			case OP_LTINN:
+			case OP_GTIJNN:
+			case OP_LTIJNN: {
+				struct tvalue b = RK(B);
+				bool          t;
+
+				switch (OP) {
+					case OP_EQI: case OP_EQIJ:
+						t = TV_TYPE(b) == TYPE_NUMBER && TV_NUMBER(b) == iSC(i);
+						break;
+					case OP_GTI: case OP_GTIJ:
+						CHECKNUM(b, OP);
+						/* Fallthrough */
+					case OP_GTINN: case OP_GTIJNN:
+						t = TV_NUMBER(b) > iSC(i);
+						break;
+					case OP_LTI: case OP_LTIJ:
+						CHECKNUM(b, OP);
+						/* Fallthrough */
+					default:
+						t = TV_NUMBER(b) < iSC(i);
+						break;
+				}
 
-				assert(R[B].t == TYPE_LIST);
+				if (OPMODE(OP) == JBC) {
+					if (! t)
+						f->pc += A;
+				} else if (t) {
+					f->pc ++;
+				} else {
+					f->pc += iJ(*f->pc) + 1;
+				}
+				break;
+			}
+			case OP_SWITCH: {
+				Instruction *t = f->pc; /* Jump table */
+				long         e = (long)TV_NUMBER(R[A]) - TV_NUMBER(RK(B));
 
-				struct tvalue *t = ISK(c) ? &K[INDEXK(c)] : &R[c];
+				if (TV_TYPE(R[A]) != TYPE_NUMBER || e < 0 || e >= C)
+					e = C;
 
-				List *l = list_cons(R[B].v.list, t);
-				R[A] = *tvalue(TYPE_LIST, (Value){ .list = l });
+				f->pc = t + e + 1 + iJ(t[e]);
 				break;
 			}
-			case OP_PATH:
-				R[A].v.pathid->module = RK(B).v.atom;
-				R[A].v.pathid->path   = RK(C).v.atom;
+			case OP_SWITCHK: {
+				Instruction *t = f->pc; /* Jump table */
+				int          e = vm_searchk(K, t, C, R[A]);
+
+				f->pc = t + e + 1 + iJ(t[e]);
 				break;
-			case OP_TAILCALL: {
-				int             matches = -1;
-				struct tvalue   arg     = R[C];
+			}
+			case OP_TESTT: {
+				struct tvalue b = R[B];
 
-				c = c->path->clauses[B];
+				if (TV_TYPE(b) == TYPE_TUPLE && TV_TUPLE(b)->arity == C)
+					f->pc ++;
+				else
+					f->pc += iJ(*f->pc) + 1;
 
-				if ((matches = vm_tailcall(vm, proc, c, &arg)) < 0) /* Replace stack call-frame */
-					error(1, 0, "no matches for %s/%s", c->path->module->name, c->path->name);
-				goto reentry;
+				break;
 			}
-			case OP_CALL: {
-				int matches = -1;
+			case OP_TESTL: {
+				struct tvalue b = R[B];
 
-				struct tvalue callee = RK(B);
-				struct tvalue arg = RK(C);
+				if (TV_TYPE(b) == TYPE_LIST && (C == 2 || ! LIST_ISEMPTY(TV_LIST(b)) == C))
+					f->pc ++;
+				else
+					f->pc += iJ(*f->pc) + 1;
 
-				switch (callee.t) {
-					case TYPE_PATH: {
-						matches = vm_call(vm, proc, callee.v.path->clauses[0], &arg); /* Create & push stack call-frame */
-						break;
-					}
-					case 0:
-					case TYPE_PATHID: {
-						struct path   *p;
-						struct module *m;
+				break;
+			}
+			case OP_EQV:
+				if (RK(B).word == RK(C).word)
+					f->pc ++;
+				else
+					f->pc += iJ(*f->pc) + 1;
 
-						const char *module = callee.v.pathid->module;
-						const char *path   = callee.v.pathid->path;
+				break;
+			case OP_GETT:
+				assert(TV_TYPE(R[B]) == TYPE_TUPLE);
+				assert(C < TV_TUPLE(R[B])->arity);
 
-						if (! (m = vm_module(vm, module)))
-							error(1, 0, "module `%s` not found", module);
+				R[A] = TV_TUPLE(R[B])->members[C];
+				break;
+			case OP_HEAD:
+				assert(TV_TYPE(R[B]) == TYPE_LIST);
 
-						if (! (p = module_path(m, path)))
-							error(1, 0, "path `%s` not found in `%s` module", path, module);
+				R[A] = TV_LIST(R[B])->head;
+				break;
+			case OP_TAIL:
+				assert(TV_TYPE(R[B]) == TYPE_LIST);
 
-						K[INDEXK(B)] = *tvalue(TYPE_PATH, (Value){ .path = p });
+				R[A] = TVPTR(TYPE_LIST, TV_LIST(R[B])->tail);
+				break;
+			case OP_TUPLE:
+				R[A] = *tuple(B);
+				break;
+			case OP_SETTUPLE:
+				assert(TV_TYPE(R[A]) == TYPE_TUPLE);
+				assert(B < TV_TUPLE(R[A])->arity);
 
-						c = p->clauses[0];
-						matches = vm_call(vm, proc, c, &arg); /* Create & push stack call-frame */
+				TV_TUPLE(R[A])->members[B] = RK(C);
+				break;
+			case OP_LIST:
+				R[A] = TVPTR(TYPE_LIST, list());
+				break;
+			case OP_CONS: {
+				assert(TV_TYPE(R[B]) == TYPE_LIST);
 
-						break;
-					}
-					case TYPE_CLAUSE:
-						c = callee.v.clause;
-						break;
-					default:
-						assert(0);
-				}
-				if (matches < 0)
-					error(1, 0, "no matches for %s/%s", c->path->module->name, c->path->name);
+				List *l = list_cons(TV_LIST(R[B]), RK(C));
+				R[A] = TVPTR(TYPE_LIST, l);
+				break;
+			}
+			case OP_TUPLEF: {
+				Tuple *t = (Tuple *)&R[C];
+				       t->arity = B;
+
+				R[A] = TVPTR(TYPE_TUPLE, t);
+				break;
+			}
+			case OP_LISTF: {
+				List *l = (List *)&R[C];
+				      l->head = TV(TYPE_INVALID, 0);
+				      l->tail = NULL;
+
+				R[A] = TVPTR(TYPE_LIST, l);
+				break;
+			}
+			case OP_CONSF: {
+				assert(TV_TYPE(R[A]) == TYPE_LIST);
+
+				List *l = (List *)&R[B];
+				      l->head = RK(C);
+				      l->tail = TV_LIST(R[A]);
+
+				R[A] = TVPTR(TYPE_LIST, l);
+				break;
+			}
+			case OP_PATH:
+				TV_PATHID(R[A])->module = TV_ATOM(RK(B));
+				TV_PATHID(R[A])->path   = TV_ATOM(RK(C));
+				break;
+			case OP_LOOP:
+				f->pc = c->code;
+				break;
+			case OP_TAILCALL: {
+				struct tvalue arg = RK(C);
 
-				s->frame->result = A;                    /* Set return-value register */
+				if (ISK(B))
+					vm_retail(vm, proc, &K[INDEXK(B)], &c->caches[f->pc - c->code - 1], &arg, 0);
+				else
+					vm_retail(vm, proc, &R[B], NULL, &arg, 0);
+				goto reentry;
+			}
+			case OP_TAILCALLN:
+				if (ISK(B))
+					vm_retail(vm, proc, &K[INDEXK(B)], &c->caches[f->pc - c->code - 1], &R[A], C);
+				else
+					vm_retail(vm, proc, &R[B], NULL, &R[A], C);
+				goto reentry;
+			case OP_CALLN:
+				if (ISK(B))
+					vm_invoke(vm, proc, &K[INDEXK(B)], &c->caches[f->pc - c->code - 1], &R[A], C, A);
+				else
+					vm_invoke(vm, proc, &R[B], NULL, &R[A], C, A);
+				goto reentry;
+			case OP_CALL: {
+				struct tvalue arg = RK(C);
 
+				if (ISK(B))
+					vm_invoke(vm, proc, &K[INDEXK(B)], &c->caches[f->pc - c->code - 1], &arg, 0, A);
+				else
+					vm_invoke(vm, proc, &R[B], NULL, &arg, 0, A);
 				goto reentry;
 			}
 			case OP_RETURN: {
-				struct frame *old = stack_pop(s);
+				struct tvalue *ret;
 
-				/* We reached the top of the stack,
-				 * exit loop & return last register value. */
-				if (s->depth == 0)
-					return &R[A];
+				if ((ret = vm_return(vm, proc, ISK(A) ? &K[INDEXK(A)] : &R[A], 0)))
+					return ret;
 
-				assert(s->frame->locals);
-				assert(old);
+				goto reentry;
+			}
+			case OP_RETURNN: {
+				struct tvalue *ret;
 
-				s->frame->locals[old->result] = RK(A);
+				if ((ret = vm_return(vm, proc, &R[A], C)))
+					return ret;
+
+				goto reentry;
+			}
+			case OP_UNPACK: {
+				struct tvalue a = R[A];
+
+				if (TV_TYPE(a) == TYPE_TUPLE && TV_TUPLE(a)->arity == C) {
+					memcpy(&R[A], TV_TUPLE(a)->members, sizeof(a) * C);
+					f->pc ++;
+				} else {
+					f->pc += iJ(*f->pc) + 1;
+				}
+				break;
+			}
+			case OP_RETK: {
+				struct tvalue *ret;
+
+				if ((ret = vm_return(vm, proc, &K[D], 0)))
+					return ret;
 
-				for (int i = 0; i < proc->stack->depth; i++)
-					debug(INDENT);
-				debug("%s/%s\n", s->frame->clause->path->module->name,
-								 s->frame->clause->path->name);
 				goto reentry;
 			}
 			default:
@@ -694,6 +1305,866 @@ reentry:
 	return NULL;
 }
 
+#undef RK
+#undef OP
+#undef A
+#undef B
+#undef C
+#undef D
+#undef J
+
+#if defined(VM_THREADED)
+
+/* Label addresses and computed `goto`s are GNU extensions, see `vm.h` */
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+
+/*
+ * Handler addresses of `vm_threaded`, by op-code and RK operand kind.
+ */
+static const void *(*VM_HANDLERS)[4] = NULL;
+
+/*
+ * Handlers of ops which haven't been quickened yet, see `vm_quicken`,
+ * and of ops which were compiled to native code, see `vm_native`.
+ */
+static const void *const *VM_SPECIAL = NULL;
+
+#define VM_QUICKEN  (VM_SPECIAL[0])
+#define VM_NATIVE   (VM_SPECIAL[1])
+
+/* RK operand kind of a decoded op */
+#define OPK(op) (((op)->b ? OPK_KR : 0) | ((op)->c ? OPK_RK : 0))
+
+/*
+ * Whether op-code `o` of decoded op `op` may be quickened. Only calls
+ * to constant callees are, as they are the only ones with a cache.
+ */
+static bool vm_quickens(OpCode o, Operation *op)
+{
+	switch (o) {
+		case OP_ADD:
+		case OP_SUB:
+		case OP_ADDI:
+		case OP_SUBI:
+		case OP_MATCH:
+		case OP_MATCHJ:
+			return true;
+		case OP_CALL:
+		case OP_CALLN:
+			return op->b != NULL;
+		default:
+			return false;
+	}
+}
+
+/*
+ * Decode the byte-code of clause `c` into `c->ops`,
+ * for the threaded dispatcher.
+ */
+static void vm_decode(VM *vm, struct clause *c)
+{
+	c->ops = malloc(sizeof(Operation) * c->codelen);
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		Instruction i  = c->code[n];
+		OpCode      o  = iOP(i);
+		Operation  *op = c->ops + n;
+		int         k  = OPK_RR;
+
+		op->a  = iA(i);
+		op->rb = iB(i);
+		op->rc = iC(i);
+		op->b  = NULL;
+		op->c  = NULL;
+		op->j  = 0;
+		op->imm = iSC(i);
+
+		switch (OPMODE(o)) {
+			case JBC:
+				op->j = op->a;
+				/* Fallthrough */
+			case ABC:
+				if (BMODE(o) == OPARG_K && ISK(op->rb)) {
+					op->b = c->constants + INDEXK(op->rb);
+					k |= OPK_KR;
+				}
+				if (CMODE(o) == OPARG_K && ISK(op->rc)) {
+					op->c = c->constants + INDEXK(op->rc);
+					k |= OPK_RK;
+				}
+				break;
+			case AD:
+				op->b = c->constants + iD(i);
+				break;
+			case AJ:
+				op->j = iJ(i);
+				break;
+		}
+
+		/* The operand of `return` is in `A` */
+		if (o == OP_RETURN && ISK(op->a)) {
+			op->b = c->constants + INDEXK(op->a);
+			k = OPK_KR;
+		}
+
+		/* Test instructions are followed by a jump, which
+		 * is taken if the test fails. */
+		if (TMODE(o) && n + 1 < c->codelen)
+			op->j = iJ(c->code[n + 1]);
+
+		op->handler = vm_quickens(o, op) ? VM_QUICKEN : VM_HANDLERS[o][k];
+	}
+}
+
+/*
+ * Quicken op `op` of clause `c`, the first time it is run, with
+ * registers `R`: pick the handler of a quickened op-code, if its
+ * operands are of the kind it is specialized for, else of the
+ * generic op-code. Returns the handler, which replaces that of
+ * `op` for good.
+ *
+ * Quickened handlers check that their operands are still of
+ * that kind, and if not, revert `op` to its generic handler.
+ */
+static const void *vm_quicken(VM *vm, struct clause *c, Operation *op, struct tvalue *R)
+{
+	unsigned long  n  = op - c->ops;
+	OpCode         o  = iOP(c->code[n]),
+	               q  = OP_INVALID;
+	struct tvalue *vb = op->b ? op->b : &R[op->rb],
+	              *vc = op->c ? op->c : &R[op->rc];
+
+	switch (o) {
+		case OP_ADD:
+		case OP_SUB:
+			if (TV_TYPE(*vb) == TYPE_NUMBER && TV_TYPE(*vc) == TYPE_NUMBER)
+				q = o == OP_ADD ? OP_ADDQ : OP_SUBQ;
+			break;
+		case OP_ADDI:
+		case OP_SUBI:
+			if (TV_TYPE(*vb) == TYPE_NUMBER)
+				q = o == OP_ADDI ? OP_ADDIQ : OP_SUBIQ;
+			break;
+		case OP_MATCH:
+		case OP_MATCHJ:
+			if (TV_TYPE(*vb) == TYPE_ATOM)
+				q = o == OP_MATCH ? OP_MATCHATOM : OP_MATCHJATOM;
+			break;
+		case OP_CALL:
+		case OP_CALLN: {
+			struct callcache *cache = &c->caches[n];
+			struct path      *p;
+
+			if (TV_TAG(*vb) == TYPE_CLAUSE)
+				break;
+
+			/* Resolve the callee once, and keep it in the inline
+			 * cache of the call site, along with the version of
+			 * its module, which the quickened op checks. */
+			if ((p = vm_resolve(vm, vb, cache))->nclauses == 1) {
+				cache->path    = p;
+				cache->version = p->module->version;
+
+				q = o == OP_CALL ? OP_CALLDIRECT : OP_CALLNDIRECT;
+			}
+			break;
+		}
+		default:
+			assert(0);
+	}
+
+	if (q == OP_INVALID)
+		return VM_HANDLERS[o][OPK(op)];
+
+	vm->quickened[q] ++;
+
+	return VM_HANDLERS[q][OPK(op)];
+}
+
+/*
+ * Run clause `c` as native code `native`: have the dispatcher
+ * enter it at every op which was compiled.
+ */
+void vm_native(VM *vm, struct clause *c, struct native *native)
+{
+	assert(c->ops);
+
+	c->native = native;
+
+	for (unsigned long n = 0; n < c->codelen; n++) {
+		if (native->compiled[n])
+			c->ops[n].handler = VM_NATIVE;
+	}
+}
+
+#if defined(VM_JIT)
+/*
+ * Compile clause `c` to native code, once it is hot.
+ */
+static void vm_jit(VM *vm, struct clause *c)
+{
+	struct native *native;
+
+	if (! c->ops || c->native || ! (native = jit_compile(c)))
+		return;
+
+	vm_native(vm, c, native);
+	vm->njit ++;
+}
+#endif
+
+/*
+ * Run `proc` over pre-decoded instructions, jumping from
+ * handler to handler with computed gotos.
+ */
+static struct tvalue *vm_threaded(VM *vm, Process *proc)
+{
+	#define SAME(h)       { &&h, &&h, &&h, &&h }
+	#define VARIANTS(h)   { &&h##_RR, &&h##_RK, &&h##_KR, &&h##_KK }
+	#define VARIANTS_B(h) { &&h##_R,  &&h##_R,  &&h##_K,  &&h##_K  }
+
+	static const void *handlers[][4] = {
+		[OP_INVALID]  = SAME(INVALID),
+		[OP_MOVE]     = SAME(MOVE),
+		[OP_LOADK]    = SAME(LOADK),
+		[OP_ADD]      = VARIANTS(ADD),
+		[OP_SUB]      = VARIANTS(SUB),
+		[OP_GT]       = VARIANTS(GT),
+		[OP_EQ]       = VARIANTS(EQ),
+		[OP_JUMP]     = SAME(JUMP),
+		[OP_RETURN]   = { &&RETURN_R, &&RETURN_R, &&RETURN_K, &&RETURN_K },
+		[OP_MATCH]    = SAME(MATCH),
+		[OP_TUPLE]    = SAME(TUPLE),
+		[OP_SETTUPLE] = SAME(SETTUPLE),
+		[OP_LIST]     = SAME(LIST),
+		[OP_CONS]     = SAME(CONS),
+		[OP_CALL]     = SAME(CALL),
+		[OP_TAILCALL] = SAME(TAILCALL),
+		[OP_SEND]     = SAME(INVALID),
+		[OP_LAMBDA]   = SAME(INVALID),
+		[OP_PATH]     = SAME(PATH),
+		[OP_EQJ]      = VARIANTS(EQJ),
+		[OP_GTJ]      = VARIANTS(GTJ),
+		[OP_MATCHJ]   = SAME(MATCHJ),
+		[OP_RETK]     = SAME(RETURN_K),
+		[OP_ADDI]     = VARIANTS_B(ADDI),
+		[OP_SUBI]     = VARIANTS_B(SUBI),
+		[OP_EQI]      = VARIANTS_B(EQI),
+		[OP_GTI]      = VARIANTS_B(GTI),
+		[OP_LTI]      = VARIANTS_B(LTI),
+		[OP_EQIJ]     = VARIANTS_B(EQIJ),
+		[OP_GTIJ]     = VARIANTS_B(GTIJ),
+		[OP_LTIJ]     = VARIANTS_B(LTIJ),
+		[OP_SWITCH]   = SAME(SWITCH),
+		[OP_SWITCHK]  = SAME(SWITCHK),
+		[OP_TESTT]    = SAME(TESTT),
+		[OP_TESTL]    = SAME(TESTL),
+		[OP_EQV]      = VARIANTS(EQV),
+		[OP_GETT]     = SAME(GETT),
+		[OP_HEAD]     = SAME(HEAD),
+		[OP_TAIL]     = SAME(TAIL),
+		[OP_LOOP]     = SAME(LOOP),
+		[OP_CALLN]    = SAME(CALLN),
+		[OP_TAILCALLN] = SAME(TAILCALLN),
+		[OP_UNPACK]   = SAME(UNPACK),
+		[OP_RETURNN]  = SAME(RETURNN),
+		[OP_ADDNN]    = VARIANTS(ADDNN),
+		[OP_SUBNN]    = VARIANTS(SUBNN),
+		[OP_ADDINN]   = VARIANTS_B(ADDINN),
+		[OP_SUBINN]   = VARIANTS_B(SUBINN),
+		[OP_GTNN]     = VARIANTS(GTNN),
+		[OP_GTJNN]    = VARIANTS(GTJNN),
+		[OP_GTINN]    = VARIANTS_B(GTINN),
+		[OP_LTINN]    = VARIANTS_B(LTINN),
+		[OP_GTIJNN]   = VARIANTS_B(GTIJNN),
+		[OP_LTIJNN]   = VARIANTS_B(LTIJNN),
+		[OP_TUPLEF]   = SAME(TUPLEF),
+		[OP_LISTF]    = SAME(LISTF),
+		[OP_CONSF]    = SAME(CONSF),
+		[OP_ADDQ]     = VARIANTS(ADDQ),
+		[OP_SUBQ]     = VARIANTS(SUBQ),
+		[OP_ADDIQ]    = VARIANTS_B(ADDIQ),
+		[OP_SUBIQ]    = VARIANTS_B(SUBIQ),
+		[OP_MATCHATOM]  = VARIANTS(MATCHATOM),
+		[OP_MATCHJATOM] = VARIANTS(MATCHJATOM),
+		[OP_CALLDIRECT]  = SAME(CALLDIRECT),
+		[OP_CALLNDIRECT] = SAME(CALLNDIRECT)
+	};
+	static const void *special[] = { &&QUICKEN, &&NATIVE };
+
+	#undef SAME
+	#undef VARIANTS
+	#undef VARIANTS_B
+
+	if (proc == NULL) { /* Export handler table */
+		VM_HANDLERS = handlers;
+		VM_SPECIAL  = special;
+		return NULL;
+	}
+
+	struct clause *c;
+
+	struct stack *s;
+	struct frame *f;
+
+	Operation *ip;
+
+	struct tvalue *R;
+
+/* Operands, as register or constant */
+#define RB   (ip->b ? ip->b : &R[ip->rb])
+#define RC   (ip->c ? ip->c : &R[ip->rc])
+
+/* Save the program counter to the current frame */
+#define SAVEPC()  (f->pc = c->code + (ip - c->ops) + 1)
+
+#if defined(DEBUG)
+#define TRACE() \
+	do { \
+		for (int i = 0; i < proc->stack->depth; i++) \
+			debug(INDENT); \
+		printf("%3ld:\t", (long)(ip - c->ops)); \
+		op_pp(c->code[ip - c->ops]); putchar('\n'); \
+	} while (0)
+#else
+#define TRACE()
+#endif
+
+#define DISPATCH() \
+	do { \
+		TRACE(); \
+		goto *ip->handler; \
+	} while (0)
+
+#define NEXT() \
+	do { \
+		ip ++; \
+		if (-- proc->credits == 0) goto yield; \
+		DISPATCH(); \
+	} while (0)
+
+/* Skip the following jump if `cond` holds, else take it */
+#define TEST(cond) \
+	do { \
+		ip += (cond) ? 2 : 2 + ip->j; \
+		if (-- proc->credits == 0) goto yield; \
+		DISPATCH(); \
+	} while (0)
+
+/* Skip `ip->j` instructions unless `cond` holds */
+#define TESTJ(cond) \
+	do { \
+		ip += (cond) ? 1 : 1 + ip->j; \
+		if (-- proc->credits == 0) goto yield; \
+		DISPATCH(); \
+	} while (0)
+
+/* Revert quickened op `q` to generic op `o`, and run it */
+#define DEOPT(q, o) \
+	do { \
+		vm->deopts[q] ++; \
+		ip->handler = VM_HANDLERS[o][OPK(ip)]; \
+		DISPATCH(); \
+	} while (0)
+
+/* Generate one handler per RK operand kind */
+#define HANDLERS(h, ...) \
+	h##_RR: { struct tvalue *vb = &R[ip->rb], *vc = &R[ip->rc]; __VA_ARGS__ } \
+	h##_RK: { struct tvalue *vb = &R[ip->rb], *vc = ip->c;      __VA_ARGS__ } \
+	h##_KR: { struct tvalue *vb = ip->b,      *vc = &R[ip->rc]; __VA_ARGS__ } \
+	h##_KK: { struct tvalue *vb = ip->b,      *vc = ip->c;      __VA_ARGS__ }
+
+/* Generate one handler per kind of `B`, for ops with an immediate `C` */
+#define HANDLERS_B(h, ...) \
+	h##_R: { struct tvalue *vb = &R[ip->rb]; __VA_ARGS__ } \
+	h##_K: { struct tvalue *vb = ip->b;      __VA_ARGS__ }
+
+reentry:
+
+	vm->proc = proc;
+
+	s  = proc->stack;                     /* Current stack */
+	f  = s->frame;                        /* Current stack-frame */
+	c  = f->clause;                       /* Current clause */
+	R  = f->locals;                       /* Registry (local vars) */
+	ip = c->ops + (f->pc - c->code);      /* Current instruction */
+
+	DISPATCH();
+
+MOVE:
+	R[ip->a] = R[ip->rb];
+	NEXT();
+
+LOADK:
+	R[ip->a] = *ip->b;
+	NEXT();
+
+HANDLERS(ADD,
+	CHECKNUM(*vb, OP_ADD);
+	CHECKNUM(*vc, OP_ADD);
+
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) + TV_NUMBER(*vc));
+	NEXT();
+)
+
+HANDLERS(SUB,
+	CHECKNUM(*vb, OP_SUB);
+	CHECKNUM(*vc, OP_SUB);
+
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) - TV_NUMBER(*vc));
+	NEXT();
+)
+
+HANDLERS(GT,
+	CHECKNUM(*vb, OP_GT);
+	CHECKNUM(*vc, OP_GT);
+
+	TEST(TV_NUMBER(*vb) > TV_NUMBER(*vc));
+)
+
+HANDLERS(EQ,
+	TEST(vb->word == vc->word);
+)
+
+HANDLERS(EQJ,
+	TESTJ(vb->word == vc->word);
+)
+
+HANDLERS(GTJ,
+	CHECKNUM(*vb, OP_GTJ);
+	CHECKNUM(*vc, OP_GTJ);
+
+	TESTJ(TV_NUMBER(*vb) > TV_NUMBER(*vc));
+)
+
+HANDLERS_B(ADDI,
+	CHECKNUM(*vb, OP_ADDI);
+
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) + ip->imm);
+	NEXT();
+)
+
+HANDLERS_B(SUBI,
+	CHECKNUM(*vb, OP_SUBI);
+
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) - ip->imm);
+	NEXT();
+)
+
+HANDLERS_B(EQI,
+	TEST(TV_TYPE(*vb) == TYPE_NUMBER && TV_NUMBER(*vb) == ip->imm);
+)
+
+HANDLERS_B(GTI,
+	CHECKNUM(*vb, OP_GTI);
+
+	TEST(TV_NUMBER(*vb) > ip->imm);
+)
+
+HANDLERS_B(LTI,
+	CHECKNUM(*vb, OP_LTI);
+
+	TEST(TV_NUMBER(*vb) < ip->imm);
+)
+
+HANDLERS_B(EQIJ,
+	TESTJ(TV_TYPE(*vb) == TYPE_NUMBER && TV_NUMBER(*vb) == ip->imm);
+)
+
+HANDLERS_B(GTIJ,
+	CHECKNUM(*vb, OP_GTIJ);
+
+	TESTJ(TV_NUMBER(*vb) > ip->imm);
+)
+
+HANDLERS_B(LTIJ,
+	CHECKNUM(*vb, OP_LTIJ);
+
+	TESTJ(TV_NUMBER(*vb) < ip->imm);
+)
+
+/* Unchecked variants, see `OP_ADDNN` */
+HANDLERS(ADDNN,
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) + TV_NUMBER(*vc));
+	NEXT();
+)
+
+HANDLERS(SUBNN,
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) - TV_NUMBER(*vc));
+	NEXT();
+)
+
+HANDLERS_B(ADDINN,
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) + ip->imm);
+	NEXT();
+)
+
+HANDLERS_B(SUBINN,
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) - ip->imm);
+	NEXT();
+)
+
+HANDLERS(GTNN,
+	TEST(TV_NUMBER(*vb) > TV_NUMBER(*vc));
+)
+
+HANDLERS(GTJNN,
+	TESTJ(TV_NUMBER(*vb) > TV_NUMBER(*vc));
+)
+
+HANDLERS_B(GTINN,
+	TEST(TV_NUMBER(*vb) > ip->imm);
+)
+
+HANDLERS_B(LTINN,
+	TEST(TV_NUMBER(*vb) < ip->imm);
+)
+
+HANDLERS_B(GTIJNN,
+	TESTJ(TV_NUMBER(*vb) > ip->imm);
+)
+
+HANDLERS_B(LTIJNN,
+	TESTJ(TV_NUMBER(*vb) < ip->imm);
+)
+
+/* Quickened variants, see `vm_quicken` */
+QUICKEN:
+	ip->handler = vm_quicken(vm, c, ip, R);
+	DISPATCH();
+
+HANDLERS(ADDQ,
+	if (TV_TYPE(*vb) != TYPE_NUMBER || TV_TYPE(*vc) != TYPE_NUMBER)
+		DEOPT(OP_ADDQ, OP_ADD);
+
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) + TV_NUMBER(*vc));
+	NEXT();
+)
+
+HANDLERS(SUBQ,
+	if (TV_TYPE(*vb) != TYPE_NUMBER || TV_TYPE(*vc) != TYPE_NUMBER)
+		DEOPT(OP_SUBQ, OP_SUB);
+
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) - TV_NUMBER(*vc));
+	NEXT();
+)
+
+HANDLERS_B(ADDIQ,
+	if (TV_TYPE(*vb) != TYPE_NUMBER)
+		DEOPT(OP_ADDIQ, OP_ADDI);
+
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) + ip->imm);
+	NEXT();
+)
+
+HANDLERS_B(SUBIQ,
+	if (TV_TYPE(*vb) != TYPE_NUMBER)
+		DEOPT(OP_SUBIQ, OP_SUBI);
+
+	R[ip->a] = TVNUMBER(TV_NUMBER(*vb) - ip->imm);
+	NEXT();
+)
+
+/* An atom pattern matches only the same atom, and binds nothing */
+HANDLERS(MATCHATOM,
+	if (TV_TYPE(*vb) != TYPE_ATOM)
+		DEOPT(OP_MATCHATOM, OP_MATCH);
+
+	TEST(vb->word == vc->word);
+)
+
+HANDLERS(MATCHJATOM,
+	if (TV_TYPE(*vb) != TYPE_ATOM)
+		DEOPT(OP_MATCHJATOM, OP_MATCHJ);
+
+	TESTJ(vb->word == vc->word);
+)
+
+/* Run native code, from this op up to the next op it doesn't compile */
+NATIVE: {
+	unsigned long n = c->native->code(R, c->constants, &proc->credits, ip - c->ops);
+
+	ip = c->ops + (n >> 1);
+
+	/* The operands of the op weren't numbers: let its generic
+	 * handler report the error. */
+	if (n & 1)
+		goto *VM_HANDLERS[iOP(c->code[n >> 1])][OPK(ip)];
+
+	if (proc->credits == 0) goto yield;
+	DISPATCH();
+}
+
+CALLDIRECT: {
+	struct callcache *cache = &c->caches[ip - c->ops];
+	struct tvalue     arg   = *RC;
+
+	if (cache->path->module->version != cache->version)
+		DEOPT(OP_CALLDIRECT, OP_CALL);
+
+	SAVEPC();
+	if (vm_call(vm, proc, cache->path->clauses[0], &arg, 0) < 0)
+		error(1, 0, "no matches for %s/%s", cache->path->module->name, cache->path->name);
+
+	proc->stack->frame->result = ip->a;
+	goto reentry;
+}
+
+CALLNDIRECT: {
+	struct callcache *cache = &c->caches[ip - c->ops];
+
+	if (cache->path->module->version != cache->version)
+		DEOPT(OP_CALLNDIRECT, OP_CALLN);
+
+	SAVEPC();
+	if (vm_call(vm, proc, cache->path->clauses[0], &R[ip->a], ip->rc) < 0)
+		error(1, 0, "no matches for %s/%s", cache->path->module->name, cache->path->name);
+
+	proc->stack->frame->result = ip->a;
+	goto reentry;
+}
+
+JUMP:
+	ip += ip->j + 1;
+	if (-- proc->credits == 0) goto yield;
+	DISPATCH();
+
+SWITCH: {
+	long e = (long)TV_NUMBER(R[ip->a]) - TV_NUMBER(*RB);
+
+	if (TV_TYPE(R[ip->a]) != TYPE_NUMBER || e < 0 || e >= ip->rc)
+		e = ip->rc;
+
+	ip += 2 + e + ip[1 + e].j;
+	if (-- proc->credits == 0) goto yield;
+	DISPATCH();
+}
+
+SWITCHK: {
+	Instruction *t = c->code + (ip - c->ops) + 1; /* Jump table */
+	int          e = vm_searchk(c->constants, t, ip->rc, R[ip->a]);
+
+	ip += 2 + e + ip[1 + e].j;
+	if (-- proc->credits == 0) goto yield;
+	DISPATCH();
+}
+
+MATCH: {
+	struct tvalue vb = *RB,
+	              vc = *RC;
+
+	TEST(match(R, &vb, &vc, &R[ip->a + 1]) >= 0);
+}
+
+MATCHJ: {
+	struct tvalue vb = *RB,
+	              vc = *RC;
+
+	TESTJ(match(R, &vb, &vc, NULL) >= 0);
+}
+
+TESTT: {
+	struct tvalue vb = R[ip->rb];
+
+	TEST(TV_TYPE(vb) == TYPE_TUPLE && TV_TUPLE(vb)->arity == ip->rc);
+}
+
+TESTL: {
+	struct tvalue vb = R[ip->rb];
+
+	TEST(TV_TYPE(vb) == TYPE_LIST &&
+	    (ip->rc == 2 || ! LIST_ISEMPTY(TV_LIST(vb)) == ip->rc));
+}
+
+HANDLERS(EQV,
+	TEST(vb->word == vc->word);
+)
+
+GETT:
+	assert(TV_TYPE(R[ip->rb]) == TYPE_TUPLE);
+	assert(ip->rc < TV_TUPLE(R[ip->rb])->arity);
+
+	R[ip->a] = TV_TUPLE(R[ip->rb])->members[ip->rc];
+	NEXT();
+
+HEAD:
+	assert(TV_TYPE(R[ip->rb]) == TYPE_LIST);
+
+	R[ip->a] = TV_LIST(R[ip->rb])->head;
+	NEXT();
+
+TAIL:
+	assert(TV_TYPE(R[ip->rb]) == TYPE_LIST);
+
+	R[ip->a] = TVPTR(TYPE_LIST, TV_LIST(R[ip->rb])->tail);
+	NEXT();
+
+TUPLE:
+	R[ip->a] = *tuple(ip->rb);
+	NEXT();
+
+SETTUPLE:
+	assert(TV_TYPE(R[ip->a]) == TYPE_TUPLE);
+	assert(ip->rb < TV_TUPLE(R[ip->a])->arity);
+
+	TV_TUPLE(R[ip->a])->members[ip->rb] = *RC;
+	NEXT();
+
+LIST:
+	R[ip->a] = TVPTR(TYPE_LIST, list());
+	NEXT();
+
+CONS: {
+	assert(TV_TYPE(R[ip->rb]) == TYPE_LIST);
+
+	List *l = list_cons(TV_LIST(R[ip->rb]), *RC);
+	R[ip->a] = TVPTR(TYPE_LIST, l);
+	NEXT();
+}
+
+TUPLEF: {
+	Tuple *t = (Tuple *)&R[ip->rc];
+	       t->arity = ip->rb;
+
+	R[ip->a] = TVPTR(TYPE_TUPLE, t);
+	NEXT();
+}
+
+LISTF: {
+	List *l = (List *)&R[ip->rc];
+	      l->head = TV(TYPE_INVALID, 0);
+	      l->tail = NULL;
+
+	R[ip->a] = TVPTR(TYPE_LIST, l);
+	NEXT();
+}
+
+CONSF: {
+	assert(TV_TYPE(R[ip->a]) == TYPE_LIST);
+
+	List *l = (List *)&R[ip->rb];
+	      l->head = *RC;
+	      l->tail = TV_LIST(R[ip->a]);
+
+	R[ip->a] = TVPTR(TYPE_LIST, l);
+	NEXT();
+}
+
+PATH:
+	TV_PATHID(R[ip->a])->module = TV_ATOM(*RB);
+	TV_PATHID(R[ip->a])->path   = TV_ATOM(*RC);
+	NEXT();
+
+LOOP:
+	ip = c->ops;
+	JITCOUNT(vm, c);
+	if (-- proc->credits == 0) goto yield;
+	DISPATCH();
+
+TAILCALL: {
+	struct tvalue arg = *RC;
+
+	vm_retail(vm, proc, RB, ip->b ? &c->caches[ip - c->ops] : NULL, &arg, 0);
+	goto reentry;
+}
+
+TAILCALLN:
+	vm_retail(vm, proc, RB, ip->b ? &c->caches[ip - c->ops] : NULL, &R[ip->a], ip->rc);
+	goto reentry;
+
+CALLN:
+	SAVEPC();
+	vm_invoke(vm, proc, RB, ip->b ? &c->caches[ip - c->ops] : NULL, &R[ip->a], ip->rc, ip->a);
+	goto reentry;
+
+CALL: {
+	struct tvalue arg = *RC;
+
+	SAVEPC();
+	vm_invoke(vm, proc, RB, ip->b ? &c->caches[ip - c->ops] : NULL, &arg, 0, ip->a);
+	goto reentry;
+}
+
+RETURN_R: {
+	struct tvalue *ret;
+
+	if ((ret = vm_return(vm, proc, &R[ip->a], 0)))
+		return ret;
+
+	goto reentry;
+}
+
+RETURN_K: {
+	struct tvalue *ret;
+
+	if ((ret = vm_return(vm, proc, ip->b, 0)))
+		return ret;
+
+	goto reentry;
+}
+
+RETURNN: {
+	struct tvalue *ret;
+
+	if ((ret = vm_return(vm, proc, &R[ip->a], ip->rc)))
+		return ret;
+
+	goto reentry;
+}
+
+UNPACK: {
+	struct tvalue va = R[ip->a];
+	bool          ok = TV_TYPE(va) == TYPE_TUPLE && TV_TUPLE(va)->arity == ip->rc;
+
+	if (ok)
+		memcpy(&R[ip->a], TV_TUPLE(va)->members, sizeof(va) * ip->rc);
+
+	TEST(ok);
+}
+
+yield: {
+	Process *np;
+
+	f->pc = c->code + (ip - c->ops);
+
+	if ((np = vm_select(vm))) {
+		proc = np;
+		goto reentry;
+	}
+	proc->credits = 96;
+	DISPATCH();
+}
+
+INVALID:
+	assert(0);
+	return NULL;
+
+#undef RB
+#undef RC
+#undef SAVEPC
+#undef TRACE
+#undef DISPATCH
+#undef NEXT
+#undef TEST
+#undef TESTJ
+#undef DEOPT
+#undef HANDLERS
+#undef HANDLERS_B
+}
+
+#pragma GCC diagnostic pop
+
+#endif
+
+struct tvalue *vm_execute(VM *vm, Process *proc)
+{
+#if defined(VM_THREADED)
+	if (vm->dispatch == DISPATCH_THREADED)
+		return vm_threaded(vm, proc);
+#endif
+	return vm_switch(vm, proc);
+}
 struct tvalue *vm_run(VM *vm, const char *module, const char *path)
 {
 	struct module *m = vm_module(vm, module);
@@ -708,11 +2179,29 @@ struct tvalue *vm_run(VM *vm, const char *module, const char *path)
 
 	Process *proc = vm_spawn(vm, m, p);
 
-	vm_call(vm, proc, p->clauses[0], NULL);
+	if (vm_callpath(vm, proc, p, NULL, 0) < 0)
+		error(2, 0, "no matches for %s/%s", module, path);
 
 	return vm_execute(vm, proc);
 }
 
+/*
+ * Print the run-time statistics of `vm` to `out`: how its call
+ * sites were resolved, and which ops were quickened and reverted.
+ */
+void vm_stats(VM *vm, FILE *out)
+{
+	fprintf(out, "icache: %lu hit(s), %lu miss(es)\n",
+	        vm->icache_hits, vm->icache_misses);
+	fprintf(out, "jit: %lu clause(s) compiled\n", vm->njit);
+
+	for (OpCode o = 0; o < OPCODE_MAX; o++) {
+		if (vm->quickened[o] || vm->deopts[o])
+			fprintf(out, "%-12s %lu quickened, %lu deopt(s)\n",
+			        OPCODE_STRINGS[o], vm->quickened[o], vm->deopts[o]);
+	}
+}
+
 struct module *vm_module(VM *vm, const char *name)
 {
 	uint32_t key = hash(name, strlen(name)) % 512;
@@ -6,12 +6,33 @@
  * vm.h
  *
  */
+/*
+ * Computed `goto` is a GNU extension, which the threaded
+ * dispatcher relies on.
+ */
+#if defined(__GNUC__)
+#define VM_THREADED
+#endif
+
+typedef enum {
+	DISPATCH_THREADED,
+	DISPATCH_SWITCH
+} Dispatch;
+
 typedef struct {
 	unsigned long       pc;
+	Dispatch            dispatch;
 	struct clause      *clause;
 	Process           **procs;
 	Process            *proc;
 	unsigned           nprocs;
+	struct segpool     segments;       /* Free stack segments of `procs` */
+	bool               jit;            /* Compile hot clauses, see `jit.c` */
+	unsigned long      njit;           /* Clauses compiled */
+	unsigned long      icache_hits;    /* Call sites resolved from their inline cache */
+	unsigned long      icache_misses;  /* Call sites resolved by name */
+	unsigned long      quickened[OPCODE_MAX];  /* Ops quickened, by quickened op-code */
+	unsigned long      deopts[OPCODE_MAX];     /* Quickened ops reverted, by op-code */
 	struct modulelist  *modules[];
 } VM;
 
@@ -21,7 +42,14 @@ struct version {
 	uint8_t patch;
 };
 
-VM            *vm       (void);
-void           vm_load  (VM *vm, const char *module, struct path *paths[]);
-void           vm_open  (VM *vm, const char *module, uint8_t *code);
-struct tvalue *vm_run   (VM *vm, const char *module, const char *path);
+VM            *vm         (void);
+void           vm_load    (VM *vm, const char *module, struct path *paths[]);
+void           vm_open    (VM *vm, const char *module, uint8_t *code);
+void           vm_link    (VM *vm);
+struct tvalue *vm_run     (VM *vm, const char *module, const char *path);
+void           vm_stats   (VM *vm, FILE *out);
+struct module *vm_module  (VM *vm, const char *name);
+Process       *vm_spawn   (VM *vm, struct module *m, struct path *p);
+int            vm_callpath(VM *vm, Process *proc, struct path *p, struct tvalue *arg, int nargs);
+struct tvalue *vm_execute (VM *vm, Process *proc);
+void           vm_badarg  (OpCode o);